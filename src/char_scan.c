@@ -0,0 +1,298 @@
+#include "char_scan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    size_t (*identifier_run)(const char *data, size_t size);
+    size_t (*whitespace_run)(const char *data, size_t size);
+    size_t (*comment_end)(const char *data, size_t size);
+    size_t (*newline)(const char *data, size_t size);
+    size_t (*newline_count)(const char *data, size_t size);
+} char_scan_kernels;
+
+// Scalar kernels
+// --------------
+
+static bool is_identifier_char(const char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') ||
+            c == '_';
+}
+
+static bool is_blank_char(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static size_t identifier_run_scalar(const char *data, size_t size) {
+    size_t i = 0;
+    while (i < size && is_identifier_char(data[i])) i++;
+    return i;
+}
+
+static size_t whitespace_run_scalar(const char *data, size_t size) {
+    size_t i = 0;
+    while (i < size && is_blank_char(data[i])) i++;
+    return i;
+}
+
+static size_t comment_end_scalar(const char *data, size_t size) {
+    for (size_t i = 0; i + 1 < size; i++) {
+        if (data[i] == '*' && data[i + 1] == '/') return i;
+    }
+    return size;
+}
+
+static size_t newline_scalar(const char *data, size_t size) {
+    size_t i = 0;
+    while (i < size && data[i] != '\n') i++;
+    return i;
+}
+
+static size_t newline_count_scalar(const char *data, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) count += (data[i] == '\n');
+    return count;
+}
+
+static const char_scan_kernels scalar_kernels = {
+    identifier_run_scalar, whitespace_run_scalar, comment_end_scalar, newline_scalar, newline_count_scalar
+};
+// --------------
+
+#if defined(__x86_64__)
+
+// Byte-wise c >= lo && c <= hi, using a signed compare after shifting lo down to -128
+#define SSE2_IN_RANGE(v, lo, hi) \
+    _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char) (128 - (lo)))), _mm_set1_epi8((char) (-128 + (hi) - (lo) + 1)))
+
+#define AVX2_IN_RANGE(v, lo, hi) \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char) (-128 + (hi) - (lo) + 1)), \
+                      _mm256_add_epi8(v, _mm256_set1_epi8((char) (128 - (lo)))))
+
+// SSE2 kernels, 16 bytes at a time
+// --------------------------------
+
+static __m128i sse2_identifier_mask(__m128i v) {
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+    return _mm_or_si128(_mm_or_si128(SSE2_IN_RANGE(lower, 'a', 'z'), SSE2_IN_RANGE(v, '0', '9')),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static __m128i sse2_blank_mask(__m128i v) {
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+}
+
+static size_t identifier_run_sse2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) &data[i]);
+        const uint32_t mismatch = (uint32_t) _mm_movemask_epi8(sse2_identifier_mask(v)) ^ 0xFFFFu;
+
+        if (mismatch) return i + (size_t) __builtin_ctz(mismatch);
+    }
+
+    return i + identifier_run_scalar(&data[i], size - i);
+}
+
+static size_t whitespace_run_sse2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) &data[i]);
+        const uint32_t mismatch = (uint32_t) _mm_movemask_epi8(sse2_blank_mask(v)) ^ 0xFFFFu;
+
+        if (mismatch) return i + (size_t) __builtin_ctz(mismatch);
+    }
+
+    return i + whitespace_run_scalar(&data[i], size - i);
+}
+
+static size_t comment_end_sse2(const char *data, size_t size) {
+    size_t i = 0;
+
+    // Compare the block against '*' and the block one byte on against '/'
+    for (; i + 17 <= size; i += 16) {
+        const __m128i stars = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &data[i]), _mm_set1_epi8('*'));
+        const __m128i slashes = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &data[i + 1]), _mm_set1_epi8('/'));
+        const uint32_t match = (uint32_t) _mm_movemask_epi8(_mm_and_si128(stars, slashes));
+
+        if (match) return i + (size_t) __builtin_ctz(match);
+    }
+
+    return i + comment_end_scalar(&data[i], size - i);
+}
+
+static size_t newline_sse2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) &data[i]);
+        const uint32_t match = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+        if (match) return i + (size_t) __builtin_ctz(match);
+    }
+
+    return i + newline_scalar(&data[i], size - i);
+}
+
+static size_t newline_count_sse2(const char *data, size_t size) {
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) &data[i]);
+        count += (size_t) __builtin_popcount((unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    }
+
+    return count + newline_count_scalar(&data[i], size - i);
+}
+
+static const char_scan_kernels sse2_kernels = {
+    identifier_run_sse2, whitespace_run_sse2, comment_end_sse2, newline_sse2, newline_count_sse2
+};
+// --------------------------------
+
+// AVX2 kernels, 32 bytes at a time
+// --------------------------------
+
+__attribute__((target("avx2")))
+static __m256i avx2_identifier_mask(__m256i v) {
+    const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+    return _mm256_or_si256(_mm256_or_si256(AVX2_IN_RANGE(lower, 'a', 'z'), AVX2_IN_RANGE(v, '0', '9')),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_blank_mask(__m256i v) {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+}
+
+__attribute__((target("avx2")))
+static size_t identifier_run_avx2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) &data[i]);
+        const uint32_t mismatch = ~(uint32_t) _mm256_movemask_epi8(avx2_identifier_mask(v));
+
+        if (mismatch) return i + (size_t) __builtin_ctz(mismatch);
+    }
+
+    return i + identifier_run_sse2(&data[i], size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t whitespace_run_avx2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) &data[i]);
+        const uint32_t mismatch = ~(uint32_t) _mm256_movemask_epi8(avx2_blank_mask(v));
+
+        if (mismatch) return i + (size_t) __builtin_ctz(mismatch);
+    }
+
+    return i + whitespace_run_sse2(&data[i], size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t comment_end_avx2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 33 <= size; i += 32) {
+        const __m256i stars = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &data[i]),
+                                                _mm256_set1_epi8('*'));
+        const __m256i slashes = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &data[i + 1]),
+                                                  _mm256_set1_epi8('/'));
+        const uint32_t match = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(stars, slashes));
+
+        if (match) return i + (size_t) __builtin_ctz(match);
+    }
+
+    return i + comment_end_sse2(&data[i], size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t newline_avx2(const char *data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) &data[i]);
+        const uint32_t match = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+        if (match) return i + (size_t) __builtin_ctz(match);
+    }
+
+    return i + newline_sse2(&data[i], size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t newline_count_avx2(const char *data, size_t size) {
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) &data[i]);
+        count += (size_t) __builtin_popcount((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+    }
+
+    return count + newline_count_sse2(&data[i], size - i);
+}
+
+static const char_scan_kernels avx2_kernels = {
+    identifier_run_avx2, whitespace_run_avx2, comment_end_avx2, newline_avx2, newline_count_avx2
+};
+// --------------------------------
+
+#endif
+
+// Scalar until init_char_scan() has checked what the CPU supports
+static char_scan_kernels kernels = {
+    identifier_run_scalar, whitespace_run_scalar, comment_end_scalar, newline_scalar, newline_count_scalar
+};
+
+void init_char_scan(void) {
+    kernels = scalar_kernels;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = avx2_kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = sse2_kernels;
+    }
+#endif
+}
+
+size_t scan_identifier_run(const char *data, size_t size) {
+    return kernels.identifier_run(data, size);
+}
+
+size_t scan_whitespace_run(const char *data, size_t size) {
+    return kernels.whitespace_run(data, size);
+}
+
+size_t find_comment_end(const char *data, size_t size) {
+    return kernels.comment_end(data, size);
+}
+
+size_t find_newline(const char *data, size_t size) {
+    return kernels.newline(data, size);
+}
+
+size_t count_newlines(const char *data, size_t size) {
+    return kernels.newline_count(data, size);
+}
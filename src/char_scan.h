@@ -0,0 +1,25 @@
+#ifndef CHAR_SCAN_H
+#define CHAR_SCAN_H
+
+#include <stddef.h>
+
+// Bulk character scanning used by the lexer's hot loops.
+// Each function looks at no more than size bytes from data.
+
+void init_char_scan(void);
+
+// Number of bytes from data that are identifier characters ([A-Za-z0-9_])
+size_t scan_identifier_run(const char *data, size_t size);
+
+// Number of bytes from data that are whitespace other than newlines (' ', '\t', '\r')
+size_t scan_whitespace_run(const char *data, size_t size);
+
+// Index of the '*' of the first "*/" in data, or size if there isn't one
+size_t find_comment_end(const char *data, size_t size);
+
+// Index of the first '\n' in data, or size if there isn't one
+size_t find_newline(const char *data, size_t size);
+
+size_t count_newlines(const char *data, size_t size);
+
+#endif // CHAR_SCAN_H
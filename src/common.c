@@ -1,7 +1,10 @@
 #include "enums.h"
 #include "common.h"
+#include "file_table.h"
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define RED_TEXT "\x1B[1;31m"
 #define RESET_TEXT "\x1B[0m"
@@ -18,6 +21,46 @@ int operator_precedence[] = {
     0
 };
 
-void error(const string *filename, int line, char *message) {
-    fprintf(stderr, COLOUR_TEXT(RED, "Error in %.*s on line %d: %s\n"), filename->len, filename->data, line, message);
+THREAD_LOCAL message_buffer *diagnostics = NULL;
+
+// Prints a message to stderr, or adds it to diagnostics while a translation unit is being processed
+void report(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+
+    if (diagnostics == NULL) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+
+    const int len = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
+
+    if (len > 0) {
+        if (diagnostics->len + (size_t) len + 1 > diagnostics->cap) {
+            while (diagnostics->len + (size_t) len + 1 > diagnostics->cap) {
+                diagnostics->cap = diagnostics->cap ? diagnostics->cap * 2 : 256;
+            }
+
+            diagnostics->data = realloc(diagnostics->data, diagnostics->cap);
+        }
+
+        vsnprintf(&diagnostics->data[diagnostics->len], (size_t) len + 1, format, args);
+        diagnostics->len += (size_t) len;
+    }
+
+    va_end(args);
+}
+
+void error(source_loc loc, char *message) {
+    const source_position position = resolve_source_loc(loc);
+    const string *filename = &get_source_file(position.file_id)->path;
+
+    report(COLOUR_TEXT(RED, "Error in %.*s on line %u, column %u: %s\n"), filename->len, filename->data,
+           position.line, position.column, message);
 }
@@ -1,103 +1,181 @@
-#ifndef COMMON_H
-#define COMMON_H
-
-#include "enums.h"
-#include "memory.h"
-#include "strings.h"
-
-#include <stdbool.h>
-#include <stdint.h>
-
-#define MAX_PARAMETERS 8
-#define MAX_PARAMETER_LENGTH 32
-#define MAX_NUM_MACROS 32768
-#define MAX_NUM_FILES 512
-#define MAX_TOKENS (1 << 20)
-
-#define TOKEN_ARENA_MAX_SIZE sizeof(tk_node) * MAX_TOKENS
-
-#define FILES_TOP files[files_top]
-
-extern int operator_precedence[];
-
-typedef struct {
-    enum token_type type;
-    enum subtype subtype;
-    string src_filepath;
-    uint16_t filename_index;
-    string lexeme;
-    int32_t line;
-    bool irreplaceable;
-    bool follows_whitespace;
-} token;
-
-typedef struct tk_node {
-    token token;
-    struct tk_node *next;
-} tk_node;
-
-typedef struct {
-    tk_node *start;
-    tk_node *end;
-    bool cond;
-} ifgroup;
-
-typedef struct {
-    char *data;
-    size_t size;
-    size_t pos;
-} buff;
-
-typedef struct {
-    string filepath;
-    buff buffer;
-
-    int current_pos;
-    int current_line;
-} file_info;
-
-typedef struct {
-    string name;
-    uint64_t hash;
-    short num_params;
-    string parameters[MAX_PARAMETERS];
-    bool is_function_like;
-    token replacement[512];
-
-    string defined_file;
-    int defined_line;
-} macro;
-
-typedef struct {
-    tk_node *start;
-    tk_node *end;
-    size_t len;
-} tk_list_segment;
-
-// Defined in lexer:
-extern memory_arena *token_arena;
-extern tk_node *tokens;
-extern size_t num_tokens;
-
-extern file_info files[MAX_NUM_FILES];
-extern int files_top;
-
-
-// Defined in preprocessor:
-extern size_t num_macros;
-
-extern bool in_define;
-extern bool in_include;
-
-void error(const string *filename, int line, char *message);
-void scan_and_insert_tokens(tk_node *insert_point);
-void process_preprocessing_tokens(tk_node *token_node);
-void expand_macro_tokens(tk_node *token_node);
-
-const macro *macro_exists(tk_node *token_node);
-tk_node *remove_tokens(const tk_node *start, const tk_node *end);
-tk_list_segment expand_macro(tk_node *token_node);
-
-bool add_file(const string *file_path);
-
-#endif //COMMON_H
+#ifndef COMMON_H
+#define COMMON_H
+
+#include "enums.h"
+#include "file_table.h"
+#include "hideset.h"
+#include "intern.h"
+#include "memory.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_NUM_MACROS 32768
+#define MAX_NUM_FILES 512
+
+// Only lexemes that can't point into the source or the intern table live in the token arena,
+// it grows by another block of this size whenever it fills up
+#define TOKEN_ARENA_BLOCK_SIZE (1 << 25)
+
+// Files larger than this are read through a window of this size rather than all at once. When only
+// preprocessing, tokens are also written out and dropped a batch at a time, see lex_more_tokens,
+// so the memory used for a file grows with the window rather than with the file
+#define SOURCE_WINDOW_SIZE (1 << 16)
+
+// Tokens the lexer reads before it looks for a place to end a batch
+#define STREAM_BATCH_TOKENS (1 << 14)
+
+#define FILES_TOP files[files_top]
+
+extern int operator_precedence[];
+
+typedef struct {
+    enum token_type type;
+    enum subtype subtype;
+    source_loc loc;
+    string lexeme;
+    atom atom; // Only set for identifiers
+    uint64_t value; // Only set for integer constants
+    hideset hideset; // Macros this token was expanded from
+    bool follows_whitespace;
+} token;
+
+// Index of a token in the token buffer, TK_NONE ends a list
+typedef uint32_t tk_node;
+
+#define TK_NONE 0
+
+// Bits of token_buffer.flags
+#define TK_FOLLOWS_WHITESPACE 0x1
+
+// Tokens are stored as parallel arrays indexed by tk_node.
+// next links the tokens into lists, so segments can still be spliced in and out during macro expansion
+typedef struct {
+    uint8_t *type;
+    uint8_t *subtype;
+    uint8_t *flags;
+    source_loc *loc;
+    atom *atom;
+    uint64_t *value;
+    hideset *hideset;
+    string *lexeme;
+    tk_node *next;
+
+    uint32_t len;
+    uint32_t cap;
+} token_buffer;
+
+typedef struct {
+    tk_node start;
+    tk_node end;
+    bool cond;
+} ifgroup;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t pos;
+    bool mapped; // data is a read-only mmap of the file rather than a malloc'd copy
+
+    // Set while there is more of the file to read into the window, data can move until then
+    FILE *stream;
+    size_t offset; // Offset in the file of data[0]
+    size_t remaining; // Bytes left to read from stream, a deferred group is only read up to its end
+    size_t capacity; // Of data, when it's a window
+    bool windowed; // data only ever holds part of the file
+
+    bool deferred_groups; // Some conditional groups weren't lexed, so data is kept until they're needed
+    bool borrowed; // data belongs to the file table, for lexing a deferred group
+} buff;
+
+typedef struct {
+    uint16_t file_id;
+    buff buffer;
+    bool group; // Only a deferred group of the file is being lexed, so its END isn't the end of the file
+} file_info;
+
+typedef struct {
+    atom name;
+    short num_params;
+    atom *parameters; // num_params atoms, allocated from the macro arena
+    bool is_function_like;
+    bool is_variadic; // The last parameter is ..., which is __VA_ARGS__ in the replacement list
+
+    // replacement_len tokens followed by a token with no location, allocated from the macro arena
+    token *replacement;
+    uint32_t replacement_len;
+
+    source_loc defined_loc;
+} macro;
+
+typedef struct {
+    tk_node start;
+    tk_node end;
+    size_t len;
+} tk_list_segment;
+
+// Messages for one translation unit, kept until it's done so they can be printed in order
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} message_buffer;
+
+// Defined in common:
+extern THREAD_LOCAL message_buffer *diagnostics;
+
+void report(const char *format, ...);
+
+// Defined in token buffer:
+extern THREAD_LOCAL token_buffer tk;
+
+void reset_token_buffer(void);
+void free_token_buffer(void);
+tk_node new_token_node(const token *new_token);
+token get_token(tk_node node);
+void set_token(tk_node node, const token *new_token);
+
+// Defined in lexer:
+extern THREAD_LOCAL memory_arena *token_arena;
+extern THREAD_LOCAL tk_node tokens;
+extern THREAD_LOCAL size_t num_tokens;
+
+extern THREAD_LOCAL file_info files[MAX_NUM_FILES];
+extern THREAD_LOCAL int files_top;
+
+extern bool zero_copy_lexing;
+extern THREAD_LOCAL bool streaming_output;
+
+
+// Defined in preprocessor:
+extern THREAD_LOCAL size_t num_macros;
+extern THREAD_LOCAL size_t max_macros;
+
+extern THREAD_LOCAL bool in_define;
+extern THREAD_LOCAL bool in_include;
+
+struct token_writer;
+
+void error(source_loc loc, char *message);
+void scan_and_insert_tokens(tk_node insert_point);
+bool lex_more_tokens(tk_node insert_point);
+void release_written_tokens(token *kept);
+void process_preprocessing_tokens(tk_node token_node, struct token_writer *output);
+void expand_macro_tokens(tk_node token_node);
+
+const macro *macro_exists(tk_node token_node);
+tk_list_segment expand_macro(tk_node before);
+
+bool add_file(const string *file_path);
+void parse_integer_constant(token *constant);
+void release_source_buffers(void);
+void free_retained_buffers(void);
+void free_preprocessor(void);
+void lex_deferred_group(tk_node before_group);
+bool stream_deferred_group(tk_node group);
+void watch_include_guard(uint16_t file_id);
+
+#endif //COMMON_H
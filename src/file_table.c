@@ -0,0 +1,328 @@
+#include "file_table.h"
+#include "char_scan.h"
+#include "hash_table.h"
+#include "memory.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A file with line checkpoints only has the offsets of this many lines in memory at once
+#define LINE_CHECKPOINT_INTERVAL 1024
+
+// Every file seen by the lexer gets a single entry, tokens refer to it by its ID.
+// Allocated with the first file, so a thread that never lexes anything doesn't pay for it.
+// The table only covers one translation unit, it's emptied by reset_file_table once it's finished,
+// so the limits on file IDs and locations are for each translation unit rather than the whole run
+
+static THREAD_LOCAL source_file *file_table;
+static THREAD_LOCAL uint16_t num_source_files = 0;
+
+// Location 0 is NO_SOURCE_LOC, so the first file starts at 1
+static THREAD_LOCAL uint64_t next_base = 1;
+
+// Set once a file couldn't be added, until the table is reset
+static THREAD_LOCAL bool table_full = false;
+
+static THREAD_LOCAL memory_arena *file_table_arena;
+static THREAD_LOCAL ht *file_id_hash_table;
+
+// Returns the ID of the file with the given path, adding it to the table if needed.
+// size is the file's length in bytes, used to reserve its range of locations.
+// A file that's changed size since it was added gets a new entry, see forget_source_file.
+// Returns NO_FILE_ID if there's no room left for it, see file_table_full
+uint16_t add_source_file(const string *path, size_t size) {
+    if (file_id_hash_table == NULL) {
+        file_table_arena = create_arena(sizeof(ht) + sizeof(ht_entry) * MAX_SOURCE_FILES);
+        file_id_hash_table = ht_alloc(MAX_SOURCE_FILES, ht_compare_strcmp, file_table_arena);
+        file_table = calloc(MAX_SOURCE_FILES, sizeof(source_file));
+    }
+
+    const source_file *existing_file = ht_get(file_id_hash_table, path);
+
+    if (existing_file != NULL && existing_file->size == size) {
+        return (uint16_t) (existing_file - file_table);
+    }
+
+    // One more than the size, so the end of the file has a location too.
+    // A changed file that doesn't fit keeps its old entry, so it can still be found
+    if (num_source_files == MAX_SOURCE_FILES - 1 || next_base + size + 1 > UINT32_MAX) {
+        table_full = true;
+        return NO_FILE_ID;
+    }
+
+    if (existing_file != NULL) {
+        ht_remove(file_id_hash_table, path);
+    }
+
+    source_file *new_file = &file_table[num_source_files];
+
+    new_file->path = (string) {.data = malloc(path->len + 1u), .cap = (uint16_t) (path->len + 1), .len = 0};
+    string_copy(&new_file->path, path);
+
+    const string last_slash = string_rstr(&new_file->path, '/');
+    new_file->dir_len = last_slash.data == NULL ? 0 : (uint16_t) (last_slash.data - new_file->path.data + 1);
+
+    new_file->base = (source_loc) next_base;
+    new_file->size = (uint32_t) size;
+    next_base += size + 1;
+
+    ht_add(file_id_hash_table, new_file, &new_file->path);
+
+    return num_source_files++;
+}
+
+// Whether a file couldn't be added to this translation unit,
+// as there are too many files or they add up to more than 4 GiB
+bool file_table_full(void) {
+    return table_full;
+}
+
+// Empties the table once a translation unit is finished, IDs and locations start again from the beginning
+void reset_file_table(void) {
+    for (uint16_t file_id = 0; file_id < num_source_files; file_id++) {
+        free(file_table[file_id].path.data);
+        free(file_table[file_id].line_offsets);
+        free(file_table[file_id].line_checkpoints);
+    }
+
+    if (file_id_hash_table != NULL) {
+        memset(file_table, 0, num_source_files * sizeof(source_file));
+        ht_clear(file_id_hash_table);
+    }
+
+    num_source_files = 0;
+    next_base = 1;
+    table_full = false;
+}
+
+// The file at path has changed since it was added, so the next add_source_file for it makes a new
+// entry, with its own locations and line table. The old one is kept for the tokens that refer to it
+void forget_source_file(const string *path) {
+    if (file_id_hash_table != NULL) {
+        ht_remove(file_id_hash_table, path);
+    }
+}
+
+void free_file_table(void) {
+    reset_file_table();
+
+    if (file_id_hash_table != NULL) {
+        free(file_table);
+        delete_arena(file_table_arena);
+    }
+
+    file_table = NULL;
+    file_table_arena = NULL;
+    file_id_hash_table = NULL;
+}
+
+// Returns the ID of the file with the given path, or -1 if it hasn't been seen
+int32_t find_source_file(const string *path) {
+    if (file_id_hash_table == NULL) {
+        return -1;
+    }
+
+    const source_file *existing_file = ht_get(file_id_hash_table, path);
+
+    return existing_file == NULL ? -1 : (int32_t) (existing_file - file_table);
+}
+
+uint16_t source_file_count(void) {
+    return num_source_files;
+}
+
+source_file *get_source_file(uint16_t file_id) {
+    assert(file_id < num_source_files);
+
+    return &file_table[file_id];
+}
+
+// Makes build_line_table keep only where every LINE_CHECKPOINT_INTERVAL'th line of the file starts,
+// for a file too large to keep the start of every line. It has to be used before the file's first chunk
+void keep_line_checkpoints(uint16_t file_id) {
+    source_file *file = &file_table[file_id];
+
+    assert(file->line_offsets == NULL && file->line_table_end == 0);
+
+    file->max_checkpoints = 64;
+    file->line_checkpoints = malloc(file->max_checkpoints * sizeof(uint32_t));
+    file->line_checkpoints[0] = 0;
+    file->num_checkpoints = 1;
+    file->lines_seen = 1;
+}
+
+// Records where each line of the file starts. The file can be given in chunks,
+// as long as they're in order. Only done the first time a file is read in the translation unit
+void build_line_table(uint16_t file_id, const char *data, size_t offset, size_t size) {
+    source_file *file = &file_table[file_id];
+
+    if (file->line_offsets == NULL && file->line_checkpoints == NULL) {
+        file->max_lines = 64;
+        file->line_offsets = malloc(file->max_lines * sizeof(uint32_t));
+        file->line_offsets[0] = 0;
+        file->num_lines = 1;
+    }
+
+    if (offset != file->line_table_end) {
+        return;
+    }
+
+    if (file->line_checkpoints != NULL) {
+        for (size_t pos = find_newline(data, size); pos < size; pos += find_newline(&data[pos], size - pos)) {
+            pos++;
+
+            if (file->lines_seen++ % LINE_CHECKPOINT_INTERVAL != 0) continue;
+
+            if (file->num_checkpoints == file->max_checkpoints) {
+                file->max_checkpoints *= 2;
+                file->line_checkpoints = realloc(file->line_checkpoints, file->max_checkpoints * sizeof(uint32_t));
+            }
+
+            file->line_checkpoints[file->num_checkpoints++] = (uint32_t) (offset + pos);
+        }
+
+        file->line_table_end = (uint32_t) (offset + size);
+        return;
+    }
+
+    const uint32_t new_lines = (uint32_t) count_newlines(data, size);
+
+    if (file->num_lines + new_lines > file->max_lines) {
+        while (file->num_lines + new_lines > file->max_lines) file->max_lines *= 2;
+        file->line_offsets = realloc(file->line_offsets, file->max_lines * sizeof(uint32_t));
+    }
+
+    for (size_t pos = find_newline(data, size); pos < size; pos += find_newline(&data[pos], size - pos)) {
+        file->line_offsets[file->num_lines++] = (uint32_t) (offset + ++pos);
+    }
+
+    file->line_table_end = (uint32_t) (offset + size);
+}
+
+// Gives a file whose lines are already known, like a cached or precompiled header,
+// its line table, if it doesn't have one yet
+void set_line_table(uint16_t file_id, const uint32_t *line_offsets, uint32_t num_lines) {
+    source_file *file = &file_table[file_id];
+
+    if (file->line_offsets != NULL || file->line_checkpoints != NULL) {
+        return;
+    }
+
+    file->num_lines = file->max_lines = num_lines;
+    file->line_offsets = malloc(num_lines * sizeof(uint32_t));
+    file->line_table_end = file->size;
+
+    memcpy(file->line_offsets, line_offsets, num_lines * sizeof(uint32_t));
+}
+
+source_loc make_source_loc(uint16_t file_id, size_t offset) {
+    assert(offset <= file_table[file_id].size);
+
+    return file_table[file_id].base + (source_loc) offset;
+}
+
+// Files are added in order of their base, so the table can be binary searched
+uint16_t source_loc_file_id(source_loc loc) {
+    assert(loc != NO_SOURCE_LOC && num_source_files > 0);
+
+    uint16_t low = 0;
+    uint16_t high = (uint16_t) (num_source_files - 1);
+
+    while (low < high) {
+        const uint16_t mid = (uint16_t) (low + (high - low + 1) / 2);
+
+        if (file_table[mid].base <= loc) {
+            low = mid;
+        } else {
+            high = (uint16_t) (mid - 1);
+        }
+    }
+
+    return low;
+}
+
+// Reads back the offsets of the lines from the checkpoint'th one up to the next, out of the file itself.
+// If it can't be read any more, the block is left with just the line at the checkpoint
+static void load_line_block(source_file *file, uint32_t checkpoint) {
+    char chunk[4096];
+    FILE *stream = fopen(file->path.data, "rb");
+    size_t offset = file->line_checkpoints[checkpoint];
+
+    if (file->line_offsets == NULL) {
+        file->max_lines = LINE_CHECKPOINT_INTERVAL;
+        file->line_offsets = malloc(file->max_lines * sizeof(uint32_t));
+    }
+
+    file->first_line = checkpoint * LINE_CHECKPOINT_INTERVAL;
+    file->line_offsets[0] = (uint32_t) offset;
+    file->num_lines = 1;
+
+    if (stream == NULL) {
+        return;
+    }
+
+    fseek(stream, (long) offset, SEEK_SET);
+
+    size_t chunk_size;
+
+    while (file->num_lines < LINE_CHECKPOINT_INTERVAL && (chunk_size = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+        for (size_t pos = find_newline(chunk, chunk_size); pos < chunk_size && file->num_lines < LINE_CHECKPOINT_INTERVAL;
+             pos += find_newline(&chunk[pos], chunk_size - pos)) {
+            file->line_offsets[file->num_lines++] = (uint32_t) (offset + ++pos);
+        }
+
+        offset += chunk_size;
+    }
+
+    fclose(stream);
+}
+
+// Works out the line and column of a location, both counted from 1
+source_position resolve_source_loc(source_loc loc) {
+    const uint16_t file_id = source_loc_file_id(loc);
+    source_file *file = &file_table[file_id];
+    const uint32_t offset = loc - file->base;
+
+    uint32_t low = 0;
+    uint32_t high;
+
+    // Locations are mostly resolved in order, so the block of lines that's loaded is usually the one needed
+    if (file->line_checkpoints != NULL) {
+        high = file->num_checkpoints - 1;
+
+        while (low < high) {
+            const uint32_t mid = low + (high - low + 1) / 2;
+
+            if (file->line_checkpoints[mid] <= offset) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+
+        if (file->line_offsets == NULL || file->first_line != low * LINE_CHECKPOINT_INTERVAL) {
+            load_line_block(file, low);
+        }
+
+        low = 0;
+    }
+
+    high = file->num_lines - 1;
+
+    while (low < high) {
+        const uint32_t mid = low + (high - low + 1) / 2;
+
+        if (file->line_offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return (source_position) {.file_id = file_id, .line = file->first_line + low + 1,
+                              .column = offset - file->line_offsets[low] + 1};
+}
@@ -0,0 +1,81 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+
+#include "intern.h"
+#include "strings.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_SOURCE_FILES UINT16_MAX
+
+// Returned by add_source_file once the translation unit has run out of file IDs or locations
+#define NO_FILE_ID UINT16_MAX
+
+// A position in the source, every file is given its own range of locations,
+// so a single 32-bit value holds both the file and the byte offset within it
+typedef uint32_t source_loc;
+
+#define NO_SOURCE_LOC 0
+
+typedef struct {
+    uint16_t file_id;
+    uint32_t line;
+    uint32_t column;
+} source_position;
+
+typedef struct {
+    string path;
+    uint16_t dir_len; // Length of the directory prefix of path, including the trailing '/'
+
+    // Location of the first byte of the file, the range runs up to and including base + size
+    source_loc base;
+    uint32_t size;
+
+    // Byte offset of the start of each line, line_offsets[0] is line first_line + 1. That's every line of
+    // the file unless it has line_checkpoints, when it's a block of them read back from the file as needed
+    uint32_t *line_offsets;
+    uint32_t num_lines;
+    uint32_t max_lines;
+    uint32_t first_line;
+    uint32_t line_table_end; // How much of the file the line table covers
+
+    // Byte offset of every LINE_CHECKPOINT_INTERVAL'th line, NULL unless keep_line_checkpoints was used
+    uint32_t *line_checkpoints;
+    uint32_t num_checkpoints;
+    uint32_t max_checkpoints;
+    uint32_t lines_seen; // Lines started in the part of the file the checkpoints cover
+
+    // For skipping headers that have already been included
+    atom include_guard; // Macro from an #ifndef wrapping the whole file, NO_ATOM if there isn't one
+    bool guard_checked;
+    bool pragma_once;
+    uint32_t last_included; // Translation unit the file was last included in
+
+    // The whole file, if the lexer deferred any of its conditional groups. It lasts until the end
+    // of the translation unit, or the rest of the run when it comes from the header cache
+    const char *text;
+
+    // Of the bytes that were lexed, only worked out when something will look at it, see add_file
+    uint64_t content_hash;
+    bool content_hashed;
+    bool windowed; // Read through a window rather than all at once, see open_window
+} source_file;
+
+uint16_t add_source_file(const string *path, size_t size);
+bool file_table_full(void);
+void reset_file_table(void);
+void free_file_table(void);
+void forget_source_file(const string *path);
+int32_t find_source_file(const string *path);
+uint16_t source_file_count(void);
+source_file *get_source_file(uint16_t file_id);
+void keep_line_checkpoints(uint16_t file_id);
+void build_line_table(uint16_t file_id, const char *data, size_t offset, size_t size);
+void set_line_table(uint16_t file_id, const uint32_t *line_offsets, uint32_t num_lines);
+
+source_loc make_source_loc(uint16_t file_id, size_t offset);
+uint16_t source_loc_file_id(source_loc loc);
+source_position resolve_source_loc(source_loc loc);
+
+#endif // FILE_TABLE_H
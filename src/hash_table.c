@@ -4,33 +4,55 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Hash Table using open addressing with linear probing
 
+// Once this fraction of the slots are tombstones, the next add rehashes the table to clear them
+#define MAX_TOMBSTONE_FRACTION 4
+
 bool ht_compare_strcmp(const string *s1, const string *s2) {
     return string_cmp(s1, s2) == 0;
 }
 
-// FNV-1a Hash
+// For tables keyed by interned strings, where equal strings are the same string
+bool ht_compare_ptr(const string *s1, const string *s2) {
+    return s1 == s2;
+}
+
+// Hashes the key 8 bytes at a time, each word is mixed in with a multiply and
+// the result is finalised so the low bits used to pick a slot depend on every byte
 uint64_t ht_hash(const string *key) {
     assert(key->data != NULL);
 
-    static const uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325;
-    static const uint64_t FNV_PRIME = 0x100000001B3;
-    char *data = key->data;
+    static const uint64_t SEED = 0x9E3779B97F4A7C15;
+    static const uint64_t MULTIPLIER = 0xFF51AFD7ED558CCD;
+    static const uint64_t FINAL_MULTIPLIER = 0xC4CEB9FE1A85EC53;
 
-    uint64_t hash = FNV_OFFSET_BASIS;
+    const char *data = key->data;
+    size_t remaining = key->len;
+    uint64_t hash = SEED ^ remaining;
+    uint64_t word;
 
-    if (data == NULL) {
-        return hash;
+    for (; remaining >= sizeof(word); data += sizeof(word), remaining -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
     }
 
-    while (*data && data != &key->data[key->len]) {
-        hash ^= (uint64_t) *data++;
-        hash *= FNV_PRIME;
+    if (remaining > 0) {
+        word = 0;
+        memcpy(&word, data, remaining);
+
+        hash = (hash ^ word) * MULTIPLIER;
     }
 
+    hash ^= hash >> 33;
+    hash *= FINAL_MULTIPLIER;
+    hash ^= hash >> 33;
+
     return hash;
 }
 
@@ -41,85 +63,134 @@ ht *ht_alloc(size_t max_entries, bool comparision_function(const string *s1, con
 
     hash_table->comp_func = comparision_function;
     hash_table->capacity = max_entries;
-    hash_table->length = 0;
 
     return hash_table;
 }
 
-const void *ht_get(ht *hash_table, const string *key) {
-    assert(hash_table != NULL);
-    assert(key != NULL);
+// Removes every entry, leaving no tombstones behind
+void ht_clear(ht *hash_table) {
+    memset(hash_table->entries, 0, hash_table->capacity * sizeof(ht_entry));
+    hash_table->length = 0;
+    hash_table->tombstones = 0;
+    hash_table->max_probe = 0;
+}
+
+// Returns the slot key is in, or the capacity if it isn't in the table
+static size_t find_slot(const ht *hash_table, const string *key, uint64_t hash) {
+    size_t index = hash % hash_table->capacity;
 
-    size_t index = ht_hash(key) % hash_table->capacity;
-    ht_entry *entry = &hash_table->entries[index];
+    // No entry is further than max_probe from its home slot, so the key can't be past that
+    for (size_t probe = 0; probe <= hash_table->max_probe; probe++) {
+        const ht_entry *entry = &hash_table->entries[index];
+
+        if (entry->status == EMPTY) {
+            break;
+        }
 
-    while (entry->status != EMPTY) {
         if (entry->status == OCCUPIED && hash_table->comp_func(key, entry->key)) {
-            return entry->value;
+            return index;
         }
 
-        entry++;
+        index++;
+        index %= hash_table->capacity;
+    }
+
+    return hash_table->capacity;
+}
+
+// Puts the entry in the first free slot from its home slot, the key mustn't be in the table already
+static void insert_entry(ht *hash_table, const void *entry, const string *key, uint64_t hash) {
+    size_t index = hash % hash_table->capacity;
+    size_t probe = 0;
+
+    while (hash_table->entries[index].status == OCCUPIED) {
+        index++;
+        index %= hash_table->capacity;
+        probe++;
+    }
+
+    if (hash_table->entries[index].status == TOMBSTONE) {
+        hash_table->tombstones--;
+    }
+
+    hash_table->entries[index] = (ht_entry) {.key = key, .value = entry, .status = OCCUPIED};
+    hash_table->length++;
+
+    if (probe > hash_table->max_probe) {
+        hash_table->max_probe = probe;
+    }
+}
+
+// Puts every entry back without the tombstones, which also brings max_probe back down
+static void rehash(ht *hash_table) {
+    ht_entry *kept_entries = malloc(hash_table->length * sizeof(ht_entry));
+    const size_t num_kept = hash_table->length;
+    size_t i = 0;
 
-        if ((size_t) (entry - hash_table->entries) == hash_table->capacity) {
-            entry = hash_table->entries;
+    for (size_t index = 0; index < hash_table->capacity; index++) {
+        if (hash_table->entries[index].status == OCCUPIED) {
+            kept_entries[i++] = hash_table->entries[index];
         }
     }
 
-    return NULL;
+    ht_clear(hash_table);
+
+    for (i = 0; i < num_kept; i++) {
+        insert_entry(hash_table, kept_entries[i].value, kept_entries[i].key, ht_hash(kept_entries[i].key));
+    }
+
+    free(kept_entries);
 }
 
-void ht_add(ht *hash_table, const void *entry, const string *key) {
+const void *ht_get(ht *hash_table, const string *key) {
+    return ht_get_with_hash(hash_table, key, ht_hash(key));
+}
+
+// For callers that already have the key's hash, it must be the same as ht_hash(key)
+const void *ht_get_with_hash(ht *hash_table, const string *key, uint64_t hash) {
     assert(hash_table != NULL);
-    assert(entry != NULL);
     assert(key != NULL);
 
-    assert(hash_table->length < hash_table->capacity);
+    const size_t index = find_slot(hash_table, key, hash);
 
-    size_t index = ht_hash(key) % hash_table->capacity;
-    size_t tombstone_index = 0;
-    bool tombstone_found = false;
+    return index < hash_table->capacity ? hash_table->entries[index].value : NULL;
+}
 
-    while (hash_table->entries[index].status != EMPTY) {
-        if (hash_table->entries[index].status == TOMBSTONE && !tombstone_found) {
-            tombstone_index = index;
-        }
+void ht_add(ht *hash_table, const void *entry, const string *key) {
+    ht_add_with_hash(hash_table, entry, key, ht_hash(key));
+}
 
-        index++;
-        index %= hash_table->capacity;
-    }
+// The first free slot is used, whether it's empty or a tombstone. Tables that keep having entries
+// removed and added again, like the macro table, are rehashed once they fill up with tombstones
+void ht_add_with_hash(ht *hash_table, const void *entry, const string *key, uint64_t hash) {
+    assert(hash_table != NULL);
+    assert(entry != NULL);
+    assert(key != NULL);
+
+    assert(hash_table->length < hash_table->capacity);
 
-    if (tombstone_found) {
-        hash_table->entries[tombstone_index].key = key;
-        hash_table->entries[tombstone_index].value = entry;
-        hash_table->entries[tombstone_index].status = OCCUPIED;
-    } else {
-        hash_table->entries[index].key = key;
-        hash_table->entries[index].value = entry;
-        hash_table->entries[index].status = OCCUPIED;
+    if (hash_table->tombstones > hash_table->capacity / MAX_TOMBSTONE_FRACTION) {
+        rehash(hash_table);
     }
 
-    hash_table->length++;
+    insert_entry(hash_table, entry, key, hash);
 }
 
 void ht_remove(ht *hash_table, const string *key) {
+    ht_remove_with_hash(hash_table, key, ht_hash(key));
+}
+
+// Leaves a tombstone, so the entries after it can still be found.
+// The table isn't rehashed here, so entries can be removed while going through the table
+void ht_remove_with_hash(ht *hash_table, const string *key, uint64_t hash) {
     assert(hash_table != NULL);
     assert(key != NULL);
 
-    size_t index = ht_hash(key) % hash_table->capacity;
-    size_t start_index = index;
+    const size_t index = find_slot(hash_table, key, hash);
 
-    while (hash_table->entries[index].status != EMPTY) {
-        if (hash_table->entries[index].status == OCCUPIED && (string_cmp(key, hash_table->entries[index].key) == 0)) {
-            hash_table->entries[index].status = TOMBSTONE;
-
-            hash_table->length--;
-        }
-
-        index++;
-        index %= hash_table->capacity;
-
-        if (index == start_index) {
-            break;
-        }
+    if (index < hash_table->capacity) {
+        hash_table->entries[index].status = TOMBSTONE;
+        hash_table->length--;
+        hash_table->tombstones++;
     }
 }
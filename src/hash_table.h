@@ -21,15 +21,25 @@ typedef struct {
 typedef struct {
     size_t capacity;
     size_t length;
+    size_t tombstones;
+    size_t max_probe; // Furthest any entry is from its home slot, lookups give up after that
     bool (*comp_func)(const string *s1, const string *s2);
     ht_entry entries[];
 } ht;
 
 ht *ht_alloc(size_t max_entries, bool comparision_function(const string *s1, const string *s2), memory_arena *arena);
+void ht_clear(ht *hash_table);
 const void *ht_get(ht *hash_table, const string *key);
 void ht_add(ht *hash_table, const void *entry, const string *key);
 void ht_remove(ht *hash_table, const string *key);
 
+const void *ht_get_with_hash(ht *hash_table, const string *key, uint64_t hash);
+void ht_add_with_hash(ht *hash_table, const void *entry, const string *key, uint64_t hash);
+void ht_remove_with_hash(ht *hash_table, const string *key, uint64_t hash);
+
+uint64_t ht_hash(const string *key);
+
 bool ht_compare_strcmp(const string *s1, const string *s2);
+bool ht_compare_ptr(const string *s1, const string *s2);
 
 #endif // HASH_TABLE_H
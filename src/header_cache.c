@@ -0,0 +1,283 @@
+// pthread_rwlock_t and st_mtim aren't part of C99
+#define _POSIX_C_SOURCE 200809L
+
+#include "header_cache.h"
+#include "common.h"
+#include "file_table.h"
+#include "hash_table.h"
+#include "intern.h"
+#include "manifest.h"
+#include "memory.h"
+#include "strings.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define HEADER_CACHE_ARENA_BLOCK_SIZE (1 << 22)
+#define MAX_CACHED_HEADERS (1 << 14)
+
+// A header's tokens as the lexer produced them, kept for the rest of the run,
+// so a header included by many translation units is only lexed once, whichever thread they're on
+typedef struct {
+    // Each translation unit gives the header new locations, so the tokens' locations are offsets
+    // into the file, plus one so tokens without a location still have NO_SOURCE_LOC.
+    // Atoms belong to a thread, so an identifier's atom is the index of its spelling in names instead
+    token *tokens; // Ends with the header's END token
+    uint32_t num_tokens;
+
+    // Each identifier spelling used in the header, interned once by each translation unit that splices it
+    string *names;
+    uint32_t num_names;
+
+    // What the file table needs for the locations, which is built as the file is lexed otherwise
+    uint32_t *line_offsets;
+    uint32_t num_lines;
+    const char *text; // For lexing the conditional groups the lexer deferred, NULL if there weren't any
+
+    // The file as it was when it was lexed, if either has changed the tokens are out of date
+    struct timespec mtime;
+    off_t size;
+
+    // A file can be rewritten without its modification time changing, if it's within the same tick
+    // of the file system's clock. That can only happen to one modified around when it was cached,
+    // so only those have their contents checked against the hash of what was lexed
+    bool check_contents;
+    uint64_t content_hash;
+    bool content_hashed;
+} cached_header;
+
+// Shared by every thread. Headers are added with the write lock held, and once added are never
+// changed or freed until free_header_cache, so they can be used after the read lock is released
+static pthread_rwlock_t header_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static memory_arena *header_cache_arena;
+
+// Keyed by the header's path
+static ht *cached_headers;
+
+// Lexemes can point into the token arena or a source buffer, which are both freed at the end of
+// the translation unit, so those are copied. Keywords, punctuators and the whitespace tokens use
+// static strings, so they can be kept, and identifiers use the header's names
+static string persistent_lexeme(const token *cached_token) {
+    switch (cached_token->type) {
+        case KEYWORD:
+        case IDENTIFIER:
+        case PUNCTUATOR:
+        case NEWLINE:
+        case BLANK:
+        case END:
+            return cached_token->lexeme;
+        default:
+            break;
+    }
+
+    if (cached_token->lexeme.data == NULL) {
+        return cached_token->lexeme;
+    }
+
+    string copy = create_heap_string((uint16_t) (cached_token->lexeme.len + 1), header_cache_arena);
+    string_copy(&copy, &cached_token->lexeme);
+
+    return copy;
+}
+
+// Saves the tokens of a header that's just been lexed, first is its first token
+void cache_header_tokens(uint16_t file_id, tk_node first) {
+    const source_file *file = get_source_file(file_id);
+    struct stat file_stat;
+    uint32_t num_tokens = 1;
+
+    if (file->windowed || stat(file->path.data, &file_stat) != 0 || (uint64_t) file_stat.st_size != file->size) {
+        return;
+    }
+
+    const bool check_contents = file_stat.st_mtim.tv_sec + 1 >= time(NULL);
+
+    // Without the hash of what was lexed there's no telling if the file changed before it was looked at
+    if (check_contents && !file->content_hashed) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&header_cache_lock);
+
+    if (header_cache_arena == NULL) {
+        header_cache_arena = create_arena(HEADER_CACHE_ARENA_BLOCK_SIZE);
+        cached_headers = ht_alloc(MAX_CACHED_HEADERS, ht_compare_strcmp, header_cache_arena);
+    }
+
+    // Kept at most half full, past that headers just aren't cached
+    if (ht_get(cached_headers, &file->path) == NULL && cached_headers->length * 2 >= cached_headers->capacity) {
+        pthread_rwlock_unlock(&header_cache_lock);
+        return;
+    }
+
+    atom max_atom = NO_ATOM;
+
+    for (tk_node ptr = first; tk.type[ptr] != END; ptr = tk.next[ptr]) {
+        if (tk.atom[ptr] > max_atom) max_atom = tk.atom[ptr];
+        num_tokens++;
+    }
+
+    cached_header *header = allocate_from_arena(header_cache_arena, sizeof(cached_header));
+
+    *header = (cached_header) {
+        .tokens = allocate_from_arena(header_cache_arena, num_tokens * sizeof(token)),
+        .num_tokens = num_tokens,
+        .line_offsets = allocate_from_arena(header_cache_arena, file->num_lines * sizeof(uint32_t)),
+        .num_lines = file->num_lines,
+        .mtime = file_stat.st_mtim,
+        .size = file_stat.st_size,
+        .check_contents = check_contents,
+        .content_hash = file->content_hash,
+        .content_hashed = file->content_hashed
+    };
+
+    memcpy(header->line_offsets, file->line_offsets, file->num_lines * sizeof(uint32_t));
+
+    // The lexer's copy of the text only lasts until the end of the translation unit
+    if (file->text != NULL) {
+        char *text = allocate_from_arena(header_cache_arena, file->size);
+
+        memcpy(text, file->text, file->size);
+        header->text = text;
+    }
+
+    // Each atom's index in names, plus one so 0 means it's not there yet
+    uint32_t *name_indices = calloc((size_t) max_atom + 1, sizeof(uint32_t));
+    tk_node ptr = first;
+
+    for (uint32_t i = 0; i < num_tokens; i++, ptr = tk.next[ptr]) {
+        header->tokens[i] = get_token(ptr);
+        header->tokens[i].lexeme = persistent_lexeme(&header->tokens[i]);
+
+        if (header->tokens[i].atom != NO_ATOM && name_indices[header->tokens[i].atom] == 0) {
+            name_indices[header->tokens[i].atom] = ++header->num_names;
+        }
+
+        header->tokens[i].atom = header->tokens[i].atom == NO_ATOM ? NO_ATOM : name_indices[header->tokens[i].atom] - 1;
+
+        if (header->tokens[i].loc != NO_SOURCE_LOC) {
+            header->tokens[i].loc = header->tokens[i].loc - file->base + 1;
+        }
+    }
+
+    header->names = allocate_from_arena(header_cache_arena, header->num_names * sizeof(string));
+
+    for (atom atom = 1; atom <= max_atom; atom++) {
+        if (name_indices[atom] == 0) continue;
+
+        string *name = &header->names[name_indices[atom] - 1];
+
+        *name = create_heap_string((uint16_t) (atom_to_string(atom)->len + 1), header_cache_arena);
+        string_copy(name, atom_to_string(atom));
+    }
+
+    free(name_indices);
+
+    for (uint32_t i = 0; i < num_tokens; i++) {
+        if (header->tokens[i].type == IDENTIFIER) {
+            header->tokens[i].lexeme = header->names[header->tokens[i].atom];
+        }
+    }
+
+    // Replaces the tokens of an earlier version of the file, if there are any. Another thread
+    // could still be splicing them, so they're left in the arena
+    string *key = allocate_from_arena(header_cache_arena, sizeof(string));
+
+    *key = create_heap_string((uint16_t) (file->path.len + 1), header_cache_arena);
+    string_copy(key, &file->path);
+
+    ht_remove(cached_headers, key);
+    ht_add(cached_headers, header, key);
+
+    pthread_rwlock_unlock(&header_cache_lock);
+}
+
+// Inserts a copy of the header's cached tokens after insert_point, adding the header to the file table
+// if it's not already there. Returns its file ID, or NO_FILE_ID if there are no tokens for it,
+// or the file has changed since they were cached
+uint16_t splice_cached_header(const string *path, tk_node insert_point) {
+    struct stat file_stat;
+    uint64_t content_hash;
+
+    pthread_rwlock_rdlock(&header_cache_lock);
+    const cached_header *header = cached_headers == NULL ? NULL : ht_get(cached_headers, path);
+    pthread_rwlock_unlock(&header_cache_lock);
+
+    if (header == NULL) {
+        return NO_FILE_ID;
+    }
+
+    bool changed = stat(path->data, &file_stat) != 0 || file_stat.st_size != header->size ||
+                   file_stat.st_mtim.tv_sec != header->mtime.tv_sec || file_stat.st_mtim.tv_nsec != header->mtime.tv_nsec;
+
+    if (!changed && header->check_contents) {
+        changed = !hash_file_contents(path->data, &content_hash) || content_hash != header->content_hash;
+    }
+
+    // Whatever this translation unit has read of the file is out of date too
+    if (changed) {
+        forget_source_file(path);
+        return NO_FILE_ID;
+    }
+
+    const uint16_t file_id = add_source_file(path, (size_t) header->size);
+
+    if (file_id == NO_FILE_ID) {
+        return NO_FILE_ID;
+    }
+
+    source_file *file = get_source_file(file_id);
+
+    set_line_table(file_id, header->line_offsets, header->num_lines);
+
+    // The file holds what was cached, so the hash is of the tokens being used
+    file->content_hash = header->content_hash;
+    file->content_hashed = header->content_hashed;
+
+    if (header->text != NULL) {
+        file->text = header->text;
+    }
+
+    atom *atoms = malloc(header->num_names * sizeof(atom));
+
+    for (uint32_t i = 0; i < header->num_names; i++) atoms[i] = intern(&header->names[i]);
+
+    const tk_node rest = tk.next[insert_point];
+
+    for (uint32_t i = 0; i < header->num_tokens; i++) {
+        token cached_token = header->tokens[i];
+
+        if (cached_token.loc != NO_SOURCE_LOC) {
+            cached_token.loc = file->base + cached_token.loc - 1;
+        }
+
+        // Identifiers use their interned spelling, like the ones from the lexer
+        if (cached_token.type == IDENTIFIER) {
+            cached_token.atom = atoms[cached_token.atom];
+            cached_token.lexeme = *atom_to_string(cached_token.atom);
+        }
+
+        const tk_node new_node = new_token_node(&cached_token);
+
+        tk.next[insert_point] = new_node;
+        insert_point = new_node;
+    }
+
+    tk.next[insert_point] = rest;
+    free(atoms);
+
+    return file_id;
+}
+
+// Only once every thread is done with it
+void free_header_cache(void) {
+    if (header_cache_arena != NULL) {
+        delete_arena(header_cache_arena);
+    }
+
+    header_cache_arena = NULL;
+    cached_headers = NULL;
+}
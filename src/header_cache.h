@@ -0,0 +1,14 @@
+#ifndef HEADER_CACHE_H
+#define HEADER_CACHE_H
+
+#include "common.h"
+#include "strings.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void cache_header_tokens(uint16_t file_id, tk_node first);
+uint16_t splice_cached_header(const string *path, tk_node insert_point);
+void free_header_cache(void);
+
+#endif // HEADER_CACHE_H
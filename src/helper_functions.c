@@ -1,142 +1,297 @@
-#include "helper_functions.h"
-#include "common.h"
-#include "enums.h"
-#include "memory.h"
-
-#include <string.h>
-
-#include <stdint.h>
-#include <stdio.h>
-
-const char ESCAPED_CHAR_MAPPINGS[256] = {
-    ['\''] = '\'',
-    ['\"'] = '\"',
-    ['\?'] = '\?',
-    ['\\'] = '\\',
-    ['\a'] = 'a',
-    ['\b'] = 'b',
-    ['\f'] = 'f',
-    ['\n'] = 'n',
-    ['\r'] = 'r',
-    ['\t'] = 't',
-    ['\v'] = 'v',
-
-    // Escaped Octal Digital
-    [0x80] = '0',
-    [0x81] = '1',
-    [0x82] = '2',
-    [0x83] = '3',
-    [0x84] = '4',
-    [0x85] = '5',
-    [0x86] = '6',
-    [0x87] = '7',
-};
-
-tk_node *advance_list(tk_node *list, size_t amount) {
-    for (size_t i = 0; i < amount; i++) list = list->next;
-    return list;
-}
-
-// Returns the end of the segment, or dest if segment is NULL
-tk_node *insert_list_segment(tk_node *dest, tk_list_segment segment) {
-    if (segment.start == NULL) {
-        return dest;
-    }
-
-    segment.end->next = dest->next;
-    dest->next = segment.start;
-
-    return segment.end;
-}
-
-void insert_token_into_list(tk_node *list_ptr, token token, memory_arena *arena) {
-    tk_node *new_entry = allocate_from_arena(arena, sizeof(tk_node));
-
-    new_entry->token = token;
-
-    new_entry->next = list_ptr->next;
-    list_ptr->next = new_entry;
-}
-
-// Removes tokens from start (inclusive) to end (exclusive)
-void remove_from_list(tk_node *list, const tk_node *start, const tk_node *end) {
-    tk_node *ptr = list;
-
-    for (; ptr->next != start; ptr = ptr->next);
-
-    tk_node *before_remove = ptr;
-
-    for (; ptr != end; ptr = ptr->next);
-
-    before_remove->next = ptr;
-}
-
-void save_tokens_to_file(const string *file_path, tk_node *start_node) {
-    FILE *out_file = fopen(file_path->data, "w");
-
-    for (tk_node *ptr = start_node; ptr != NULL; ptr = advance_list(ptr, 1)) {
-        if (ptr->token.type == STRING_LITERAL) {
-            fputc('\"', out_file);
-        }
-
-        if (ptr->token.subtype == CONST_CHAR) {
-            fputc('\'', out_file);
-        }
-
-        if (ptr->token.type == DIRECTIVE) {
-            fputc('#', out_file);
-        }
-
-        if (ptr->token.type == BLANK || ptr->token.type == END) continue;
-
-        if (ptr->token.type != NEWLINE) {
-            for (size_t i = 0; ptr->token.lexeme.data[i]; i++) {
-                if (ptr->token.lexeme.data[i] & 0x80) {
-                    fputc('\\', out_file);
-                    fputc(ESCAPED_CHAR_MAPPINGS[(uint8_t) ptr->token.lexeme.data[i] & 0x7F], out_file);
-                } else {
-                    fputc(ptr->token.lexeme.data[i], out_file);
-                }
-            }
-        }
-
-        if (ptr->token.type == STRING_LITERAL) {
-            fputs("\"", out_file);
-        }
-
-        if (ptr->token.subtype == CONST_CHAR) {
-            fputs("\' ", out_file);
-        }
-
-        if (ptr->next == NULL) continue;
-
-        if (ptr->next->token.subtype != PUN_DOT && ptr->token.type != NEWLINE) {
-            fputs(" ", out_file);
-        }
-
-        if (ptr->token.type == NEWLINE && (ptr->next->token.type != NEWLINE && ptr->next->token.type != END)) {
-            fputs("\n", out_file);
-        }
-    }
-
-    fclose(out_file);
-}
-
-uint64_t hash(const string *str) {
-    uint64_t complete_hash = 0;
-    char *data = str->data;
-
-    if (data == NULL) {
-        return complete_hash;
-    }
-
-    while (*data && data != &str->data[str->len]) {
-        uint64_t current_hash = 0;
-        for (uint8_t i = 0; i < 64 && *data; i+=8) {
-            current_hash |= ((uint64_t)(*data++) << i);
-        }
-        complete_hash ^= current_hash;
-    }
-
-    return complete_hash;
-}
+#include "helper_functions.h"
+#include "common.h"
+#include "enums.h"
+#include "memory.h"
+
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const char ESCAPED_CHAR_MAPPINGS[256] = {
+    ['\''] = '\'',
+    ['\"'] = '\"',
+    ['\?'] = '\?',
+    ['\\'] = '\\',
+    ['\a'] = 'a',
+    ['\b'] = 'b',
+    ['\f'] = 'f',
+    ['\n'] = 'n',
+    ['\r'] = 'r',
+    ['\t'] = 't',
+    ['\v'] = 'v',
+
+    // Escaped Octal Digital
+    [0x80] = '0',
+    [0x81] = '1',
+    [0x82] = '2',
+    [0x83] = '3',
+    [0x84] = '4',
+    [0x85] = '5',
+    [0x86] = '6',
+    [0x87] = '7',
+};
+
+tk_node advance_list(tk_node list, size_t amount) {
+    for (size_t i = 0; i < amount; i++) list = tk.next[list];
+    return list;
+}
+
+// Returns the end of the segment, or dest if segment is empty
+tk_node insert_list_segment(tk_node dest, tk_list_segment segment) {
+    if (segment.start == TK_NONE) {
+        return dest;
+    }
+
+    tk.next[segment.end] = tk.next[dest];
+    tk.next[dest] = segment.start;
+
+    return segment.end;
+}
+
+void insert_token_into_list(tk_node list_ptr, token token) {
+    tk_node new_entry = new_token_node(&token);
+
+    tk.next[new_entry] = tk.next[list_ptr];
+    tk.next[list_ptr] = new_entry;
+}
+
+// Removes the tokens after before_start, up to end (exclusive)
+void remove_from_list(tk_node before_start, tk_node end) {
+    tk.next[before_start] = end;
+}
+
+// Preprocessed output is rendered into a buffer of this size, which is written out whenever it fills up
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// Output that has fallen this many lines or fewer behind the source catches up with blank lines
+// rather than a line marker, like GCC does
+#define MAX_LINE_GAP 8
+
+static void flush_output(output_buffer *out) {
+    size_t written = 0;
+
+    while (!out->failed && written < out->len) {
+        const ssize_t result = write(out->fd, out->data + written, out->len - written);
+
+        if (result >= 0) {
+            written += (size_t) result;
+        } else if (errno != EINTR) {
+            out->failed = true;
+        }
+    }
+
+    out->len = 0;
+}
+
+// Makes sure there's room for len more bytes, which has to be no more than OUTPUT_BUFFER_SIZE
+static inline char *reserve_output(output_buffer *out, size_t len) {
+    if (out->len + len > OUTPUT_BUFFER_SIZE) {
+        flush_output(out);
+    }
+
+    return out->data + out->len;
+}
+
+static inline void output_char(output_buffer *out, char c) {
+    *reserve_output(out, 1) = c;
+    out->len++;
+}
+
+static inline void output_string(output_buffer *out, const char *data, size_t len) {
+    memcpy(reserve_output(out, len), data, len);
+    out->len += len;
+}
+
+// Lexemes keep escaped characters as a single byte with the top bit set, see ESCAPED_CHAR_MAPPINGS
+static bool has_escaped_chars(const char *data, size_t len) {
+    uint64_t word;
+    uint64_t all_bits = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));
+        all_bits |= word;
+    }
+
+    for (; i < len; i++) all_bits |= (uint8_t) data[i];
+
+    return (all_bits & 0x8080808080808080) != 0;
+}
+
+static void output_lexeme(output_buffer *out, const string *lexeme) {
+    if (!has_escaped_chars(lexeme->data, lexeme->len)) {
+        output_string(out, lexeme->data, lexeme->len);
+        return;
+    }
+
+    // At worst every character takes two bytes
+    char *dest = reserve_output(out, 2 * (size_t) lexeme->len);
+    char *const dest_start = dest;
+
+    for (size_t i = 0; i < lexeme->len; i++) {
+        if (lexeme->data[i] & 0x80) {
+            *dest++ = '\\';
+            *dest++ = ESCAPED_CHAR_MAPPINGS[(uint8_t) lexeme->data[i] & 0x7F];
+        } else {
+            *dest++ = lexeme->data[i];
+        }
+    }
+
+    out->len += (size_t) (dest - dest_start);
+}
+
+// # <line> "<file>", the file name is escaped like a string literal
+static void output_line_marker(output_buffer *out, const string *path, uint32_t line) {
+    char *dest = reserve_output(out, 2 * (size_t) path->len + 32);
+    char *const dest_start = dest;
+
+    dest += sprintf(dest, "# %u \"", (unsigned) line);
+
+    for (uint16_t i = 0; i < path->len; i++) {
+        if (path->data[i] == '\\' || path->data[i] == '\"') *dest++ = '\\';
+        *dest++ = path->data[i];
+    }
+
+    *dest++ = '\"';
+    *dest++ = '\n';
+
+    out->len += (size_t) (dest - dest_start);
+}
+
+// Starts writing the tokens of a translation unit out as text, which can be done a range at a time.
+// The output goes to a file next to file_path until it's closed, so nothing can see it half written,
+// and so the translation unit can include whatever was at file_path before
+void open_token_writer(token_writer *writer, const string *file_path, bool line_markers) {
+    *writer = (token_writer) {.line_markers = line_markers, .at_line_start = true};
+
+    snprintf(writer->path, sizeof(writer->path), "%.*s", file_path->len, file_path->data);
+    snprintf(writer->temp_path, sizeof(writer->temp_path), "%s.tmp", writer->path);
+
+    writer->out.fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (writer->out.fd < 0) {
+        report("Cannot write %s\n", writer->path);
+        return;
+    }
+
+    writer->out.data = malloc(OUTPUT_BUFFER_SIZE);
+}
+
+// Writes out the tokens from start up to end, or to the end of the list if end is TK_NONE.
+// With line markers, each line of output that doesn't follow on from the line before it in the same
+// file is preceded by a GCC style line marker giving where it came from
+void write_tokens(token_writer *writer, tk_node start, tk_node end) {
+    output_buffer *out = &writer->out;
+
+    if (out->fd < 0) {
+        return;
+    }
+
+    for (tk_node ptr = start; ptr != end; ptr = tk.next[ptr]) {
+        const tk_node next = tk.next[ptr];
+        const source_loc loc = tk.loc[ptr];
+
+        if (writer->line_markers && tk.type[ptr] != NEWLINE && tk.type[ptr] != BLANK && tk.type[ptr] != END &&
+            loc != NO_SOURCE_LOC) {
+            const bool in_marked_file = loc >= writer->marked_file_start && loc <= writer->marked_file_end;
+
+            // The end of an included file can run on into the line after the #include
+            if (!writer->at_line_start && !in_marked_file) {
+                output_char(out, '\n');
+                writer->at_line_start = true;
+            }
+
+            if (writer->at_line_start) {
+                const source_position position = resolve_source_loc(loc);
+
+                if (!in_marked_file || position.line < writer->next_line ||
+                    position.line - writer->next_line > MAX_LINE_GAP) {
+                    const source_file *file = get_source_file(position.file_id);
+
+                    output_line_marker(out, &file->path, position.line);
+                    writer->marked_file_start = file->base;
+                    writer->marked_file_end = file->base + file->size;
+                } else {
+                    for (; writer->next_line < position.line; writer->next_line++) output_char(out, '\n');
+                }
+
+                writer->next_line = position.line;
+                writer->at_line_start = false;
+            }
+        }
+
+        if (tk.type[ptr] == STRING_LITERAL) {
+            output_char(out, '\"');
+        }
+
+        if (tk.subtype[ptr] == CONST_CHAR) {
+            output_char(out, '\'');
+        }
+
+        if (tk.type[ptr] == DIRECTIVE) {
+            output_char(out, '#');
+        }
+
+        if (tk.type[ptr] == BLANK || tk.type[ptr] == END) continue;
+
+        if (tk.type[ptr] != NEWLINE) {
+            output_lexeme(out, &tk.lexeme[ptr]);
+        }
+
+        if (tk.type[ptr] == STRING_LITERAL) {
+            output_char(out, '\"');
+        }
+
+        if (tk.subtype[ptr] == CONST_CHAR) {
+            output_string(out, "\' ", 2);
+        }
+
+        if (next == TK_NONE) continue;
+
+        if (tk.subtype[next] != PUN_DOT && tk.type[ptr] != NEWLINE) {
+            output_char(out, ' ');
+        }
+
+        if (tk.type[ptr] == NEWLINE && (tk.type[next] != NEWLINE && tk.type[next] != END)) {
+            // Nothing goes before the first line marker, like GCC
+            if (!writer->line_markers || writer->marked_file_start != NO_SOURCE_LOC) {
+                output_char(out, '\n');
+                writer->next_line++;
+            }
+
+            writer->at_line_start = true;
+        }
+    }
+}
+
+// Finishes the output, and moves it into place unless it couldn't all be written
+void close_token_writer(token_writer *writer) {
+    output_buffer *out = &writer->out;
+
+    if (out->fd < 0) {
+        return;
+    }
+
+    flush_output(out);
+    close(out->fd);
+    free(out->data);
+
+    if (out->failed || rename(writer->temp_path, writer->path) != 0) {
+        report("Cannot write %s\n", writer->path);
+        remove(writer->temp_path);
+    }
+}
+
+// Writes every token from start_node on out as text, see write_tokens
+void save_tokens_to_file(const string *file_path, tk_node start_node, bool line_markers) {
+    token_writer writer;
+
+    open_token_writer(&writer, file_path, line_markers);
+    write_tokens(&writer, start_node, TK_NONE);
+    close_token_writer(&writer);
+}
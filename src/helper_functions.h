@@ -1,15 +1,39 @@
-#ifndef HELPER_FUNCTIONS_H
-#define HELPER_FUNCTIONS_H
-
-#include "common.h"
-
-tk_node *advance_list(tk_node *list, size_t amount);
-tk_node *insert_list_segment(tk_node *dest, tk_list_segment segment);
-
-void insert_token_into_list(tk_node *list_ptr, token token, memory_arena *arena);
-void remove_from_list(tk_node *list, const tk_node *start, const tk_node *end);
-void save_tokens_to_file(const string *file_path, tk_node *start_node);
-
-uint64_t hash(const string *str);
-
-#endif // HELPER_FUNCTIONS_H
+#ifndef HELPER_FUNCTIONS_H
+#define HELPER_FUNCTIONS_H
+
+#include "common.h"
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    bool failed;
+} output_buffer;
+
+// Preprocessed output being written to path
+typedef struct token_writer {
+    output_buffer out;
+    bool line_markers;
+    char path[MAX_FILEPATH_LENGTH];
+    char temp_path[MAX_FILEPATH_LENGTH + 8];
+
+    // The source line the next line of output would be taken to come from without a line marker,
+    // and the range of locations of the file the last marker was for
+    uint32_t next_line;
+    source_loc marked_file_start;
+    source_loc marked_file_end;
+    bool at_line_start;
+} token_writer;
+
+tk_node advance_list(tk_node list, size_t amount);
+tk_node insert_list_segment(tk_node dest, tk_list_segment segment);
+
+void insert_token_into_list(tk_node list_ptr, token token);
+void remove_from_list(tk_node before_start, tk_node end);
+void save_tokens_to_file(const string *file_path, tk_node start_node, bool line_markers);
+
+void open_token_writer(token_writer *writer, const string *file_path, bool line_markers);
+void write_tokens(token_writer *writer, tk_node start, tk_node end);
+void close_token_writer(token_writer *writer);
+
+#endif // HELPER_FUNCTIONS_H
@@ -0,0 +1,236 @@
+#include "hideset.h"
+#include "memory.h"
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HIDESET_ARENA_BLOCK_SIZE (1 << 20)
+#define INITIAL_HIDESET_SLOTS 1024
+#define UNION_CACHE_SIZE 4096
+
+// Allocated from the hide set arena. The atoms are sorted, so equal sets are stored the same way
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    atom atoms[];
+} hideset_entry;
+
+static THREAD_LOCAL memory_arena *hideset_arena;
+
+// Indexed by hide set, EMPTY_HIDESET is never stored
+static THREAD_LOCAL hideset_entry **hidesets;
+static THREAD_LOCAL uint32_t num_hidesets = 1;
+static THREAD_LOCAL uint32_t max_hidesets = 0;
+
+// Open addressing with linear probing, the number of slots is a power of 2
+static THREAD_LOCAL hideset *hideset_slots;
+static THREAD_LOCAL uint32_t num_slots = 0;
+
+// Expansion mostly takes the union of the same few sets over and over, so recent results are kept
+typedef struct {
+    hideset set_one;
+    hideset set_two;
+    hideset result;
+} union_cache_entry;
+
+static THREAD_LOCAL union_cache_entry union_cache[UNION_CACHE_SIZE];
+
+static uint64_t hash_atoms(const atom *atoms, uint32_t len) {
+    uint64_t hash = 0x9E3779B97F4A7C15 ^ len;
+
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ atoms[i]) * 0xFF51AFD7ED558CCD;
+    }
+
+    return hash ^ (hash >> 32);
+}
+
+static void grow_hideset_slots(void) {
+    const uint32_t new_num_slots = num_slots ? num_slots * 2 : INITIAL_HIDESET_SLOTS;
+    hideset *new_slots = calloc(new_num_slots, sizeof(hideset));
+
+    for (hideset set = 1; set < num_hidesets; set++) {
+        size_t index = hidesets[set]->hash & (new_num_slots - 1);
+
+        while (new_slots[index] != EMPTY_HIDESET) index = (index + 1) & (new_num_slots - 1);
+
+        new_slots[index] = set;
+    }
+
+    free(hideset_slots);
+    hideset_slots = new_slots;
+    num_slots = new_num_slots;
+}
+
+// Returns the ID of the set with the given sorted atoms, adding it if it's new
+static hideset intern_hideset(const atom *atoms, uint32_t len) {
+    if (len == 0) {
+        return EMPTY_HIDESET;
+    }
+
+    if (hideset_arena == NULL) {
+        hideset_arena = create_arena(HIDESET_ARENA_BLOCK_SIZE);
+        grow_hideset_slots();
+    }
+
+    const uint64_t hash = hash_atoms(atoms, len);
+    size_t index = hash & (num_slots - 1);
+
+    for (; hideset_slots[index] != EMPTY_HIDESET; index = (index + 1) & (num_slots - 1)) {
+        const hideset_entry *entry = hidesets[hideset_slots[index]];
+
+        if (entry->hash == hash && entry->len == len && memcmp(entry->atoms, atoms, len * sizeof(atom)) == 0) {
+            return hideset_slots[index];
+        }
+    }
+
+    if (num_hidesets >= max_hidesets) {
+        max_hidesets = max_hidesets ? max_hidesets * 2 : INITIAL_HIDESET_SLOTS;
+        hidesets = realloc(hidesets, max_hidesets * sizeof(hideset_entry *));
+    }
+
+    hideset_entry *entry = allocate_from_arena(hideset_arena, sizeof(hideset_entry) + len * sizeof(atom));
+
+    entry->hash = hash;
+    entry->len = len;
+    memcpy(entry->atoms, atoms, len * sizeof(atom));
+
+    const hideset new_set = num_hidesets++;
+
+    hidesets[new_set] = entry;
+    hideset_slots[index] = new_set;
+
+    // Keep the load factor below 1/2
+    if (num_hidesets * 2 > num_slots) {
+        grow_hideset_slots();
+    }
+
+    return new_set;
+}
+
+bool hideset_contains(hideset set, atom name) {
+    if (set == EMPTY_HIDESET) {
+        return false;
+    }
+
+    const hideset_entry *entry = hidesets[set];
+    uint32_t low = 0;
+    uint32_t high = entry->len;
+
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+
+        if (entry->atoms[middle] == name) return true;
+
+        if (entry->atoms[middle] < name) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return false;
+}
+
+hideset hideset_add(hideset set, atom name) {
+    if (set == EMPTY_HIDESET) {
+        return intern_hideset(&name, 1);
+    }
+
+    if (hideset_contains(set, name)) {
+        return set;
+    }
+
+    const hideset_entry *entry = hidesets[set];
+    atom atoms[entry->len + 1];
+    uint32_t len = 0;
+
+    for (uint32_t i = 0; i < entry->len && entry->atoms[i] < name; i++) {
+        atoms[len++] = entry->atoms[i];
+    }
+
+    atoms[len++] = name;
+
+    for (uint32_t i = len - 1; i < entry->len; i++) {
+        atoms[len++] = entry->atoms[i];
+    }
+
+    return intern_hideset(atoms, len);
+}
+
+hideset hideset_union(hideset set_one, hideset set_two) {
+    if (set_one == set_two || set_two == EMPTY_HIDESET) return set_one;
+    if (set_one == EMPTY_HIDESET) return set_two;
+
+    union_cache_entry *cached = &union_cache[((uint64_t) set_one * 0x9E3779B1 + set_two) & (UNION_CACHE_SIZE - 1)];
+
+    if (cached->set_one == set_one && cached->set_two == set_two) {
+        return cached->result;
+    }
+
+    const hideset_entry *entry_one = hidesets[set_one];
+    const hideset_entry *entry_two = hidesets[set_two];
+    atom atoms[entry_one->len + entry_two->len];
+    uint32_t len = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    while (i < entry_one->len || j < entry_two->len) {
+        if (j == entry_two->len || (i < entry_one->len && entry_one->atoms[i] < entry_two->atoms[j])) {
+            atoms[len++] = entry_one->atoms[i++];
+        } else if (i == entry_one->len || entry_two->atoms[j] < entry_one->atoms[i]) {
+            atoms[len++] = entry_two->atoms[j++];
+        } else {
+            atoms[len++] = entry_one->atoms[i++];
+            j++;
+        }
+    }
+
+    *cached = (union_cache_entry) {.set_one = set_one, .set_two = set_two, .result = intern_hideset(atoms, len)};
+
+    return cached->result;
+}
+
+hideset hideset_intersection(hideset set_one, hideset set_two) {
+    if (set_one == set_two) return set_one;
+    if (set_one == EMPTY_HIDESET || set_two == EMPTY_HIDESET) return EMPTY_HIDESET;
+
+    const hideset_entry *entry_one = hidesets[set_one];
+    const hideset_entry *entry_two = hidesets[set_two];
+    atom atoms[entry_one->len < entry_two->len ? entry_one->len : entry_two->len];
+    uint32_t len = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    while (i < entry_one->len && j < entry_two->len) {
+        if (entry_one->atoms[i] < entry_two->atoms[j]) {
+            i++;
+        } else if (entry_two->atoms[j] < entry_one->atoms[i]) {
+            j++;
+        } else {
+            atoms[len++] = entry_one->atoms[i++];
+            j++;
+        }
+    }
+
+    return intern_hideset(atoms, len);
+}
+
+// Every set is forgotten, only once nothing on the thread uses them any more
+void free_hidesets(void) {
+    if (hideset_arena != NULL) {
+        delete_arena(hideset_arena);
+    }
+
+    free(hidesets);
+    free(hideset_slots);
+
+    hideset_arena = NULL;
+    hidesets = NULL;
+    hideset_slots = NULL;
+    num_hidesets = 1;
+    max_hidesets = 0;
+    num_slots = 0;
+    memset(union_cache, 0, sizeof(union_cache));
+}
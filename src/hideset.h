@@ -0,0 +1,21 @@
+#ifndef HIDESET_H
+#define HIDESET_H
+
+#include "intern.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The macros a token came from, which can't be expanded again when the token is rescanned.
+// Sets are interned, so equal sets have the same ID and can be shared by any number of tokens
+typedef uint32_t hideset;
+
+#define EMPTY_HIDESET 0
+
+hideset hideset_add(hideset set, atom name);
+hideset hideset_union(hideset set_one, hideset set_two);
+hideset hideset_intersection(hideset set_one, hideset set_two);
+bool hideset_contains(hideset set, atom name);
+void free_hidesets(void);
+
+#endif // HIDESET_H
@@ -0,0 +1,400 @@
+#include "if_expression.h"
+#include "common.h"
+#include "enums.h"
+#include "thread_pool.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// #if arithmetic is done in intmax_t and uintmax_t, whatever the types of the constants.
+// Signed values are kept as their two's complement bits, so overflow wraps rather than being undefined
+typedef struct {
+    uintmax_t value;
+    bool is_unsigned;
+} if_value;
+
+// The #if line being evaluated, ptr is its next token
+typedef struct {
+    tk_node ptr;
+    bool failed; // Only the first error on the line is reported
+} if_parser;
+
+#define VALUE_BITS (sizeof(uintmax_t) * CHAR_BIT)
+
+static string defined_string = create_const_string("defined");
+static THREAD_LOCAL atom defined_atom;
+
+static if_value parse_expression(if_parser *parser, bool evaluate);
+static if_value parse_conditional(if_parser *parser, bool evaluate);
+
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+// The lexer keeps simple escapes as the character with the top bit set, and octal and hex escapes
+// as they were written. The value follows GCC on x86-64: char is signed, each further character
+// of a multi-character constant shifts the value up a byte, and wchar_t is a 32-bit int
+static intmax_t char_constant_value(const string *lexeme, bool wide) {
+    uintmax_t value = 0;
+    uint16_t num_chars = 0;
+    uint16_t i = 0;
+
+    while (i < lexeme->len) {
+        uintmax_t c = (uint8_t) lexeme->data[i++];
+
+        if (c & 0x80) {
+            c &= 0x7F;
+        } else if (c == '\\' && i < lexeme->len && lexeme->data[i] == 'x') {
+            for (c = 0, i++; i < lexeme->len && hex_digit_value(lexeme->data[i]) >= 0; i++) {
+                c = c * 16 + (uintmax_t) hex_digit_value(lexeme->data[i]);
+            }
+        } else if (c == '\\' && i < lexeme->len && lexeme->data[i] >= '0' && lexeme->data[i] <= '7') {
+            c = 0;
+
+            for (int digits = 0; digits < 3 && i < lexeme->len && lexeme->data[i] >= '0' && lexeme->data[i] <= '7'; digits++) {
+                c = c * 8 + (uintmax_t) (lexeme->data[i++] - '0');
+            }
+        }
+
+        // Only the last character of a wide multi-character constant counts
+        value = wide ? c : (value << CHAR_BIT) | (c & UCHAR_MAX);
+        num_chars++;
+    }
+
+    if (wide) {
+        return (int32_t) (uint32_t) value;
+    }
+
+    return num_chars == 1 ? (intmax_t) (signed char) value : (intmax_t) (int) (unsigned) value;
+}
+
+static void if_error(if_parser *parser, char *message) {
+    if (!parser->failed) {
+        error(tk.loc[parser->ptr], message);
+    }
+
+    parser->failed = true;
+}
+
+static void advance(if_parser *parser) {
+    do {
+        parser->ptr = tk.next[parser->ptr];
+    } while (tk.type[parser->ptr] == BLANK);
+}
+
+static bool at_end(const if_parser *parser) {
+    return tk.type[parser->ptr] == NEWLINE || tk.type[parser->ptr] == END || parser->failed;
+}
+
+static bool at_punctuator(const if_parser *parser, enum subtype punctuator) {
+    return !at_end(parser) && tk.type[parser->ptr] == PUNCTUATOR && tk.subtype[parser->ptr] == punctuator;
+}
+
+static void expect(if_parser *parser, enum subtype punctuator, char *message) {
+    if (at_punctuator(parser, punctuator)) {
+        advance(parser);
+    } else {
+        if_error(parser, message);
+    }
+}
+
+static intmax_t as_signed(if_value value) {
+    return value.value > INTMAX_MAX ? -(intmax_t) (UINTMAX_MAX - value.value) - 1 : (intmax_t) value.value;
+}
+
+static if_value signed_value(uintmax_t value) {
+    return (if_value) {.value = value, .is_unsigned = false};
+}
+
+// defined X or defined ( X ), parser is at the token after defined
+static if_value parse_defined(if_parser *parser) {
+    const bool parenthesised = at_punctuator(parser, PUN_LEFT_PARENTHESIS);
+
+    if (parenthesised) advance(parser);
+
+    if (at_end(parser) || (tk.type[parser->ptr] != IDENTIFIER && tk.type[parser->ptr] != KEYWORD)) {
+        if_error(parser, "Expected identifier after defined");
+        return signed_value(0);
+    }
+
+    const bool is_defined = macro_exists(parser->ptr) != NULL;
+    advance(parser);
+
+    if (parenthesised) expect(parser, PUN_RIGHT_PARENTHESIS, "Expected ) after defined");
+
+    return signed_value(is_defined);
+}
+
+static if_value parse_primary(if_parser *parser, bool evaluate) {
+    if (at_end(parser)) {
+        if_error(parser, "Expected value in #if");
+        return signed_value(0);
+    }
+
+    const tk_node value_node = parser->ptr;
+
+    if (at_punctuator(parser, PUN_LEFT_PARENTHESIS)) {
+        advance(parser);
+
+        const if_value value = parse_expression(parser, evaluate);
+        expect(parser, PUN_RIGHT_PARENTHESIS, "Expected ) in #if");
+
+        return value;
+    }
+
+    switch (tk.type[value_node]) {
+        case IDENTIFIER:
+        case KEYWORD:
+            advance(parser);
+
+            if (tk.atom[value_node] == defined_atom && tk.type[value_node] == IDENTIFIER) {
+                return parse_defined(parser);
+            }
+
+            // Any identifier left after expansion isn't a macro, so it's 0
+            if (at_punctuator(parser, PUN_LEFT_PARENTHESIS)) {
+                if_error(parser, "Function-like macro is not defined in #if");
+            }
+
+            return signed_value(0);
+        case CONSTANT:
+            advance(parser);
+
+            switch (tk.subtype[value_node]) {
+                case CONST_INTEGER:
+                case CONST_LONG:
+                case CONST_LONG_LONG:
+                    return signed_value(tk.value[value_node]);
+                case CONST_UNSIGNED_INT:
+                case CONST_UNSIGNED_LONG:
+                case CONST_UNSIGNED_LONG_LONG:
+                    return (if_value) {.value = tk.value[value_node], .is_unsigned = true};
+                case CONST_CHAR:
+                case CONST_WIDE_CHAR:
+                    return signed_value((uintmax_t) char_constant_value(&tk.lexeme[value_node],
+                                                                        tk.subtype[value_node] == CONST_WIDE_CHAR));
+                default:
+                    parser->ptr = value_node;
+                    if_error(parser, "Floating constant in #if");
+                    return signed_value(0);
+            }
+        default:
+            if_error(parser, "Expected value in #if");
+            return signed_value(0);
+    }
+}
+
+static if_value parse_unary(if_parser *parser, bool evaluate) {
+    if (at_end(parser) || tk.type[parser->ptr] != PUNCTUATOR) {
+        return parse_primary(parser, evaluate);
+    }
+
+    const enum subtype operator = tk.subtype[parser->ptr];
+    if_value operand;
+
+    switch (operator) {
+        case PUN_PLUS:
+            advance(parser);
+            return parse_unary(parser, evaluate);
+        case PUN_MINUS:
+            advance(parser);
+            operand = parse_unary(parser, evaluate);
+            return (if_value) {.value = 0 - operand.value, .is_unsigned = operand.is_unsigned};
+        case PUN_TILDE:
+            advance(parser);
+            operand = parse_unary(parser, evaluate);
+            return (if_value) {.value = ~operand.value, .is_unsigned = operand.is_unsigned};
+        case PUN_EXCLAMATION_MARK:
+            advance(parser);
+            operand = parse_unary(parser, evaluate);
+            return signed_value(operand.value == 0);
+        default:
+            return parse_primary(parser, evaluate);
+    }
+}
+
+// Higher binds tighter, 0 for anything that isn't a binary operator
+static int binary_precedence(const if_parser *parser) {
+    if (at_end(parser) || tk.type[parser->ptr] != PUNCTUATOR) {
+        return 0;
+    }
+
+    switch (tk.subtype[parser->ptr]) {
+        case PUN_ASTERISK:
+        case PUN_FWD_SLASH:
+        case PUN_REMAINDER: return 10;
+        case PUN_PLUS:
+        case PUN_MINUS: return 9;
+        case PUN_LEFT_BITSHIFT:
+        case PUN_RIGHT_BITSHIFT: return 8;
+        case PUN_LESS_THAN:
+        case PUN_GREATER_THAN:
+        case PUN_LESS_THAN_EQUAL:
+        case PUN_GREATER_THAN_EQUAL: return 7;
+        case PUN_EQUALITY:
+        case PUN_INEQUALITY: return 6;
+        case PUN_AMPERSAND: return 5;
+        case PUN_BITWISE_XOR: return 4;
+        case PUN_BITWISE_OR: return 3;
+        case PUN_LOGICAL_AND: return 2;
+        case PUN_LOGICAL_OR: return 1;
+        default: return 0;
+    }
+}
+
+// A shift by a negative amount shifts the other way, and shifting out every bit leaves 0,
+// or -1 for a negative signed value shifted right
+static if_value shift(if_value left, if_value right, bool shift_left) {
+    uintmax_t amount = right.value;
+
+    if (!right.is_unsigned && as_signed(right) < 0) {
+        shift_left = !shift_left;
+        amount = 0 - right.value;
+    }
+
+    const bool negative = !left.is_unsigned && as_signed(left) < 0;
+
+    if (amount >= VALUE_BITS) {
+        left.value = (!shift_left && negative) ? UINTMAX_MAX : 0;
+    } else if (shift_left) {
+        left.value <<= amount;
+    } else {
+        left.value = negative ? ~(~left.value >> amount) : left.value >> amount;
+    }
+
+    return left;
+}
+
+static if_value apply_binary(if_parser *parser, enum subtype operator, if_value left, if_value right, bool evaluate) {
+    // The usual arithmetic conversions, if either side is unsigned both are
+    const bool is_unsigned = left.is_unsigned || right.is_unsigned;
+    const intmax_t left_signed = as_signed(left);
+    const intmax_t right_signed = as_signed(right);
+
+    switch (operator) {
+        case PUN_ASTERISK: return (if_value) {left.value * right.value, is_unsigned};
+        case PUN_PLUS: return (if_value) {left.value + right.value, is_unsigned};
+        case PUN_MINUS: return (if_value) {left.value - right.value, is_unsigned};
+        case PUN_FWD_SLASH:
+        case PUN_REMAINDER:
+            if (right.value == 0) {
+                // Only an error if it's actually evaluated, e.g. not in x != 0 && y / x
+                if (evaluate) if_error(parser, "Division by zero in #if");
+                return (if_value) {0, is_unsigned};
+            }
+
+            if (is_unsigned) {
+                return (if_value) {operator == PUN_FWD_SLASH ? left.value / right.value : left.value % right.value, true};
+            }
+
+            // INTMAX_MIN / -1 overflows
+            if (left_signed == INTMAX_MIN && right_signed == -1) {
+                return signed_value(operator == PUN_FWD_SLASH ? left.value : 0);
+            }
+
+            return signed_value((uintmax_t) (operator == PUN_FWD_SLASH ? left_signed / right_signed
+                                                                        : left_signed % right_signed));
+        case PUN_LEFT_BITSHIFT: return shift(left, right, true);
+        case PUN_RIGHT_BITSHIFT: return shift(left, right, false);
+        case PUN_LESS_THAN:
+            return signed_value(is_unsigned ? left.value < right.value : left_signed < right_signed);
+        case PUN_GREATER_THAN:
+            return signed_value(is_unsigned ? left.value > right.value : left_signed > right_signed);
+        case PUN_LESS_THAN_EQUAL:
+            return signed_value(is_unsigned ? left.value <= right.value : left_signed <= right_signed);
+        case PUN_GREATER_THAN_EQUAL:
+            return signed_value(is_unsigned ? left.value >= right.value : left_signed >= right_signed);
+        case PUN_EQUALITY: return signed_value(left.value == right.value);
+        case PUN_INEQUALITY: return signed_value(left.value != right.value);
+        case PUN_AMPERSAND: return (if_value) {left.value & right.value, is_unsigned};
+        case PUN_BITWISE_XOR: return (if_value) {left.value ^ right.value, is_unsigned};
+        case PUN_BITWISE_OR: return (if_value) {left.value | right.value, is_unsigned};
+        default:
+            if_error(parser, "Unknown operator in #if");
+            return signed_value(0);
+    }
+}
+
+// Precedence climbing, every operator at or above min_precedence is parsed into the result.
+// The right side of && and || is only evaluated when the left doesn't decide the result
+static if_value parse_binary(if_parser *parser, int min_precedence, bool evaluate) {
+    if_value left = parse_unary(parser, evaluate);
+    int precedence;
+
+    while ((precedence = binary_precedence(parser)) >= min_precedence && precedence > 0) {
+        const enum subtype operator = tk.subtype[parser->ptr];
+        advance(parser);
+
+        if (operator == PUN_LOGICAL_AND || operator == PUN_LOGICAL_OR) {
+            const bool decided = (operator == PUN_LOGICAL_AND) == (left.value == 0);
+            const if_value right = parse_binary(parser, precedence + 1, evaluate && !decided);
+
+            left = signed_value(decided ? operator == PUN_LOGICAL_OR : right.value != 0);
+            continue;
+        }
+
+        const if_value right = parse_binary(parser, precedence + 1, evaluate);
+        left = apply_binary(parser, operator, left, right, evaluate);
+    }
+
+    return left;
+}
+
+static if_value parse_conditional(if_parser *parser, bool evaluate) {
+    const if_value condition = parse_binary(parser, 1, evaluate);
+
+    if (!at_punctuator(parser, PUN_QUESTION_MARK)) {
+        return condition;
+    }
+
+    advance(parser);
+
+    const if_value if_true = parse_expression(parser, evaluate && condition.value != 0);
+    expect(parser, PUN_COLON, "Expected : in #if");
+    const if_value if_false = parse_conditional(parser, evaluate && condition.value == 0);
+
+    return (if_value) {
+        .value = condition.value != 0 ? if_true.value : if_false.value,
+        .is_unsigned = if_true.is_unsigned || if_false.is_unsigned
+    };
+}
+
+static if_value parse_expression(if_parser *parser, bool evaluate) {
+    if_value value = parse_conditional(parser, evaluate);
+
+    while (at_punctuator(parser, PUN_COMMA)) {
+        advance(parser);
+        value = parse_conditional(parser, evaluate);
+    }
+
+    return value;
+}
+
+// Evaluates the controlling expression of an #if or #elif, once its macros have been expanded.
+// Expressions are parsed and evaluated in a single pass, only nesting uses the C stack
+bool evaluate_if(tk_node directive) {
+    if (defined_atom == NO_ATOM) {
+        defined_atom = intern(&defined_string);
+    }
+
+    if_parser parser = {.ptr = directive, .failed = false};
+    advance(&parser);
+
+    if (at_end(&parser)) {
+        if_error(&parser, "Expected expression after #if");
+        return false;
+    }
+
+    const if_value value = parse_expression(&parser, true);
+
+    if (!at_end(&parser)) {
+        if_error(&parser, "Missing binary operator in #if");
+    }
+
+    return !parser.failed && value.value != 0;
+}
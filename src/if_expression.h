@@ -0,0 +1,10 @@
+#ifndef IF_EXPRESSION_H
+#define IF_EXPRESSION_H
+
+#include "common.h"
+
+#include <stdbool.h>
+
+bool evaluate_if(tk_node directive);
+
+#endif // IF_EXPRESSION_H
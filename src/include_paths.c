@@ -0,0 +1,298 @@
+// pthread_rwlock_t isn't part of C99, and neither is the d_type of a directory entry
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include "include_paths.h"
+#include "hash_table.h"
+#include "memory.h"
+#include "strings.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MAX_INCLUDE_DIRS 64
+#define MAX_LISTED_DIRS 4096
+#define MAX_LISTED_ENTRIES (1 << 16)
+#define MAX_RESOLVED_INCLUDES (1 << 14)
+#define INCLUDE_ARENA_BLOCK_SIZE (1 << 20)
+
+// Searched after any -isystem directories
+static const char *default_system_dirs[] = {
+    "./standard_library_ready/", // TODO: Use own standard library
+    "/usr/local/lib/clang/21/include/",
+    "/usr/local/include/",
+    "/usr/include/x86_64-linux-gnu/",
+    "/usr/include/",
+};
+
+// <...> includes search the -I directories and then the system ones,
+// "..." includes look in the including file's directory first.
+// Every directory ends with a '/'
+// These are only added to before any translation unit starts, so every thread shares them
+static string user_dirs[MAX_INCLUDE_DIRS];
+static size_t num_user_dirs = 0;
+static string system_dirs[MAX_INCLUDE_DIRS];
+static size_t num_system_dirs = 0;
+
+static memory_arena *include_dir_arena;
+
+// The caches are filled in as headers are looked up, and shared by every thread. Looking up an include
+// that's already been resolved only takes the read lock, anything else is done with the write lock held.
+// Nothing in them is changed or freed once added, until free_include_cache
+static pthread_rwlock_t include_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static memory_arena *include_arena;
+
+// Directories that have been read, keyed by their path. Ones with too many entries to
+// fit in dir_entries are recorded as too_big, and looked up in the file system every time
+static ht *listed_dirs;
+// Every entry of the listed directories, keyed by its full path
+static ht *dir_entries;
+// Result of every include looked up, keyed by the header name, the kind of include and,
+// for "..." includes, the including file's directory
+static ht *resolved_includes;
+
+// Value for the set-like tables
+static const char present;
+static const char too_big;
+// Cached result for headers that aren't in any search directory
+static const string not_found;
+
+static void init_include_cache(void) {
+    include_arena = create_arena(INCLUDE_ARENA_BLOCK_SIZE);
+
+    listed_dirs = ht_alloc(MAX_LISTED_DIRS, ht_compare_strcmp, include_arena);
+    dir_entries = ht_alloc(MAX_LISTED_ENTRIES, ht_compare_strcmp, include_arena);
+    resolved_includes = ht_alloc(MAX_RESOLVED_INCLUDES, ht_compare_strcmp, include_arena);
+}
+
+static string *copy_to_arena(const string *str) {
+    string *copy = allocate_from_arena(include_arena, sizeof(string));
+
+    *copy = create_heap_string((uint16_t) (str->len + 1), include_arena);
+    string_copy(copy, str);
+
+    return copy;
+}
+
+// The tables are kept at most half full, past that lookups go to the file system
+static bool has_room(const ht *hash_table) {
+    return hash_table->length * 2 < hash_table->capacity;
+}
+
+void add_include_dir(const char *dir, bool is_system) {
+    string *dirs = is_system ? system_dirs : user_dirs;
+    size_t *num_dirs = is_system ? &num_system_dirs : &num_user_dirs;
+    const size_t len = strlen(dir);
+
+    if (include_dir_arena == NULL) {
+        include_dir_arena = create_arena(INCLUDE_ARENA_BLOCK_SIZE);
+    }
+
+    if (*num_dirs >= MAX_INCLUDE_DIRS || len == 0 || len + 1 >= MAX_FILEPATH_LENGTH) {
+        fprintf(stderr, "Ignoring include directory %s\n", dir);
+        return;
+    }
+
+    string new_dir = create_heap_string((uint16_t) (len + 2), include_dir_arena);
+    string_copy(&new_dir, &(string) {.data = (char *) dir, .len = (uint16_t) len, .cap = (uint16_t) (len + 1)});
+
+    if (dir[len - 1] != '/') {
+        string_cat_c(&new_dir, '/');
+    }
+
+    dirs[(*num_dirs)++] = new_dir;
+}
+
+// The default directories go after any given with -isystem, so they're added once all the options have been read
+void add_default_include_dirs(void) {
+    for (size_t i = 0; i < sizeof(default_system_dirs) / sizeof(default_system_dirs[0]); i++) {
+        add_include_dir(default_system_dirs[i], true);
+    }
+}
+
+// The -I directories, or the system ones, in the order they're searched
+const string *get_include_dirs(bool is_system, size_t *num_dirs) {
+    *num_dirs = is_system ? num_system_dirs : num_user_dirs;
+
+    return is_system ? system_dirs : user_dirs;
+}
+
+// Whether path is a regular file, or a link to one
+static bool is_regular_file(const char *path) {
+    struct stat file_stat;
+
+    return stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+// Reads every file in dir into dir_entries, leaving out subdirectories. A directory with more
+// entries than there's room for is recorded as too_big before any of them are added
+static void list_directory(const string *dir) {
+    const string *dir_key = copy_to_arena(dir);
+    string entry_path = create_local_string("", MAX_FILEPATH_LENGTH);
+
+    // A file in the working directory has no directory prefix
+    DIR *dir_stream = opendir(dir->len == 0 ? "." : dir_key->data);
+
+    // A directory that can't be opened is cached too, as having no entries
+    if (dir_stream == NULL) {
+        ht_add(listed_dirs, &present, dir_key);
+        return;
+    }
+
+    size_t num_entries = 0;
+
+    while (readdir(dir_stream) != NULL) {
+        num_entries++;
+    }
+
+    if ((dir_entries->length + num_entries) * 2 >= dir_entries->capacity) {
+        closedir(dir_stream);
+        ht_add(listed_dirs, &too_big, dir_key);
+        return;
+    }
+
+    rewinddir(dir_stream);
+
+    const struct dirent *entry;
+
+    while ((entry = readdir(dir_stream)) != NULL) {
+        const size_t name_len = strlen(entry->d_name);
+
+        if (dir->len + name_len >= MAX_FILEPATH_LENGTH || (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+                                                           entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+
+        string_copy(&entry_path, dir);
+        string_cat(&entry_path, &(string) {.data = (char *) entry->d_name, .len = (uint16_t) name_len});
+
+        // Without the type in the listing, or for a link, the file itself has to be looked at
+        if (entry->d_type != DT_REG && !is_regular_file(entry_path.data)) {
+            continue;
+        }
+
+        ht_add(dir_entries, &present, copy_to_arena(&entry_path));
+    }
+
+    closedir(dir_stream);
+
+    ht_add(listed_dirs, &present, dir_key);
+}
+
+// Checks if path is a file by looking it up in its directory's listing, so a missing
+// header costs at most one read of each directory rather than a failed open per include
+static bool path_exists(const string *path) {
+    const string last_slash = string_rstr(path, '/');
+    string dir = *path;
+
+    dir.len = last_slash.data == NULL ? 0 : (uint16_t) (last_slash.data - path->data + 1);
+
+    const char *listing = ht_get(listed_dirs, &dir);
+
+    if (listing == NULL && has_room(listed_dirs)) {
+        list_directory(&dir);
+        listing = ht_get(listed_dirs, &dir);
+    }
+
+    if (listing != &present) {
+        return is_regular_file(path->data);
+    }
+
+    return ht_get(dir_entries, path) != NULL;
+}
+
+// Builds dir + header_name into header_path and checks if it exists
+static bool try_include_dir(const string *dir, const string *header_name, string *header_path) {
+    if (dir->len + header_name->len >= MAX_FILEPATH_LENGTH) {
+        return false;
+    }
+
+    string_copy(header_path, dir);
+    string_cat(header_path, header_name);
+
+    return path_exists(header_path);
+}
+
+static bool search_include_dirs(const string *dirs, size_t num_dirs, const string *header_name, string *header_path) {
+    for (size_t i = 0; i < num_dirs; i++) {
+        if (try_include_dir(&dirs[i], header_name, header_path)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns the path of the header an #include refers to, or NULL if it can't be found.
+// including_dir is the directory prefix of the including file's path
+const string *find_include(const string *header_name, bool angled, const string *including_dir) {
+    // A header name can't contain the quote that ends it, so the key can't be ambiguous
+    string key = create_local_string("", 2 * MAX_FILEPATH_LENGTH + 4);
+    const string empty_dir = {.data = "", .len = 0, .cap = 1};
+
+    string_cat_c(&key, angled ? '<' : '"');
+    string_cat(&key, header_name);
+
+    if (!angled) {
+        string_cat_c(&key, '"');
+        string_cat(&key, including_dir);
+    }
+
+    pthread_rwlock_rdlock(&include_cache_lock);
+    const string *cached_path = resolved_includes == NULL ? NULL : ht_get(resolved_includes, &key);
+    pthread_rwlock_unlock(&include_cache_lock);
+
+    if (cached_path != NULL) {
+        return cached_path == &not_found ? NULL : cached_path;
+    }
+
+    pthread_rwlock_wrlock(&include_cache_lock);
+
+    if (include_arena == NULL) {
+        init_include_cache();
+    }
+
+    // Another thread could have looked it up since
+    cached_path = ht_get(resolved_includes, &key);
+
+    if (cached_path != NULL) {
+        pthread_rwlock_unlock(&include_cache_lock);
+        return cached_path == &not_found ? NULL : cached_path;
+    }
+
+    string header_path = create_local_string("", MAX_FILEPATH_LENGTH);
+    bool found_header;
+
+    if (header_name->len > 0 && header_name->data[0] == '/') {
+        found_header = try_include_dir(&empty_dir, header_name, &header_path);
+    } else {
+        found_header = (!angled && try_include_dir(including_dir, header_name, &header_path)) ||
+                       search_include_dirs(user_dirs, num_user_dirs, header_name, &header_path) ||
+                       search_include_dirs(system_dirs, num_system_dirs, header_name, &header_path);
+    }
+
+    const string *result = found_header ? copy_to_arena(&header_path) : NULL;
+
+    if (has_room(resolved_includes)) {
+        ht_add(resolved_includes, found_header ? result : &not_found, copy_to_arena(&key));
+    }
+
+    pthread_rwlock_unlock(&include_cache_lock);
+
+    return result;
+}
+
+// Only once every thread is done with it
+void free_include_cache(void) {
+    if (include_arena != NULL) {
+        delete_arena(include_arena);
+    }
+
+    include_arena = NULL;
+    listed_dirs = NULL;
+    dir_entries = NULL;
+    resolved_includes = NULL;
+}
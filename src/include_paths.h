@@ -0,0 +1,15 @@
+#ifndef INCLUDE_PATHS_H
+#define INCLUDE_PATHS_H
+
+#include "strings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void add_include_dir(const char *dir, bool is_system);
+void add_default_include_dirs(void);
+const string *get_include_dirs(bool is_system, size_t *num_dirs);
+const string *find_include(const string *header_name, bool angled, const string *including_dir);
+void free_include_cache(void);
+
+#endif // INCLUDE_PATHS_H
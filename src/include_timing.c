@@ -0,0 +1,372 @@
+// clock_gettime and CLOCK_MONOTONIC aren't part of C99
+#define _POSIX_C_SOURCE 199309L
+
+#include "include_timing.h"
+#include "common.h"
+#include "file_table.h"
+#include "hash_table.h"
+#include "memory.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A file's time runs from just before it's read until the preprocessor reaches its END token, which is
+// after everything it includes, so the files being timed nest like the includes. Time spent on the files
+// a file includes is its own inclusive time but not its exclusive time
+typedef struct {
+    uint64_t start;
+    uint64_t children_time;
+    uint32_t first_token; // tk.len when the file was started, the tokens made after it are the file's
+    size_t event; // SIZE_MAX until the file has been read
+} open_file;
+
+// Totals for one file over every translation unit
+typedef struct {
+    string path;
+    uint64_t inclusive_time;
+    uint64_t exclusive_time;
+    uint64_t bytes;
+    uint64_t tokens;
+    uint32_t times_included;
+    uint32_t times_skipped;
+} file_totals;
+
+THREAD_LOCAL include_timings *include_timing = NULL;
+
+static uint64_t timing_start;
+
+static THREAD_LOCAL open_file *open_files;
+static THREAD_LOCAL size_t num_open_files;
+static THREAD_LOCAL size_t max_open_files;
+
+static uint64_t clock_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec - timing_start;
+}
+
+// Times in the report are from here, it has to be called before any threads start
+void start_include_timing(void) {
+    timing_start = clock_ns();
+}
+
+static include_event *add_event(uint16_t file_id, size_t depth) {
+    if (include_timing->len == include_timing->cap) {
+        include_timing->cap = include_timing->cap ? include_timing->cap * 2 : 64;
+        include_timing->events = realloc(include_timing->events, include_timing->cap * sizeof(include_event));
+    }
+
+    include_event *event = &include_timing->events[include_timing->len++];
+    *event = (include_event) {.file_id = file_id, .depth = (uint16_t) depth};
+
+    return event;
+}
+
+// Starts timing a file before it's read, its ID isn't known until end_file_lexing
+void begin_file_timing(void) {
+    if (include_timing == NULL) {
+        return;
+    }
+
+    if (num_open_files == max_open_files) {
+        max_open_files = max_open_files ? max_open_files * 2 : 64;
+        open_files = realloc(open_files, max_open_files * sizeof(open_file));
+    }
+
+    open_files[num_open_files++] = (open_file) {.start = clock_ns(), .first_token = tk.len, .event = SIZE_MAX};
+}
+
+// The file started by begin_file_timing has been lexed or spliced in, any tokens made
+// after this come from macro expansion, the files it includes, or add_lexed_tokens
+void end_file_lexing(uint16_t file_id) {
+    if (include_timing == NULL || num_open_files == 0) {
+        return;
+    }
+
+    open_file *file = &open_files[num_open_files - 1];
+    include_event *event = add_event(file_id, num_open_files - 1);
+
+    event->start = file->start;
+    event->bytes = get_source_file(file_id)->size;
+    event->tokens = tk.len - file->first_token;
+
+    file->event = include_timing->len - 1;
+}
+
+// Tokens lexed after end_file_lexing, from conditional groups the lexer deferred or from a file that's read
+// a batch at a time. The file may not be the innermost one being timed by then, as it can include others
+void add_lexed_tokens(uint16_t file_id, uint32_t num_tokens) {
+    if (include_timing == NULL || num_tokens == 0) {
+        return;
+    }
+
+    for (size_t i = num_open_files; i > 0; i--) {
+        const size_t event = open_files[i - 1].event;
+
+        if (event != SIZE_MAX && include_timing->events[event].file_id == file_id) {
+            include_timing->events[event].tokens += num_tokens;
+            return;
+        }
+    }
+}
+
+// The file started by begin_file_timing couldn't be read
+void cancel_file_timing(void) {
+    if (include_timing != NULL && num_open_files > 0) {
+        num_open_files--;
+    }
+}
+
+// Called with the file of each END token the preprocessor reaches,
+// only the innermost file being timed can end, END tokens of any other file are ignored
+void end_file_timing(uint16_t file_id) {
+    if (include_timing == NULL || num_open_files == 0) {
+        return;
+    }
+
+    const open_file *file = &open_files[num_open_files - 1];
+
+    if (file->event != SIZE_MAX && include_timing->events[file->event].file_id != file_id) {
+        return;
+    }
+
+    const uint64_t inclusive_time = clock_ns() - file->start;
+
+    if (file->event != SIZE_MAX) {
+        include_event *event = &include_timing->events[file->event];
+
+        event->inclusive_time = inclusive_time;
+        event->exclusive_time = inclusive_time - file->children_time;
+    }
+
+    num_open_files--;
+
+    if (num_open_files > 0) {
+        open_files[num_open_files - 1].children_time += inclusive_time;
+    }
+}
+
+void record_skipped_file(uint16_t file_id) {
+    if (include_timing != NULL) {
+        add_event(file_id, num_open_files)->skipped = true;
+    }
+}
+
+// Ends the files still being timed, at least the main file, and copies the paths of the files
+// in the events, as the file table belongs to the thread that ran the translation unit
+void finish_include_timing(void) {
+    if (include_timing == NULL) {
+        return;
+    }
+
+    while (num_open_files > 0) {
+        const size_t event = open_files[num_open_files - 1].event;
+        end_file_timing(event != SIZE_MAX ? include_timing->events[event].file_id : 0);
+    }
+
+    include_timing->num_paths = source_file_count();
+    include_timing->paths = calloc(include_timing->num_paths, sizeof(char *));
+
+    for (size_t i = 0; i < include_timing->len; i++) {
+        const uint16_t file_id = include_timing->events[i].file_id;
+
+        if (include_timing->paths[file_id] == NULL) {
+            const string *path = &get_source_file(file_id)->path;
+
+            include_timing->paths[file_id] = malloc(path->len + 1u);
+            memcpy(include_timing->paths[file_id], path->data, path->len);
+            include_timing->paths[file_id][path->len] = 0;
+        }
+    }
+}
+
+void free_open_files(void) {
+    free(open_files);
+
+    open_files = NULL;
+    num_open_files = 0;
+    max_open_files = 0;
+}
+
+// Most costly first
+static int compare_totals(const void *totals_one, const void *totals_two) {
+    const file_totals *one = totals_one;
+    const file_totals *two = totals_two;
+
+    if (one->exclusive_time != two->exclusive_time) {
+        return one->exclusive_time < two->exclusive_time ? 1 : -1;
+    }
+
+    return string_cmp(&one->path, &two->path);
+}
+
+// Writes a table of the time, bytes and tokens each file accounted for over all the translation units,
+// sorted by exclusive time. A file's inclusive time isn't counted again while it's including itself
+bool write_include_report(const char *path, const include_timings *timings, size_t num_timings) {
+    FILE *report_file = fopen(path, "w");
+
+    if (report_file == NULL) {
+        return false;
+    }
+
+    size_t max_files = 1;
+
+    for (size_t i = 0; i < num_timings; i++) max_files += timings[i].num_paths;
+
+    memory_arena *totals_arena = create_arena(sizeof(ht) + 2 * max_files * sizeof(ht_entry));
+    ht *totals_table = ht_alloc(2 * max_files, ht_compare_strcmp, totals_arena);
+    file_totals *totals = calloc(max_files, sizeof(file_totals));
+    size_t num_totals = 0;
+    uint16_t *open_file_ids = NULL;
+    size_t max_depth = 0;
+
+    for (size_t i = 0; i < num_timings; i++) {
+        for (size_t j = 0; j < timings[i].len; j++) {
+            const include_event *event = &timings[i].events[j];
+            const char *file_path = timings[i].paths[event->file_id];
+            const string key = {.data = (char *) file_path, .len = (uint16_t) strlen(file_path),
+                                .cap = (uint16_t) (strlen(file_path) + 1)};
+
+            file_totals *file = (file_totals *) ht_get(totals_table, &key);
+
+            if (file == NULL) {
+                file = &totals[num_totals++];
+                file->path = key;
+                ht_add(totals_table, file, &file->path);
+            }
+
+            if (event->skipped) {
+                file->times_skipped++;
+                continue;
+            }
+
+            // The files an event is inside are the last ones seen at each smaller depth
+            if (event->depth >= max_depth) {
+                max_depth = event->depth + 1u;
+                open_file_ids = realloc(open_file_ids, max_depth * sizeof(uint16_t));
+            }
+
+            open_file_ids[event->depth] = event->file_id;
+
+            bool nested_in_itself = false;
+
+            for (uint16_t depth = 0; depth < event->depth; depth++) {
+                nested_in_itself |= open_file_ids[depth] == event->file_id;
+            }
+
+            file->times_included++;
+            file->bytes += event->bytes;
+            file->tokens += event->tokens;
+            file->exclusive_time += event->exclusive_time;
+            file->inclusive_time += nested_in_itself ? 0 : event->inclusive_time;
+        }
+    }
+
+    qsort(totals, num_totals, sizeof(file_totals), compare_totals);
+
+    file_totals overall = {0};
+
+    fprintf(report_file, "%12s %12s %9s %9s %12s %10s  %s\n",
+            "exclusive ms", "inclusive ms", "included", "skipped", "bytes", "tokens", "file");
+
+    for (size_t i = 0; i < num_totals; i++) {
+        fprintf(report_file, "%12.3f %12.3f %9u %9u %12llu %10llu  %s\n",
+                (double) totals[i].exclusive_time / 1e6, (double) totals[i].inclusive_time / 1e6,
+                totals[i].times_included, totals[i].times_skipped, (unsigned long long) totals[i].bytes,
+                (unsigned long long) totals[i].tokens, totals[i].path.data);
+
+        overall.exclusive_time += totals[i].exclusive_time;
+        overall.times_included += totals[i].times_included;
+        overall.times_skipped += totals[i].times_skipped;
+        overall.bytes += totals[i].bytes;
+        overall.tokens += totals[i].tokens;
+    }
+
+    fprintf(report_file, "%12.3f %12s %9u %9u %12llu %10llu  %s\n",
+            (double) overall.exclusive_time / 1e6, "", overall.times_included, overall.times_skipped,
+            (unsigned long long) overall.bytes, (unsigned long long) overall.tokens, "total");
+
+    free(open_file_ids);
+    free(totals);
+    delete_arena(totals_arena);
+
+    return fclose(report_file) == 0;
+}
+
+static void write_json_string(FILE *out_file, const char *text) {
+    fputc('\"', out_file);
+
+    for (; *text != 0; text++) {
+        if (*text == '\"' || *text == '\\') {
+            fputc('\\', out_file);
+            fputc(*text, out_file);
+        } else if ((unsigned char) *text < 0x20) {
+            fprintf(out_file, "\\u%04x", (unsigned) (unsigned char) *text);
+        } else {
+            fputc(*text, out_file);
+        }
+    }
+
+    fputc('\"', out_file);
+}
+
+// Writes every file that was read as a Chrome trace event (for chrome://tracing or Perfetto),
+// with a track for each translation unit named after its main file
+bool write_include_trace(const char *path, const include_timings *timings, size_t num_timings) {
+    FILE *trace_file = fopen(path, "w");
+    bool first_event = true;
+
+    if (trace_file == NULL) {
+        return false;
+    }
+
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", trace_file);
+
+    for (size_t i = 0; i < num_timings; i++) {
+        for (size_t j = 0; j < timings[i].len; j++) {
+            const include_event *event = &timings[i].events[j];
+
+            if (event->skipped) continue;
+
+            fputs(first_event ? "\n" : ",\n", trace_file);
+            first_event = false;
+
+            if (event->depth == 0) {
+                fprintf(trace_file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": ",
+                        i + 1);
+                write_json_string(trace_file, timings[i].paths[event->file_id]);
+                fputs("}},\n", trace_file);
+            }
+
+            fputs("{\"name\": ", trace_file);
+            write_json_string(trace_file, timings[i].paths[event->file_id]);
+            fprintf(trace_file, ", \"cat\": \"include\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"exclusive_us\": %.3f, \"bytes\": %u, \"tokens\": %u}}",
+                    i + 1, (double) event->start / 1e3, (double) event->inclusive_time / 1e3,
+                    (double) event->exclusive_time / 1e3, event->bytes, event->tokens);
+        }
+    }
+
+    fputs("\n]}\n", trace_file);
+
+    return fclose(trace_file) == 0;
+}
+
+void free_include_timings(include_timings *timings, size_t num_timings) {
+    for (size_t i = 0; i < num_timings; i++) {
+        for (uint16_t file_id = 0; timings[i].paths != NULL && file_id < timings[i].num_paths; file_id++) {
+            free(timings[i].paths[file_id]);
+        }
+
+        free(timings[i].paths);
+        free(timings[i].events);
+    }
+
+    free(timings);
+}
@@ -0,0 +1,51 @@
+#ifndef INCLUDE_TIMING_H
+#define INCLUDE_TIMING_H
+
+#include "thread_pool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One inclusion of a file: from just before it's read until the preprocessor reaches its END token.
+// Times are in nanoseconds, start is from when timing was started
+typedef struct {
+    uint16_t file_id;
+    uint16_t depth; // 0 for the main file
+    bool skipped; // By its include guard or #pragma once, it has no times, bytes or tokens
+    uint32_t bytes;
+    uint32_t tokens; // Lexed, including deferred groups, or spliced from the header cache or a precompiled header
+    uint64_t start;
+    uint64_t inclusive_time;
+    uint64_t exclusive_time; // Less the time spent on the files it included
+} include_event;
+
+// Everything recorded for one translation unit, in the order the files were included
+typedef struct {
+    include_event *events;
+    size_t len;
+    size_t cap;
+
+    char **paths; // Indexed by file_id, filled in once the translation unit is finished
+    uint16_t num_paths;
+} include_timings;
+
+// The translation unit being timed on this thread, NULL when there's nothing to record
+extern THREAD_LOCAL include_timings *include_timing;
+
+void start_include_timing(void);
+
+void begin_file_timing(void);
+void end_file_lexing(uint16_t file_id);
+void add_lexed_tokens(uint16_t file_id, uint32_t num_tokens);
+void cancel_file_timing(void);
+void end_file_timing(uint16_t file_id);
+void record_skipped_file(uint16_t file_id);
+void finish_include_timing(void);
+void free_open_files(void);
+
+bool write_include_report(const char *path, const include_timings *timings, size_t num_timings);
+bool write_include_trace(const char *path, const include_timings *timings, size_t num_timings);
+void free_include_timings(include_timings *timings, size_t num_timings);
+
+#endif // INCLUDE_TIMING_H
@@ -0,0 +1,116 @@
+#include "intern.h"
+#include "hash_table.h"
+#include "memory.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_ARENA_MAX_SIZE (1 << 26)
+#define INITIAL_INTERN_SLOTS 4096
+
+// Allocated from the intern arena, so pointers to the string stay valid as the table grows
+typedef struct {
+    string str;
+    uint64_t hash;
+} interned_string;
+
+static THREAD_LOCAL memory_arena *intern_arena;
+
+// Indexed by atom, atom 0 (NO_ATOM) is unused
+static THREAD_LOCAL interned_string **atoms;
+static THREAD_LOCAL uint32_t num_atoms = 1;
+static THREAD_LOCAL uint32_t max_atoms = 0;
+
+// Open addressing with linear probing, the number of slots is a power of 2
+static THREAD_LOCAL atom *intern_slots;
+static THREAD_LOCAL uint32_t num_slots = 0;
+
+static void grow_intern_slots(void) {
+    const uint32_t new_num_slots = num_slots ? num_slots * 2 : INITIAL_INTERN_SLOTS;
+    atom *new_slots = calloc(new_num_slots, sizeof(atom));
+
+    for (atom atom = 1; atom < num_atoms; atom++) {
+        size_t index = atoms[atom]->hash & (new_num_slots - 1);
+
+        while (new_slots[index] != NO_ATOM) index = (index + 1) & (new_num_slots - 1);
+
+        new_slots[index] = atom;
+    }
+
+    free(intern_slots);
+    intern_slots = new_slots;
+    num_slots = new_num_slots;
+}
+
+atom intern(const string *str) {
+    if (intern_arena == NULL) {
+        intern_arena = create_arena(INTERN_ARENA_MAX_SIZE);
+        grow_intern_slots();
+    }
+
+    const uint64_t hash = ht_hash(str);
+    size_t index = hash & (num_slots - 1);
+
+    for (; intern_slots[index] != NO_ATOM; index = (index + 1) & (num_slots - 1)) {
+        const interned_string *entry = atoms[intern_slots[index]];
+
+        if (entry->hash == hash && string_cmp(&entry->str, str) == 0) {
+            return intern_slots[index];
+        }
+    }
+
+    if (num_atoms >= max_atoms) {
+        max_atoms = max_atoms ? max_atoms * 2 : INITIAL_INTERN_SLOTS;
+        atoms = realloc(atoms, max_atoms * sizeof(interned_string *));
+    }
+
+    interned_string *entry = allocate_from_arena(intern_arena, sizeof(interned_string));
+
+    entry->str = create_heap_string((uint16_t) (str->len + 1), intern_arena);
+    entry->hash = hash;
+    string_copy(&entry->str, str);
+
+    const atom new_atom = num_atoms++;
+
+    atoms[new_atom] = entry;
+    intern_slots[index] = new_atom;
+
+    // Keep the load factor below 1/2
+    if (num_atoms * 2 > num_slots) {
+        grow_intern_slots();
+    }
+
+    return new_atom;
+}
+
+// Every atom is forgotten, only once nothing on the thread uses them any more
+void free_intern_table(void) {
+    if (intern_arena != NULL) {
+        delete_arena(intern_arena);
+    }
+
+    free(atoms);
+    free(intern_slots);
+
+    intern_arena = NULL;
+    atoms = NULL;
+    intern_slots = NULL;
+    num_atoms = 1;
+    max_atoms = 0;
+    num_slots = 0;
+}
+
+const string *atom_to_string(atom atom) {
+    assert(atom != NO_ATOM && atom < num_atoms);
+
+    return &atoms[atom]->str;
+}
+
+uint64_t atom_hash(atom atom) {
+    assert(atom != NO_ATOM && atom < num_atoms);
+
+    return atoms[atom]->hash;
+}
@@ -0,0 +1,20 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "strings.h"
+
+#include <stdint.h>
+
+#define NO_ATOM 0
+
+// Each distinct identifier spelling is interned once and referred to by its atom,
+// so identifiers can be compared with an integer compare
+typedef uint32_t atom;
+
+atom intern(const string *str);
+
+const string *atom_to_string(atom atom);
+uint64_t atom_hash(atom atom);
+void free_intern_table(void);
+
+#endif // INTERN_H
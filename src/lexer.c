@@ -1,932 +1,1538 @@
-#include "lexer.h"
-#include "common.h"
-#include "enums.h"
-#include "strings.h"
-#include "lexer.h"
-
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-memory_arena *token_arena;
-tk_node *tokens;
-size_t num_tokens = 0;
-
-file_info files[MAX_NUM_FILES];
-int files_top = -1;
-
-bool escaped;
-
-static string newline_string = create_const_string("\n");
-static string empty_string = create_const_string("");
-
-// Maps subtype enums to their string representation
-const string subtype_strings[] = {
-    // Keywords
-    [KW_AUTO] = create_const_string("auto"),
-    [KW_BREAK] = create_const_string("break"),
-    [KW_CASE] = create_const_string("case"),
-    [KW_CHAR] = create_const_string("char"),
-    [KW_CONST] = create_const_string("const"),
-    [KW_CONTINUE] = create_const_string("continue"),
-    [KW_DEFAULT] = create_const_string("default"),
-    [KW_DO] = create_const_string("do"),
-    [KW_DOUBLE] = create_const_string("double"),
-    [KW_ELSE] = create_const_string("else"),
-    [KW_ENUM] = create_const_string("enum"),
-    [KW_EXTERN] = create_const_string("extern"),
-    [KW_FLOAT] = create_const_string("float"),
-    [KW_FOR] = create_const_string("for"),
-    [KW_GOTO] = create_const_string("goto"),
-    [KW_IF] = create_const_string("if"),
-    [KW_INLINE] = create_const_string("inline"),
-    [KW_INT] = create_const_string("int"),
-    [KW_LONG] = create_const_string("long"),
-    [KW_REGISTER] = create_const_string("register"),
-    [KW_RESTRICT] = create_const_string("restrict"),
-    [KW_RETURN] = create_const_string("return"),
-    [KW_SHORT] = create_const_string("short"),
-    [KW_SIGNED] = create_const_string("signed"),
-    [KW_SIZEOF] = create_const_string("sizeof"),
-    [KW_STATIC] = create_const_string("static"),
-    [KW_STRUCT] = create_const_string("struct"),
-    [KW_SWITCH] = create_const_string("switch"),
-    [KW_TYPEDEF] = create_const_string("typedef"),
-    [KW_UNION] = create_const_string("union"),
-    [KW_UNSIGNED] = create_const_string("unsigned"),
-    [KW_VOID] = create_const_string("void"),
-    [KW_VOLATILE] = create_const_string("volatile"),
-    [KW_WHILE] = create_const_string("while"),
-    [KW__BOOL] = create_const_string("_Bool"),
-    [KW__COMPLEX] = create_const_string("_Complex"),
-    [KW__IMAGINARY] = create_const_string("_Imaginary"),
-
-    // Punctuators
-    [PUN_LEFT_SQUARE_BRACKET] = create_const_string("["),
-    [PUN_RIGHT_SQUARE_BRACKET] = create_const_string("]"),
-    [PUN_LEFT_PARENTHESIS] = create_const_string("("),
-    [PUN_RIGHT_PARENTHESIS] = create_const_string(")"),
-    [PUN_LEFT_BRACE] = create_const_string("{"),
-    [PUN_RIGHT_BRACE] = create_const_string("}"),
-    [PUN_DOT] = create_const_string("."),
-    [PUN_ARROW] = create_const_string("->"),
-    [PUN_INCREMENT] = create_const_string("++"),
-    [PUN_DECREMENT] = create_const_string("--"),
-    [PUN_AMPERSAND] = create_const_string("&"),
-    [PUN_ASTERISK] = create_const_string("*"),
-    [PUN_PLUS] = create_const_string("+"),
-    [PUN_MINUS] = create_const_string("-"),
-    [PUN_TILDE] = create_const_string("~"),
-    [PUN_EXCLAMATION_MARK] = create_const_string("!"),
-    [PUN_FWD_SLASH] = create_const_string("/"),
-    [PUN_REMAINDER] = create_const_string("%"),
-    [PUN_LEFT_BITSHIFT] = create_const_string("<<"),
-    [PUN_RIGHT_BITSHIFT] = create_const_string(">>"),
-    [PUN_LESS_THAN] = create_const_string("<"),
-    [PUN_GREATER_THAN] = create_const_string(">"),
-    [PUN_LESS_THAN_EQUAL] = create_const_string("<="),
-    [PUN_GREATER_THAN_EQUAL] = create_const_string(">="),
-    [PUN_EQUALITY] = create_const_string("=="),
-    [PUN_INEQUALITY] = create_const_string("!="),
-    [PUN_BITWISE_XOR] = create_const_string("^"),
-    [PUN_BITWISE_OR] = create_const_string("|"),
-    [PUN_LOGICAL_AND] = create_const_string("&&"),
-    [PUN_LOGICAL_OR] = create_const_string("||"),
-    [PUN_QUESTION_MARK] = create_const_string("?"),
-    [PUN_COLON] = create_const_string(":"),
-    [PUN_SEMICOLON] = create_const_string(";"),
-    [PUN_ELLIPSIS] = create_const_string("..."),
-    [PUN_ASSIGNMENT] = create_const_string("="),
-    [PUN_MULTIPLY_ASSIGNMENT] = create_const_string("*="),
-    [PUN_DIVIDE_ASSIGNMENT] = create_const_string("/="),
-    [PUN_MOD_ASSIGNMENT] = create_const_string("%="),
-    [PUN_PLUS_ASSIGNMENT] = create_const_string("+="),
-    [PUN_MINUS_ASSIGNMENT] = create_const_string("-="),
-    [PUN_LEFT_BITSHIFT_ASSIGNMENT] = create_const_string("<<="),
-    [PUN_RIGHT_BITSHIFT_ASSIGNMENT] = create_const_string(">>="),
-    [PUN_AND_ASSIGNMENT] = create_const_string("&="),
-    [PUN_XOR_ASSIGNMENT] = create_const_string("^="),
-    [PUN_OR_ASSIGNMENT] = create_const_string("|="),
-    [PUN_COMMA] = create_const_string(","),
-    [PUN_HASH] = create_const_string("#"),
-    [PUN_DOUBLE_HASH] = create_const_string("##"),
-    [PUN_NONE] = create_const_string(""),
-
-    [CONST_INTEGER] = create_const_string(""),
-    [CONST_UNSIGNED_INT] = create_const_string(""),
-    [CONST_LONG] = create_const_string(""),
-    [CONST_UNSIGNED_LONG] = create_const_string(""),
-    [CONST_LONG_LONG] = create_const_string(""),
-    [CONST_UNSIGNED_LONG_LONG] = create_const_string(""),
-    [CONST_FLOAT] = create_const_string(""),
-    [CONST_DOUBLE] = create_const_string(""),
-    [CONST_LONG_DOUBLE] = create_const_string(""),
-    [CONST_CHAR] = create_const_string(""),
-    [CONST_WIDE_CHAR] = create_const_string(""),
-
-    // Directives
-    [DIRECTIVE_IF] = create_const_string("if"),
-    [DIRECTIVE_IFDEF] = create_const_string("ifdef"),
-    [DIRECTIVE_IFNDEF] = create_const_string("ifndef"),
-    [DIRECTIVE_ELIF] = create_const_string("elif"),
-    [DIRECTIVE_ELSE] = create_const_string("else"),
-    [DIRECTIVE_ENDIF] = create_const_string("endif"),
-    [DIRECTIVE_INCLUDE] = create_const_string("include"),
-    [DIRECTIVE_DEFINE] = create_const_string("define"),
-    [DIRECTIVE_UNDEF] = create_const_string("undef"),
-    [DIRECTIVE_LINE] = create_const_string("line"),
-    [DIRECTIVE_WARNING] = create_const_string("warning"),
-    [DIRECTIVE_ERROR] = create_const_string("error"),
-    [DIRECTIVE_PRAGMA] = create_const_string("pragma"),
-    [DIRECTIVE_NULL] = create_const_string("")
-};
-
-#define NUM_SUBTYPES sizeof(subtype_strings) / sizeof(subtype_strings[0])
-
-// Removes tokens from start (inclusive) to end (exclusive)
-// Returns pointer to element before start
-tk_node *remove_tokens(const tk_node *start, const tk_node *end) {
-    tk_node *ptr = tokens;
-
-    for (; ptr->next != start; ptr = ptr->next);
-
-    tk_node *before_remove = ptr;
-
-    for (; ptr != end; ptr = ptr->next);
-
-    before_remove->next = ptr;
-
-    return before_remove;
-}
-
-char consume_next_char(void) {
-    if (FILES_TOP.buffer.pos == FILES_TOP.buffer.size) {
-        if (escaped) error(&FILES_TOP.filepath, FILES_TOP.current_line, "Lone \\");
-        return EOF;
-    }
-
-    const char c = FILES_TOP.buffer.data[FILES_TOP.buffer.pos++];
-
-    if (c == '\n') {
-        FILES_TOP.current_pos = 0;
-        FILES_TOP.current_line++;
-    }
-
-    escaped = !escaped && (c == '\\');
-
-    return c;
-}
-
-char peek_next_char(void) {
-    if (FILES_TOP.buffer.pos == FILES_TOP.buffer.size) {
-        return EOF;
-    }
-
-    return FILES_TOP.buffer.data[FILES_TOP.buffer.pos];
-}
-
-char peek_ahead_char(size_t characters_ahead) {
-    if (FILES_TOP.buffer.pos+characters_ahead-1 >= FILES_TOP.buffer.size) {
-        return EOF;
-    }
-
-
-    return FILES_TOP.buffer.data[FILES_TOP.buffer.pos+characters_ahead-1];
-}
-
-char consume_escaped_char(void) {
-    escaped = false;
-    char consumed_char = consume_next_char();
-    switch (consumed_char) {
-        case 'r': return '\r';
-        case 'n': return '\n';
-        case 't': return '\t';
-        case '"': return '"';
-        case '\'': return '\'';
-        case '\\': return '\\';
-
-        default:
-            error(&FILES_TOP.filepath, FILES_TOP.current_line, "Unexpected escape character");
-            return consumed_char;
-    }
-}
-
-void consume_whitespace(void) {
-    char c = peek_next_char();
-    while (c == ' ' || c == '\t' || c == '\r') {
-        consume_next_char();
-        c = peek_next_char();
-        FILES_TOP.current_pos++;
-    }
-}
-
-bool match(const char expected) {
-    return peek_next_char() == expected;
-}
-
-bool is_hex(const char c) {
-    return (c >= '0' && c <= '9') ||
-           (c >= 'a' && c <= 'f') ||
-           (c >= 'A' && c <= 'F');
-}
-
-bool is_numeric(const char c) {
-    return c >= '0' && c <= '9';
-}
-
-bool is_alpha(const char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z');
-}
-
-bool is_alphanumeric(const char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           (c >= '0' && c <= '9') ||
-            c == '_';
-}
-
-bool is_whitespace(const char c) {
-    return c == ' ' || c == '\t' ||
-           c == '\r';
-}
-
-// h headers can be most characters except >
-bool is_h_header_char(const char c) {
-    return (c >= 'a' && c <= '~') ||
-           (c >= 'A' && c <= '_') ||
-           (c >= '%' && c <= '=') ||
-           (c >= '!' && c <= '#') ||
-            c == '?';
-}
-
-// q headers can be most characters except "
-bool is_q_header_char(const char c) {
-    return (c >= 'a' && c <= '~') ||
-           (c >= 'A' && c <= '_') ||
-           (c >= '%' && c <= '?') ||
-            c == '!' || c == '#'  ||
-            c == '?';
-}
-
-bool not_end_of_string(const char c) {
-    return escaped || (c != '"' && c != EOF);
-}
-
-bool not_end_of_char_const(const char c) {
-    return escaped || (c != '\'' && c != EOF);
-}
-
-// Builds up a lexeme by consuming characters until
-// a character does not satisfy the compare function
-void build_lexme(bool compare_func(char), string *lexeme, bool allocate) {
-    string *str = allocate ? &create_local_string("", MAX_LEXEME_LENGTH) : lexeme;
-    char *str_data_ptr = &str->data[str->len];
-    char overflow_char;
-
-    while (compare_func(peek_next_char())) {
-        *str_data_ptr = consume_next_char();
-
-        if (escaped) {
-            if (peek_next_char() == '\r') {consume_next_char();}
-            if (peek_next_char() == '\n') {
-                consume_next_char();
-                continue;
-            }
-
-            char peeked_char = peek_next_char();
-
-            // Skip \x, \0..\7, treat them as a normal character following a backslash
-            if (peeked_char != 'x' && (peeked_char < '0' || peeked_char > '7')) {
-                *str_data_ptr = (char) (consume_escaped_char() | 0x80);
-            }
-        }
-
-        if (str->len == str->cap - 1) {
-            str_data_ptr = &overflow_char;
-        } else {
-            str_data_ptr++;
-            str->len++;
-        }
-    }
-    *str_data_ptr = '\0';
-
-    if (allocate) {
-        *lexeme = create_heap_string(str->len+1, token_arena);
-        string_copy(lexeme, str);
-    }
-}
-
-void create_punctuator_token(token* new_token, const enum subtype punctuator) {
-    *new_token = (token) {.type = PUNCTUATOR, .subtype = punctuator,
-                       .lexeme = subtype_strings[punctuator], .line = FILES_TOP.current_line};
-}
-
-void create_identifier_or_keyword_token(token* new_token, char c) {
-    *new_token = (token) {.lexeme = {0}, .line = FILES_TOP.current_line};
-
-    string tmp_str = create_local_string(c, MAX_LEXEME_LENGTH);
-    tmp_str.len++;
-
-    build_lexme(is_alphanumeric, &tmp_str, false);
-
-    // Check for keyword
-    for (enum subtype enum_num = 0; enum_num < NUM_SUBTYPES; enum_num++) {
-        if (string_cmp(&tmp_str, &subtype_strings[enum_num]) == 0) {
-            new_token->type = KEYWORD;
-            new_token->lexeme = subtype_strings[enum_num];
-            new_token->subtype = enum_num;
-
-            return;
-        }
-    }
-
-    // If we're here, the lexeme is an identifier
-    new_token->type = IDENTIFIER;
-    new_token->lexeme = create_heap_string(tmp_str.len+1, token_arena);
-    string_copy(&new_token->lexeme, &tmp_str);
-}
-
-void create_string_literal_token(token* new_token) {
-    *new_token = (token) {.type = STRING_LITERAL, .line = FILES_TOP.current_line};
-
-    build_lexme(not_end_of_string, &new_token->lexeme, true);
-
-    if (peek_next_char() == EOF) {
-        error(&FILES_TOP.filepath, FILES_TOP.current_line, "Expected end of string");
-        return;
-    }
-
-    consume_next_char(); // Consume the ending "
-}
-
-#define SUFFIX_NONE 0
-#define SUFFIX_U 1
-#define SUFFIX_L 2
-#define SUFFIX_LL 4
-#define SUFFIX_F 8
-
-void convert_to_base_10(const size_t base, string *in_str, string *out_str) {
-    size_t result = 0;
-    size_t digit = SIZE_MAX;
-    size_t position_power = 1;
-
-    for (size_t i = in_str->len - 1; i != SIZE_MAX; i--) {
-        if (in_str->data[i] >= '0' && in_str->data[i] <= '9') digit = (size_t) in_str->data[i] - '0';
-        if (in_str->data[i] >= 'a' && in_str->data[i] <= 'f') digit = (size_t) in_str->data[i] - 'a' + 10;
-        if (in_str->data[i] >= 'A' && in_str->data[i] <= 'F') digit = (size_t) in_str->data[i] - 'A' + 10;
-
-        if (digit == SIZE_MAX) {
-            error(&FILES_TOP.filepath, FILES_TOP.current_line, "Error converting to base 10: Invalid digit");
-        }
-
-        result += digit * position_power;
-        position_power *= base;
-    }
-
-    out_str->data[0] = '\0'; // In case in_str and out_str are the same
-    out_str->len = (uint16_t) sprintf(out_str->data, "%ld", result);
-}
-
-void create_constant_token(token* new_token, const char c) {
-    *new_token = (token) {.type = CONSTANT, .subtype = CONST_INTEGER,
-                          .lexeme = {0}, .line = FILES_TOP.current_line};
-
-    char next_char = peek_next_char();
-    size_t base = 10;
-
-    string tmp_str = create_local_string(c, MAX_LEXEME_LENGTH);
-    tmp_str.len = 1;
-
-    if (c == '0') {
-        tmp_str.data[0] = 0;
-        tmp_str.len = 0;
-
-        if ((next_char & 95) == 'X') {
-            base = 16;
-            consume_next_char();
-
-            build_lexme(is_hex, &tmp_str, false);
-        }
-        else if (is_numeric(next_char)) {
-            base = 8;
-            build_lexme(is_numeric, &tmp_str, false);
-        }
-        else {
-            tmp_str.data[0] = '0';
-            tmp_str.len = 1;
-        }
-    } else {
-        build_lexme(is_numeric, &tmp_str, false);
-    }
-
-    if (base != 10) convert_to_base_10(base, &tmp_str, &tmp_str);
-
-    next_char = peek_next_char();
-
-    // Floating point constant handling
-    if (next_char == '.') {
-        new_token->subtype = CONST_DOUBLE;
-        string_cat_c(&tmp_str, '.');
-        consume_next_char();
-
-        if (base == 10) {
-            build_lexme(is_numeric, &tmp_str, false);
-        } else if (base == 16) {
-            build_lexme(is_hex, &tmp_str, false);
-        } else {
-            error(&FILES_TOP.filepath, new_token->line, "Invalid base for floating constant");
-            return;
-        }
-
-        next_char = peek_next_char();
-
-        if ((next_char & 95) == 'P') {
-            if (base == 10) {
-                error(&FILES_TOP.filepath, new_token->line, "Found binary exponent part in decimal floating constant");
-                return;
-            }
-
-            consume_next_char();
-            string_cat_c(&tmp_str, 'P');
-            build_lexme(is_numeric, &tmp_str, false);
-        }
-    } else {
-        new_token->subtype = CONST_INTEGER;
-    }
-
-    if ((next_char & 95) == 'E') {
-        if (base == 16) {
-            error(&FILES_TOP.filepath, new_token->line, "Found exponent part in hexadecimal floating constant");
-            return;
-        }
-
-        consume_next_char();
-        string_cat_c(&tmp_str, 'E');
-
-        next_char = peek_next_char();
-
-        if (next_char == '+' || next_char == '-') {
-            consume_next_char();
-            string_cat_c(&tmp_str, next_char);
-        }
-
-        build_lexme(is_numeric, &tmp_str, false);
-    }
-
-    next_char = peek_next_char();
-
-    if (!is_alpha(next_char)) {
-        new_token->lexeme = create_heap_string(tmp_str.len+1, token_arena);
-        string_copy(&new_token->lexeme, &tmp_str);
-        return; // No suffix
-    }
-
-    build_lexme(is_alpha, &tmp_str, false);
-
-    char *suffix_ptr = &tmp_str.data[tmp_str.len-1];
-
-    new_token->lexeme = create_heap_string(tmp_str.len+1, token_arena);
-    string_copy(&new_token->lexeme, &tmp_str);
-
-    if (strlen(suffix_ptr) > 3) {
-        error(&FILES_TOP.filepath, new_token->line, "Unknown number suffix");
-        return;
-    }
-
-    short suffix = 0;
-
-    for (; *suffix_ptr != '\0'; suffix_ptr++) {
-        // Convert to upper case
-        *suffix_ptr &= 95;
-
-        if (*suffix_ptr != 'U' && *suffix_ptr != 'L' && *suffix_ptr != 'F') {
-            error(&FILES_TOP.filepath, new_token->line, "Unknown number suffix");
-            return;
-        }
-
-        switch (*suffix_ptr) {
-            case 'U':
-                if (*(suffix_ptr+1) == 'U') {
-                    error(&FILES_TOP.filepath, new_token->line, "Unknown number suffix");
-                    return;
-                }
-                suffix |= SUFFIX_U;
-                break;
-            case 'L':
-                if (*(suffix_ptr+1) == 'L') {
-                    suffix |= SUFFIX_LL;
-                    break;
-                }
-                suffix |= SUFFIX_L;
-                break;
-            case 'F':
-                suffix |= SUFFIX_F;
-        }
-    }
-
-    // TODO: Need to check the value can be represented by the suffix
-    if (new_token->subtype == CONST_INTEGER) {
-        switch (suffix) {
-            case SUFFIX_U: new_token->subtype = CONST_UNSIGNED_INT; break;
-            case SUFFIX_L: new_token->subtype = CONST_LONG; break;
-            case SUFFIX_LL: new_token->subtype = CONST_LONG_LONG; break;
-            case SUFFIX_U | SUFFIX_L: new_token->subtype = CONST_UNSIGNED_LONG; break;
-            case SUFFIX_U | SUFFIX_LL: new_token->subtype = CONST_UNSIGNED_LONG_LONG; break;
-            case SUFFIX_F: new_token->subtype = CONST_FLOAT; break;
-
-            default: error(&FILES_TOP.filepath, new_token->line, "Unknown integer suffix"); break;
-        }
-    }
-    else if (new_token->subtype == CONST_DOUBLE) {
-        switch (suffix) {
-            case SUFFIX_F: new_token->subtype = CONST_FLOAT; break;
-            case SUFFIX_L: new_token->subtype = CONST_LONG_DOUBLE; break;
-            default: error(&FILES_TOP.filepath, new_token->line, "Unknown integer suffix"); break;
-        }
-    }
-}
-
-void create_character_token(token* new_token, bool wide) {
-    *new_token = (token) {.type = CONSTANT, .line = FILES_TOP.current_line};
-
-    new_token->subtype = wide ? CONST_WIDE_CHAR : CONST_CHAR;
-
-    if (wide) {consume_next_char();} // Consume the starting '
-
-    build_lexme(not_end_of_char_const, &new_token->lexeme, true);
-
-    if (peek_next_char() != '\'') {
-        error(&FILES_TOP.filepath, new_token->line, "Expected \'");
-    }
-
-    consume_next_char(); // Consume the ending '
-}
-
-void create_directive_token(token* new_token) {
-    consume_whitespace();
-
-    *new_token = (token) {.type = DIRECTIVE, .lexeme = {0}, .line = FILES_TOP.current_line};
-
-    build_lexme(is_alpha, &new_token->lexeme, true);
-
-    // Check for directive
-    for (enum subtype enum_num = DIRECTIVE_IF; enum_num < NUM_SUBTYPES; enum_num++) {
-        if (string_cmp(&new_token->lexeme, &subtype_strings[enum_num]) == 0) {
-            new_token->subtype = enum_num;
-
-            in_include = (new_token->subtype == DIRECTIVE_INCLUDE);
-            in_define = (new_token->subtype == DIRECTIVE_DEFINE);
-
-            return;
-        }
-    }
-
-    error(&FILES_TOP.filepath, FILES_TOP.current_line, "Unknown directive");
-}
-
-void create_header_token(token *new_token, header_type type) {
-    consume_whitespace();
-
-    *new_token = (token) {.type = HEADER_NAME, .lexeme = {0}, .line = FILES_TOP.current_line};
-
-    switch (type) {
-        case H_HEADER:
-            build_lexme(is_h_header_char, &new_token->lexeme, true);
-            consume_whitespace();
-            consume_next_char(); // Consume the ending `>`
-
-            new_token->subtype = HEADER_H;
-            break;
-        case Q_HEADER:
-            build_lexme(is_q_header_char, &new_token->lexeme, true);
-            consume_next_char(); // Consume the ending `"`
-
-            new_token->subtype = HEADER_Q;
-            break;
-    }
-
-    in_include = false;
-}
-
-void create_newline_token(token *new_token) {
-    // FILES_TOP.current_line was incremented when the newline was read,
-    // so -1 to get the actual line the newline is on
-    *new_token = (token) {.type = NEWLINE, .lexeme = newline_string, .line = FILES_TOP.current_line-1};
-
-    in_define = false;
-}
-
-void create_blank_token(token *new_token) {
-    *new_token = (token) {.type = BLANK, .lexeme = empty_string, .line = FILES_TOP.current_line};
-}
-
-void create_end_token(token *new_token) {
-    *new_token = (token) {.type = END, .lexeme = empty_string, .line = FILES_TOP.current_line};
-}
-
-token scan_token(void) {
-    char *r_slash_ptr = NULL;
-    bool follows_whitespace = false;
-    token new_token = {0};
-    new_token.line = -1;
-
-    while (new_token.line == -1) {
-        char c = consume_next_char();
-        switch (c) {
-            // Punctuator
-            case '[': create_punctuator_token(&new_token, PUN_LEFT_SQUARE_BRACKET); break;
-            case ']': create_punctuator_token(&new_token, PUN_RIGHT_SQUARE_BRACKET); break;
-            case '(': create_punctuator_token(&new_token, PUN_LEFT_PARENTHESIS); break;
-            case ')': create_punctuator_token(&new_token, PUN_RIGHT_PARENTHESIS); break;
-            case '{': create_punctuator_token(&new_token, PUN_LEFT_BRACE); break;
-            case '}': create_punctuator_token(&new_token, PUN_RIGHT_BRACE); break;
-            case '.':
-                switch (peek_next_char()) {
-                    case '.': if (peek_ahead_char(2) == '.') {create_punctuator_token(&new_token, PUN_ELLIPSIS); consume_next_char();}
-                    consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_DOT); break;
-                }
-            break;
-
-            case '-':
-                switch (peek_next_char()) {
-                    case '>': create_punctuator_token(&new_token, PUN_ARROW); consume_next_char(); break;
-                    case '-': create_punctuator_token(&new_token, PUN_DECREMENT); consume_next_char(); break;
-                    case '=': create_punctuator_token(&new_token, PUN_MINUS_ASSIGNMENT); consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_MINUS); break;
-                }
-            break;
-
-            case '&':
-                switch(peek_next_char()) {
-                    case '&': create_punctuator_token(&new_token, PUN_LOGICAL_AND); consume_next_char(); break;
-                    case '=': create_punctuator_token(&new_token, PUN_AND_ASSIGNMENT); consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_AMPERSAND); break;
-                }
-            break;
-
-            case '*':
-                switch (peek_next_char()) {
-                    case '=': create_punctuator_token(&new_token, PUN_MULTIPLY_ASSIGNMENT);
-                    consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_ASTERISK); break;
-                }
-            break;
-
-            case '+':
-                switch (peek_next_char()) {
-                    case '+': create_punctuator_token(&new_token, PUN_INCREMENT); consume_next_char(); break;
-                    case '=': create_punctuator_token(&new_token, PUN_PLUS_ASSIGNMENT); consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_PLUS); break;
-                }
-            break;
-
-            case '~': create_punctuator_token(&new_token, PUN_TILDE); break;
-            case '!':
-                switch(peek_next_char()) {
-                    case '=': create_punctuator_token(&new_token, PUN_INEQUALITY);
-                    consume_next_char(); break;
-
-                    default: create_punctuator_token(&new_token, PUN_EXCLAMATION_MARK); break;
-                }
-            break;
-
-            case '/':
-                switch (peek_next_char()) {
-                    // If we're in a comment, consume characters until the next line
-                    case '/': while (consume_next_char() != '\n'); create_newline_token(&new_token); break;
-                    case '*': ; // Technically a variable declaration can't follow directly after "case"
-                    int in_comment = 1;
-                    while (in_comment) {
-                        switch (consume_next_char()) {
-                            case '*' : if (peek_next_char() == '/') { consume_next_char(); in_comment = 0;} break;
-                            default  : break;
-                        }
-                    }
-                    break;
-                    case '=': create_punctuator_token(&new_token, PUN_DIVIDE_ASSIGNMENT); consume_next_char(); break;
-
-                    default: create_punctuator_token(&new_token, PUN_FWD_SLASH); break;
-                }
-            break;
-
-            case '%':
-                switch (peek_next_char()) {
-                    case '=': create_punctuator_token(&new_token, PUN_MOD_ASSIGNMENT);
-                    consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_REMAINDER); break;
-                }
-            break;
-
-            case '<':
-                switch (peek_next_char()) {
-                    case '<':
-                        if (peek_ahead_char(2) == '=') {
-                            create_punctuator_token(&new_token, PUN_LEFT_BITSHIFT_ASSIGNMENT);
-                            consume_next_char();
-                        }
-                        else {
-                            create_punctuator_token(&new_token, PUN_LEFT_BITSHIFT);
-                        }
-                    consume_next_char();
-                    break;
-
-                    case '=': create_punctuator_token(&new_token, PUN_LESS_THAN_EQUAL); consume_next_char(); break;
-
-                    default:
-                        if (in_include) {
-                            create_header_token(&new_token, H_HEADER);
-                        } else {
-                            create_punctuator_token(&new_token, PUN_LESS_THAN);
-                        }
-
-                        break;
-                }
-            break;
-
-            case '>':
-                switch (peek_next_char()) {
-                    case '>':
-                        if (peek_ahead_char(2) == '=') {
-                            create_punctuator_token(&new_token, PUN_RIGHT_BITSHIFT_ASSIGNMENT);
-                            consume_next_char();
-                        }
-                        else {
-                            create_punctuator_token(&new_token, PUN_RIGHT_BITSHIFT);
-                        }
-                    consume_next_char();
-                    break;
-
-                    case '=': create_punctuator_token(&new_token, PUN_GREATER_THAN_EQUAL); consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_GREATER_THAN); break;
-                }
-            break;
-
-            case '^':
-                switch(peek_next_char()) {
-                    case '=': create_punctuator_token(&new_token, PUN_XOR_ASSIGNMENT);
-                    consume_next_char(); break;
-
-                    default:  create_punctuator_token(&new_token, PUN_BITWISE_XOR); break;
-                }
-            break;
-
-            case '|':
-                switch(peek_next_char()) {
-                    case '|': create_punctuator_token(&new_token, PUN_LOGICAL_OR); consume_next_char(); break;
-                    case '=': create_punctuator_token(&new_token, PUN_XOR_ASSIGNMENT); consume_next_char(); break;
-
-                    default: create_punctuator_token(&new_token, PUN_BITWISE_OR); break;
-                }
-            break;
-
-            case '?': create_punctuator_token(&new_token, PUN_QUESTION_MARK); break;
-            case ':': create_punctuator_token(&new_token, PUN_COLON); break;
-            case ';': create_punctuator_token(&new_token, PUN_SEMICOLON); break;
-            case '=':
-                switch (peek_next_char()) {
-                    case '=': create_punctuator_token(&new_token, PUN_EQUALITY);
-                    consume_next_char(); break;
-
-                    default: create_punctuator_token(&new_token, PUN_ASSIGNMENT); break;
-                }
-            break;
-
-            case ',': create_punctuator_token(&new_token, PUN_COMMA); break;
-            case '#':
-                switch (peek_next_char()) {
-                    case '#': create_punctuator_token(&new_token, PUN_DOUBLE_HASH);
-                    consume_next_char(); break;
-
-                    default:
-                        if (in_define) {
-                            create_punctuator_token(&new_token, PUN_HASH);
-                        }
-                        else {
-                            create_directive_token(&new_token); break;
-                        }
-                }
-            break;
-
-
-            // White space characters
-            case '\n': create_newline_token(&new_token); break;
-            case '\r':
-            case '\t':
-            case ' ' :
-                while (is_whitespace(peek_next_char())) consume_next_char();
-                follows_whitespace = true; break;
-
-            // String literal
-            case '"':
-                if (in_include) {
-                    create_header_token(&new_token, Q_HEADER); break;
-                } else {
-                    create_string_literal_token(&new_token); break;
-                }
-
-            // Character constant
-            case '\'': create_character_token(&new_token, false); break;
-            case 'L':
-                if (peek_next_char() == '\'') {create_character_token(&new_token, true);}
-                else {create_identifier_or_keyword_token(&new_token, c);}
-                break;
-
-            // End of file
-            case EOF:
-                create_end_token(&new_token);
-                new_token.src_filepath = create_heap_string(MAX_FILEPATH_LENGTH, token_arena);
-
-                string_copy(&new_token.src_filepath, &FILES_TOP.filepath);
-                r_slash_ptr = string_rstr(&new_token.src_filepath, '/').data;
-                if (r_slash_ptr != NULL) {
-                    new_token.filename_index = (uint16_t) (r_slash_ptr - new_token.src_filepath.data + 1);
-                }
-
-                free(FILES_TOP.buffer.data);
-                files_top--;
-                return new_token;
-
-            // Backslash followed by new line
-            case '\\':
-                if (peek_next_char() == '\r') {consume_next_char();}
-                if (peek_next_char() == '\n') {consume_next_char();}
-                break;
-
-            default:
-                // Number
-                if (is_numeric(c)) {
-                    create_constant_token(&new_token, c);
-                }
-                // Keyword/Identifier
-                else if (is_alphanumeric(c)) {
-                    create_identifier_or_keyword_token(&new_token, c);
-                }
-                else {
-                    error(&FILES_TOP.filepath, FILES_TOP.current_line, "Unknown token");
-                }
-        }
-    }
-
-    new_token.follows_whitespace = follows_whitespace;
-    new_token.src_filepath = create_heap_string(FILES_TOP.filepath.len+1, token_arena);
-
-    string_copy(&new_token.src_filepath, &FILES_TOP.filepath);
-    r_slash_ptr = string_rstr(&new_token.src_filepath, '/').data;
-    if (r_slash_ptr != NULL) {
-        new_token.filename_index = (uint16_t) (r_slash_ptr - new_token.src_filepath.data + 1);
-    }
-
-    return new_token;
-}
-
-void scan_and_insert_tokens(tk_node *insert_point) {
-    tk_node *ptr = insert_point->next;
-    while (files_top >= 0) {
-        insert_point->next = allocate_from_arena(token_arena, sizeof(tk_node));
-        insert_point->next->token = scan_token();
-        insert_point->next->next = ptr;
-        insert_point = insert_point->next;
-    }
-}
-
-bool add_file(const string *file_path) {
-    char file_path_cstr[MAX_LEXEME_LENGTH];
-
-    strcpy(file_path_cstr, file_path->data);
-    file_path_cstr[file_path->len] = 0;
-
-    FILE *file_stream = fopen(file_path_cstr, "rb");
-    size_t file_size;
-
-    if (file_stream == NULL) {
-        return NULL;
-    }
-
-    fseek(file_stream, 0, SEEK_END);
-    file_size = (size_t) ftell(file_stream);
-    rewind(file_stream);
-
-    files[++files_top] = (file_info) {.buffer = {.size = file_size, .pos = 0},
-                                      .filepath = {.cap = file_path->cap, file_path->len},
-                                      .current_pos = 0, .current_line = 1};
-
-    files[files_top].buffer.data = malloc(file_size);
-    files[files_top].filepath.data = malloc(file_path->cap);
-
-    fread(FILES_TOP.buffer.data, 1, file_size, file_stream);
-    string_copy(&files[files_top].filepath, file_path);
-
-    fclose(file_stream);
-
-    return true;
-}
+#include "lexer.h"
+#include "char_scan.h"
+#include "common.h"
+#include "enums.h"
+#include "file_table.h"
+#include "include_timing.h"
+#include "manifest.h"
+#include "perfect_hash.h"
+#include "lexer_tables.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+THREAD_LOCAL memory_arena *token_arena;
+THREAD_LOCAL tk_node tokens;
+THREAD_LOCAL size_t num_tokens = 0;
+
+THREAD_LOCAL file_info files[MAX_NUM_FILES];
+THREAD_LOCAL int files_top = -1;
+
+// When set, files are mmap'd and lexemes without escapes or line splices
+// point straight into the source buffer instead of being copied
+bool zero_copy_lexing = false;
+
+// Set when the translation unit is only preprocessed, so its tokens can be written out and dropped
+// a batch at a time. Large files are then always read through a window, see lex_more_tokens
+THREAD_LOCAL bool streaming_output = false;
+
+// Source buffers that lexemes or deferred groups may still point into, freed by release_source_buffers()
+static THREAD_LOCAL buff *retained_buffers = NULL;
+static THREAD_LOCAL size_t num_retained_buffers = 0;
+static THREAD_LOCAL size_t max_retained_buffers = 0;
+
+// Windows that have been moved on from while lexemes may still point into them,
+// freed once those tokens have been written out by release_written_tokens
+static THREAD_LOCAL char **retired_windows = NULL;
+static THREAD_LOCAL size_t num_retired_windows = 0;
+static THREAD_LOCAL size_t max_retired_windows = 0;
+
+// What lex_more_tokens has seen of the lines it's lexed, to find where a batch can end
+static THREAD_LOCAL uint32_t paren_depth = 0; // Outside of directives
+static THREAD_LOCAL bool in_directive_line = false;
+static THREAD_LOCAL bool in_include_line = false;
+
+// A header read a batch at a time has its include guard looked for as it's lexed, the same way
+// find_include_guard looks through the tokens of a whole file, see watch_include_guard
+enum guard_state {GUARD_START, GUARD_NAME, GUARD_BODY, GUARD_ENDIF_LINE, GUARD_TRAILING};
+
+static THREAD_LOCAL uint16_t guarded_file_id = NO_FILE_ID;
+static THREAD_LOCAL enum guard_state guard_state;
+static THREAD_LOCAL atom guard_name;
+static THREAD_LOCAL uint32_t guard_level;
+
+THREAD_LOCAL bool escaped;
+
+// Location of the first character of the token being scanned
+static THREAD_LOCAL source_loc token_start_loc;
+
+// Set while scanning an #if, #ifdef, #ifndef, #elif or #else line whose group can be deferred,
+// then group_follows is set by the newline ending it, so the next token is the deferred group
+static THREAD_LOCAL bool in_conditional_directive = false;
+static THREAD_LOCAL bool group_follows = false;
+
+// Set from a directive's # to the newline ending its line, which is made up if the file ends first
+static THREAD_LOCAL bool in_directive = false;
+
+static string newline_string = create_const_string("\n");
+static string empty_string = create_const_string("");
+
+// Maps subtype enums to their string representation
+const string subtype_strings[] = {
+    // Keywords
+#define KW(name, str) [KW_##name] = create_const_string(str),
+    KEYWORDS
+#undef KW
+
+    // Punctuators
+#define PUN(name, str) [PUN_##name] = create_const_string(str),
+    PUNCTUATORS
+#undef PUN
+    [PUN_NONE] = create_const_string(""),
+
+    [CONST_INTEGER] = create_const_string(""),
+    [CONST_UNSIGNED_INT] = create_const_string(""),
+    [CONST_LONG] = create_const_string(""),
+    [CONST_UNSIGNED_LONG] = create_const_string(""),
+    [CONST_LONG_LONG] = create_const_string(""),
+    [CONST_UNSIGNED_LONG_LONG] = create_const_string(""),
+    [CONST_FLOAT] = create_const_string(""),
+    [CONST_DOUBLE] = create_const_string(""),
+    [CONST_LONG_DOUBLE] = create_const_string(""),
+    [CONST_CHAR] = create_const_string(""),
+    [CONST_WIDE_CHAR] = create_const_string(""),
+
+    // Directives
+#define DIR(name, str) [DIRECTIVE_##name] = create_const_string(str),
+    DIRECTIVES
+#undef DIR
+    [DIRECTIVE_NULL] = create_const_string("")
+};
+
+// Returns the keyword lexeme is, or PUN_NONE if it isn't a keyword
+enum subtype find_keyword(const string *lexeme) {
+    if (lexeme->len == 0 || lexeme->len > KEYWORD_MAX_LENGTH) {
+        return PUN_NONE;
+    }
+
+    const enum subtype keyword = keyword_hash_table[perfect_hash(lexeme->data, lexeme->len,
+                                                                 KEYWORD_HASH_SEED, KEYWORD_HASH_BITS)];
+
+    return string_cmp(lexeme, &subtype_strings[keyword]) == 0 ? keyword : PUN_NONE;
+}
+
+// Returns the directive lexeme is, or PUN_NONE if it isn't a directive
+enum subtype find_directive(const string *lexeme) {
+    if (lexeme->len == 0) {
+        return DIRECTIVE_NULL;
+    }
+
+    if (lexeme->len > DIRECTIVE_MAX_LENGTH) {
+        return PUN_NONE;
+    }
+
+    const enum subtype directive = directive_hash_table[perfect_hash(lexeme->data, lexeme->len,
+                                                                     DIRECTIVE_HASH_SEED, DIRECTIVE_HASH_BITS)];
+
+    return string_cmp(lexeme, &subtype_strings[directive]) == 0 ? directive : PUN_NONE;
+}
+
+// Bytes guaranteed to be in the window at the start of each token (unless the file ends first),
+// so tokens scanned straight out of the buffer never run across a refill
+#define WINDOW_LOOKAHEAD MAX_LEXEME_LENGTH
+// Already consumed bytes kept when the window moves, for checks like the backslash before a newline
+#define WINDOW_LOOKBEHIND 16
+
+// Location of the next character to be consumed
+static source_loc lexer_loc(void) {
+    return make_source_loc(FILES_TOP.file_id, FILES_TOP.buffer.offset + FILES_TOP.buffer.pos);
+}
+
+static void retire_window(char *data) {
+    if (num_retired_windows == max_retired_windows) {
+        max_retired_windows = max_retired_windows ? max_retired_windows * 2 : 64;
+        retired_windows = realloc(retired_windows, max_retired_windows * sizeof(char *));
+    }
+
+    retired_windows[num_retired_windows++] = data;
+}
+
+static void free_retired_windows(void) {
+    for (size_t i = 0; i < num_retired_windows; i++) {
+        free(retired_windows[i]);
+    }
+
+    num_retired_windows = 0;
+}
+
+// Slides the window along the file, keeping the unconsumed bytes, and tops it up from the stream.
+// Returns false once there is nothing left to read
+static bool refill_window(file_info *file) {
+    buff *buffer = &file->buffer;
+
+    if (buffer->stream == NULL) {
+        return false;
+    }
+
+    const size_t keep_from = buffer->pos > WINDOW_LOOKBEHIND ? buffer->pos - WINDOW_LOOKBEHIND : 0;
+    const size_t kept = buffer->size - keep_from;
+    const size_t old_capacity = buffer->capacity;
+
+    // Only a line scanned for the end of a group can fill the whole window, see create_group_token
+    if (kept == buffer->capacity) {
+        buffer->capacity *= 2;
+    }
+
+    // Lexemes may point into the window when zero-copy lexing, so the kept bytes go into a new one
+    if (zero_copy_lexing || buffer->capacity != old_capacity) {
+        char *new_data = malloc(buffer->capacity);
+
+        memcpy(new_data, &buffer->data[keep_from], kept);
+
+        if (zero_copy_lexing) {
+            retire_window(buffer->data);
+        } else {
+            free(buffer->data);
+        }
+
+        buffer->data = new_data;
+    } else {
+        memmove(buffer->data, &buffer->data[keep_from], kept);
+    }
+
+    buffer->offset += keep_from;
+    buffer->pos -= keep_from;
+
+    const size_t space = buffer->capacity - kept;
+    const size_t bytes_wanted = space < buffer->remaining ? space : buffer->remaining;
+    const size_t bytes_read = fread(&buffer->data[kept], 1, bytes_wanted, buffer->stream);
+
+    build_line_table(file->file_id, &buffer->data[kept], buffer->offset + kept, bytes_read);
+    buffer->size = kept + bytes_read;
+    buffer->remaining -= bytes_read;
+
+    if (bytes_read < bytes_wanted || buffer->remaining == 0) {
+        fclose(buffer->stream);
+        buffer->stream = NULL;
+    }
+
+    return bytes_read > 0;
+}
+
+char consume_next_char(void) {
+    if (FILES_TOP.buffer.pos == FILES_TOP.buffer.size && !refill_window(&FILES_TOP)) {
+        if (escaped) error(lexer_loc(), "Lone \\");
+        return EOF;
+    }
+
+    const char c = FILES_TOP.buffer.data[FILES_TOP.buffer.pos++];
+
+    escaped = !escaped && (c == '\\');
+
+    return c;
+}
+
+char peek_next_char(void) {
+    if (FILES_TOP.buffer.pos == FILES_TOP.buffer.size && !refill_window(&FILES_TOP)) {
+        return EOF;
+    }
+
+    return FILES_TOP.buffer.data[FILES_TOP.buffer.pos];
+}
+
+char consume_escaped_char(void) {
+    escaped = false;
+    char consumed_char = consume_next_char();
+
+    // An escaped backslash doesn't start another escape
+    escaped = false;
+    switch (consumed_char) {
+        case 'r': return '\r';
+        case 'n': return '\n';
+        case 't': return '\t';
+        case '"': return '"';
+        case '\'': return '\'';
+        case '\\': return '\\';
+
+        default:
+            error(lexer_loc(), "Unexpected escape character");
+            return consumed_char;
+    }
+}
+
+void consume_whitespace(void) {
+    buff *buffer = &FILES_TOP.buffer;
+
+    do {
+        buffer->pos += scan_whitespace_run(&buffer->data[buffer->pos], buffer->size - buffer->pos);
+    } while (buffer->pos == buffer->size && refill_window(&FILES_TOP));
+}
+
+// Skips the rest of a // comment, including the newline that ends it.
+// A backslash before the newline splices the next line onto the comment
+void skip_line_comment(void) {
+    buff *buffer = &FILES_TOP.buffer;
+
+    while (buffer->pos < buffer->size || refill_window(&FILES_TOP)) {
+        const size_t newline_index = buffer->pos + find_newline(&buffer->data[buffer->pos], buffer->size - buffer->pos);
+
+        buffer->pos = newline_index;
+
+        if (newline_index == buffer->size) {
+            continue;
+        }
+
+        buffer->pos++;
+
+        size_t before_newline = newline_index;
+        if (before_newline > 0 && buffer->data[before_newline - 1] == '\r') before_newline--;
+
+        if (before_newline == 0 || buffer->data[before_newline - 1] != '\\') {
+            break;
+        }
+    }
+
+    escaped = false;
+}
+
+// Skips a /* */ comment, buffer.pos should be at the * of the opening /*
+void skip_block_comment(void) {
+    buff *buffer = &FILES_TOP.buffer;
+
+    // File offset to search for the closing */ from
+    size_t search_offset = buffer->offset + buffer->pos + 1;
+
+    while (true) {
+        const size_t search_start = search_offset - buffer->offset;
+        const size_t comment_end = search_start + find_comment_end(&buffer->data[search_start],
+                                                                   buffer->size - search_start);
+
+        if (comment_end < buffer->size) {
+            buffer->pos = comment_end + 2; // Past the closing */
+            break;
+        }
+
+        // A * at the end of the window may be closed by a / at the start of the next
+        search_offset = buffer->offset + (buffer->size > search_start ? buffer->size - 1 : search_start);
+        buffer->pos = buffer->size;
+
+        if (!refill_window(&FILES_TOP)) {
+            error(lexer_loc(), "Unterminated comment");
+            break;
+        }
+    }
+
+    escaped = false;
+}
+
+bool match(const char expected) {
+    return peek_next_char() == expected;
+}
+
+bool is_hex(const char c) {
+    return (c >= '0' && c <= '9') ||
+           (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+bool is_numeric(const char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_alpha(const char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z');
+}
+
+bool is_alphanumeric(const char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') ||
+            c == '_';
+}
+
+// h headers can be most characters except >
+bool is_h_header_char(const char c) {
+    return (c >= 'a' && c <= '~') ||
+           (c >= 'A' && c <= '_') ||
+           (c >= '%' && c <= '=') ||
+           (c >= '!' && c <= '#') ||
+            c == '?';
+}
+
+// q headers can be most characters except "
+bool is_q_header_char(const char c) {
+    return (c >= 'a' && c <= '~') ||
+           (c >= 'A' && c <= '_') ||
+           (c >= '%' && c <= '?') ||
+            c == '!' || c == '#'  ||
+            c == '?';
+}
+
+bool not_end_of_string(const char c) {
+    return escaped || (c != '"' && c != EOF);
+}
+
+bool not_end_of_char_const(const char c) {
+    return escaped || (c != '\'' && c != EOF);
+}
+
+// Tries to make lexeme a view of the source buffer covering every character
+// that satisfies the compare function. Fails, without consuming anything,
+// if the run contains a backslash or newline, as those need the copying path
+bool build_lexeme_view(bool compare_func(char), string *lexeme) {
+    const char *data = FILES_TOP.buffer.data;
+    const size_t start = FILES_TOP.buffer.pos;
+    size_t end = start;
+
+    while (end < FILES_TOP.buffer.size && compare_func(data[end])) {
+        if (data[end] == '\\' || data[end] == '\n') return false;
+        end++;
+    }
+
+    // Let the copying path handle truncation of overly long lexemes, and runs that go on past the window
+    if (end - start >= MAX_LEXEME_LENGTH || (end == FILES_TOP.buffer.size && FILES_TOP.buffer.stream != NULL)) {
+        return false;
+    }
+
+    *lexeme = (string) {.data = (char *) &data[start], .len = (uint16_t) (end - start),
+                        .cap = (uint16_t) (end - start + 1)};
+    FILES_TOP.buffer.pos = end;
+
+    return true;
+}
+
+// Returns a view of the source buffer from the file offset start_offset up to the current position
+// if it matches str exactly, otherwise returns a copy of str in the token arena. The window may
+// have moved on since start_offset, in which case the start might not be in it any more
+string source_view_or_copy(size_t start_offset, const string *str) {
+    const buff *buffer = &FILES_TOP.buffer;
+    const size_t start = start_offset - buffer->offset;
+
+    if (zero_copy_lexing && start_offset >= buffer->offset && buffer->pos - start == str->len &&
+        memcmp(&buffer->data[start], str->data, str->len) == 0) {
+        return (string) {.data = &buffer->data[start], .len = str->len, .cap = str->len + 1};
+    }
+
+    string copy = create_heap_string(str->len+1, token_arena);
+    string_copy(&copy, str);
+
+    return copy;
+}
+
+// Builds up a lexeme by consuming characters until
+// a character does not satisfy the compare function
+void build_lexme(bool compare_func(char), string *lexeme, bool allocate) {
+    if (allocate && zero_copy_lexing && build_lexeme_view(compare_func, lexeme)) {
+        return;
+    }
+
+    string *str = allocate ? &create_local_string("", MAX_LEXEME_LENGTH) : lexeme;
+    char *str_data_ptr = &str->data[str->len];
+    char overflow_char;
+
+    while (compare_func(peek_next_char())) {
+        *str_data_ptr = consume_next_char();
+
+        if (escaped) {
+            if (peek_next_char() == '\r') {consume_next_char();}
+            if (peek_next_char() == '\n') {
+                consume_next_char();
+                continue;
+            }
+
+            char peeked_char = peek_next_char();
+
+            // Skip \x, \0..\7, treat them as a normal character following a backslash
+            if (peeked_char != 'x' && (peeked_char < '0' || peeked_char > '7')) {
+                *str_data_ptr = (char) (consume_escaped_char() | 0x80);
+            }
+        }
+
+        if (str->len == str->cap - 1) {
+            str_data_ptr = &overflow_char;
+        } else {
+            str_data_ptr++;
+            str->len++;
+        }
+    }
+    *str_data_ptr = '\0';
+
+    if (allocate) {
+        *lexeme = create_heap_string(str->len+1, token_arena);
+        string_copy(lexeme, str);
+    }
+}
+
+void create_punctuator_token(token* new_token, const enum subtype punctuator) {
+    *new_token = (token) {.type = PUNCTUATOR, .subtype = punctuator,
+                       .lexeme = subtype_strings[punctuator], .loc = token_start_loc};
+}
+
+// Runs the punctuator DFA from the character just consumed, remembering the
+// last accepting state so the longest punctuator is matched
+// (e.g. ".." not followed by a third '.' is matched as a single '.')
+void create_longest_punctuator_token(token *new_token) {
+    const char *data = FILES_TOP.buffer.data;
+    size_t pos = FILES_TOP.buffer.pos - 1;
+    size_t match_end = pos;
+
+    enum subtype punctuator = PUN_NONE;
+    uint8_t state = PUNCTUATOR_START_STATE;
+
+    while (pos < FILES_TOP.buffer.size &&
+           (state = punctuator_transitions[state][punctuator_char_class[(uint8_t) data[pos]]]) != 0) {
+        pos++;
+
+        if (punctuator_accepts[state] != PUN_NONE) {
+            punctuator = punctuator_accepts[state];
+            match_end = pos;
+        }
+    }
+
+    FILES_TOP.buffer.pos = match_end;
+
+    create_punctuator_token(new_token, punctuator);
+}
+
+void create_identifier_or_keyword_token(token* new_token) {
+    *new_token = (token) {.lexeme = {0}, .loc = token_start_loc};
+
+    // The first character has already been consumed
+    const size_t start = FILES_TOP.buffer.pos - 1;
+    const size_t length = 1 + scan_identifier_run(&FILES_TOP.buffer.data[FILES_TOP.buffer.pos],
+                                                  FILES_TOP.buffer.size - FILES_TOP.buffer.pos);
+
+    FILES_TOP.buffer.pos = start + length;
+
+    // Like build_lexme, overly long identifiers are truncated
+    string tmp_str = {.data = &FILES_TOP.buffer.data[start],
+                      .len = (uint16_t) (length < MAX_LEXEME_LENGTH ? length : MAX_LEXEME_LENGTH - 1)};
+    tmp_str.cap = tmp_str.len + 1;
+
+    const enum subtype keyword = find_keyword(&tmp_str);
+
+    if (keyword != PUN_NONE) {
+        new_token->type = KEYWORD;
+        new_token->lexeme = subtype_strings[keyword];
+        new_token->subtype = keyword;
+
+        return;
+    }
+
+    // If we're here, the lexeme is an identifier, which uses the interned spelling
+    new_token->type = IDENTIFIER;
+    new_token->atom = intern(&tmp_str);
+    new_token->lexeme = *atom_to_string(new_token->atom);
+
+    // Only identifiers longer than WINDOW_LOOKAHEAD can reach the end of the window,
+    // the rest of them is past the truncation point so just needs skipping
+    while (FILES_TOP.buffer.pos == FILES_TOP.buffer.size && refill_window(&FILES_TOP)) {
+        FILES_TOP.buffer.pos += scan_identifier_run(&FILES_TOP.buffer.data[FILES_TOP.buffer.pos],
+                                                    FILES_TOP.buffer.size - FILES_TOP.buffer.pos);
+    }
+}
+
+void create_string_literal_token(token* new_token) {
+    *new_token = (token) {.type = STRING_LITERAL, .loc = token_start_loc};
+
+    build_lexme(not_end_of_string, &new_token->lexeme, true);
+
+    if (peek_next_char() == EOF) {
+        error(lexer_loc(), "Expected end of string");
+        return;
+    }
+
+    consume_next_char(); // Consume the ending "
+}
+
+// The integer types in the order C11 6.4.4.1 tries them, the first that can hold the value is used
+static const struct {
+    enum subtype subtype;
+    uint64_t max_value;
+    bool is_unsigned;
+    uint8_t num_longs;
+} integer_constant_types[] = {
+    {CONST_INTEGER,            INT32_MAX,  false, 0},
+    {CONST_UNSIGNED_INT,       UINT32_MAX, true,  0},
+    {CONST_LONG,               INT64_MAX,  false, 1},
+    {CONST_UNSIGNED_LONG,      UINT64_MAX, true,  1},
+    {CONST_LONG_LONG,          INT64_MAX,  false, 2},
+    {CONST_UNSIGNED_LONG_LONG, UINT64_MAX, true,  2},
+};
+
+uint8_t digit_value(const char c) {
+    if (c >= '0' && c <= '9') return (uint8_t) (c - '0');
+    if (c >= 'a' && c <= 'f') return (uint8_t) (c - 'a' + 10);
+    if (c >= 'A' && c <= 'F') return (uint8_t) (c - 'A' + 10);
+
+    return UINT8_MAX;
+}
+
+// Works out the value and type of an integer constant from its lexeme
+void parse_integer_constant(token *constant) {
+    const string *lexeme = &constant->lexeme;
+    uint64_t value = 0;
+    uint8_t base = 10;
+    size_t i = 0;
+
+    if (lexeme->len > 1 && lexeme->data[0] == '0') {
+        if ((lexeme->data[1] & 95) == 'X') {
+            base = 16;
+            i = 2;
+        } else {
+            base = 8;
+        }
+    }
+
+    const size_t digits_start = i;
+
+    for (; i < lexeme->len && digit_value(lexeme->data[i]) < base; i++) {
+        const uint8_t digit = digit_value(lexeme->data[i]);
+
+        if (value > (UINT64_MAX - digit) / base) {
+            error(constant->loc, "Integer constant is too large");
+            return;
+        }
+
+        value = value * base + digit;
+    }
+
+    if (i == digits_start || (i < lexeme->len && is_numeric(lexeme->data[i]))) {
+        error(constant->loc, "Invalid digit in integer constant");
+        return;
+    }
+
+    bool is_unsigned = false;
+    uint8_t num_longs = 0;
+
+    // Suffixes are u, l or ll in either order, the l's have to be the same case
+    for (; i < lexeme->len; i++) {
+        const char c = lexeme->data[i];
+
+        if ((c & 95) == 'U' && !is_unsigned) {
+            is_unsigned = true;
+        } else if ((c & 95) == 'L' && num_longs == 0) {
+            num_longs = 1;
+
+            if (i + 1 < lexeme->len && lexeme->data[i + 1] == c) {
+                num_longs = 2;
+                i++;
+            }
+        } else {
+            error(constant->loc, "Unknown integer suffix");
+            return;
+        }
+    }
+
+    constant->value = value;
+
+    // Decimal constants without a u suffix can only have signed types,
+    // too large for any of those and it's treated as unsigned long long, like GCC does
+    constant->subtype = CONST_UNSIGNED_LONG_LONG;
+
+    for (size_t type = 0; type < sizeof(integer_constant_types) / sizeof(integer_constant_types[0]); type++) {
+        if (integer_constant_types[type].num_longs < num_longs) continue;
+        if (integer_constant_types[type].is_unsigned && !is_unsigned && base == 10) continue;
+        if (!integer_constant_types[type].is_unsigned && is_unsigned) continue;
+
+        if (value <= integer_constant_types[type].max_value) {
+            constant->subtype = integer_constant_types[type].subtype;
+            break;
+        }
+    }
+}
+
+void create_constant_token(token* new_token, const char c) {
+    *new_token = (token) {.type = CONSTANT, .subtype = CONST_INTEGER,
+                          .lexeme = {0}, .loc = token_start_loc};
+
+    // c has already been consumed
+    const size_t start_offset = FILES_TOP.buffer.offset + FILES_TOP.buffer.pos - 1;
+
+    string tmp_str = create_local_string("", MAX_LEXEME_LENGTH);
+    string_cat_c(&tmp_str, c);
+
+    bool is_hex_constant = false;
+    bool is_floating = false;
+
+    if (c == '0' && (peek_next_char() & 95) == 'X') {
+        is_hex_constant = true;
+        string_cat_c(&tmp_str, consume_next_char());
+        build_lexme(is_hex, &tmp_str, false);
+    } else {
+        build_lexme(is_numeric, &tmp_str, false);
+    }
+
+    // Floating point constant handling
+    if (peek_next_char() == '.') {
+        is_floating = true;
+        string_cat_c(&tmp_str, consume_next_char());
+        build_lexme(is_hex_constant ? is_hex : is_numeric, &tmp_str, false);
+    }
+
+    // Hexadecimal floating constants use p for the exponent, as e is a hex digit
+    if ((peek_next_char() & 95) == (is_hex_constant ? 'P' : 'E')) {
+        is_floating = true;
+        string_cat_c(&tmp_str, consume_next_char());
+
+        if (peek_next_char() == '+' || peek_next_char() == '-') {
+            string_cat_c(&tmp_str, consume_next_char());
+        }
+
+        build_lexme(is_numeric, &tmp_str, false);
+    }
+
+    const uint16_t suffix_start = tmp_str.len;
+
+    if (is_alpha(peek_next_char())) {
+        build_lexme(is_alpha, &tmp_str, false);
+    }
+
+    new_token->lexeme = source_view_or_copy(start_offset, &tmp_str);
+
+    if (!is_floating) {
+        parse_integer_constant(new_token);
+        return;
+    }
+
+    const uint16_t suffix_length = tmp_str.len - suffix_start;
+    const char suffix = (char) (tmp_str.data[suffix_start] & 95);
+
+    if (suffix_length == 0) {
+        new_token->subtype = CONST_DOUBLE;
+    } else if (suffix_length == 1 && suffix == 'F') {
+        new_token->subtype = CONST_FLOAT;
+    } else if (suffix_length == 1 && suffix == 'L') {
+        new_token->subtype = CONST_LONG_DOUBLE;
+    } else {
+        error(new_token->loc, "Unknown number suffix");
+    }
+}
+
+void create_character_token(token* new_token, bool wide) {
+    *new_token = (token) {.type = CONSTANT, .loc = token_start_loc};
+
+    new_token->subtype = wide ? CONST_WIDE_CHAR : CONST_CHAR;
+
+    if (wide) {consume_next_char();} // Consume the starting '
+
+    build_lexme(not_end_of_char_const, &new_token->lexeme, true);
+
+    if (peek_next_char() != '\'') {
+        error(new_token->loc, "Expected \'");
+    }
+
+    consume_next_char(); // Consume the ending '
+}
+
+void create_directive_token(token* new_token) {
+    buff *buffer = &FILES_TOP.buffer;
+
+    consume_whitespace();
+
+    // Comments between the # and the name are just whitespace, see find_directive_name
+    while (true) {
+        if (buffer->pos + 1 >= buffer->size) {
+            refill_window(&FILES_TOP);
+        }
+
+        if (buffer->pos + 1 >= buffer->size || buffer->data[buffer->pos] != '/' || buffer->data[buffer->pos + 1] != '*') {
+            break;
+        }
+
+        buffer->pos++;
+        skip_block_comment();
+        consume_whitespace();
+    }
+
+    *new_token = (token) {.type = DIRECTIVE, .lexeme = {0}, .loc = token_start_loc};
+
+    in_directive = true;
+
+    build_lexme(is_alpha, &new_token->lexeme, true);
+
+    const enum subtype directive = find_directive(&new_token->lexeme);
+
+    if (directive != PUN_NONE) {
+        new_token->subtype = directive;
+
+        in_include = (new_token->subtype == DIRECTIVE_INCLUDE);
+        in_define = (new_token->subtype == DIRECTIVE_DEFINE);
+
+        in_conditional_directive = directive == DIRECTIVE_IF || directive == DIRECTIVE_IFDEF ||
+                                   directive == DIRECTIVE_IFNDEF || directive == DIRECTIVE_ELIF ||
+                                   directive == DIRECTIVE_ELSE;
+
+        return;
+    }
+
+    error(lexer_loc(), "Unknown directive");
+}
+
+void create_header_token(token *new_token, header_type type) {
+    consume_whitespace();
+
+    *new_token = (token) {.type = HEADER_NAME, .lexeme = {0}, .loc = token_start_loc};
+
+    switch (type) {
+        case H_HEADER:
+            build_lexme(is_h_header_char, &new_token->lexeme, true);
+            consume_whitespace();
+            consume_next_char(); // Consume the ending `>`
+
+            new_token->subtype = HEADER_H;
+            break;
+        case Q_HEADER:
+            build_lexme(is_q_header_char, &new_token->lexeme, true);
+            consume_next_char(); // Consume the ending `"`
+
+            new_token->subtype = HEADER_Q;
+            break;
+    }
+
+    in_include = false;
+}
+
+void create_newline_token(token *new_token) {
+    *new_token = (token) {.type = NEWLINE, .lexeme = newline_string, .loc = token_start_loc};
+
+    in_define = false;
+    in_directive = false;
+
+    group_follows = in_conditional_directive;
+    in_conditional_directive = false;
+}
+
+// Skips a quoted run in a skipped line, stopping at the closing quote or the end of the line.
+// Returns the index after it
+static size_t skip_quoted(const char *data, size_t pos, size_t size) {
+    const char quote = data[pos++];
+
+    while (pos < size && data[pos] != quote && data[pos] != '\n') {
+        pos += data[pos] == '\\' ? 2 : 1;
+    }
+
+    return pos < size && data[pos] == quote ? pos + 1 : pos;
+}
+
+// Checks if the line starting at pos is a directive, setting name_start to the index of its name
+// Skips whitespace and /* */ comments, which can run over several lines, without going past a newline
+// outside of them. Returns the index after them
+static size_t skip_space_and_comments(const char *data, size_t pos, size_t size) {
+    while (true) {
+        pos += scan_whitespace_run(&data[pos], size - pos);
+
+        if (pos + 1 >= size || data[pos] != '/' || data[pos + 1] != '*') {
+            return pos;
+        }
+
+        pos += 2;
+        pos += find_comment_end(&data[pos], size - pos);
+        pos = pos + 2 < size ? pos + 2 : size;
+    }
+}
+
+static bool find_directive_name(const char *data, size_t pos, size_t size, size_t *name_start) {
+    pos = skip_space_and_comments(data, pos, size);
+
+    if (pos == size || data[pos] != '#') {
+        return false;
+    }
+
+    *name_start = skip_space_and_comments(data, pos + 1, size);
+
+    return true;
+}
+
+static bool directive_name_is(const char *data, size_t pos, size_t size, const string *name) {
+    return size - pos >= name->len && memcmp(&data[pos], name->data, name->len) == 0 &&
+           (size - pos == name->len || !is_alphanumeric(data[pos + name->len]));
+}
+
+// Finds the end of a conditional group's body starting at the beginning of a line, without making
+// any tokens. Only the start of each line is checked for a directive, the rest of the line is
+// only looked at for comments and quotes, which can hide a # or a newline.
+// Returns the index of the start of the line with the #elif, #else or #endif ending the group,
+// or size if it isn't found. In case the data is only part of the file, the search can carry on
+// from *line_start, the start of the line that ran into the end of the data, with *nesting as it was there
+static size_t find_group_end(const char *data, size_t pos, size_t size, uint32_t *nesting, size_t *line_start) {
+    static const string if_name = create_const_string("if");
+    static const string ifdef_name = create_const_string("ifdef");
+    static const string ifndef_name = create_const_string("ifndef");
+    static const string endif_name = create_const_string("endif");
+    static const string elif_name = create_const_string("elif");
+    static const string else_name = create_const_string("else");
+
+    *line_start = pos;
+
+    while (pos < size) {
+        const uint32_t line_nesting = *nesting;
+        size_t name_start;
+
+        *line_start = pos;
+
+        if (find_directive_name(data, pos, size, &name_start)) {
+            if (directive_name_is(data, name_start, size, &if_name) ||
+                directive_name_is(data, name_start, size, &ifdef_name) ||
+                directive_name_is(data, name_start, size, &ifndef_name)) {
+                (*nesting)++;
+            } else if (directive_name_is(data, name_start, size, &endif_name)) {
+                if (*nesting == 0) return *line_start;
+                (*nesting)--;
+            } else if (*nesting == 0 && (directive_name_is(data, name_start, size, &elif_name) ||
+                                         directive_name_is(data, name_start, size, &else_name))) {
+                return *line_start;
+            }
+        }
+
+        bool line_ended = false;
+
+        // Move to the start of the next line, which may be more than one newline away
+        while (pos < size) {
+            const char c = data[pos];
+
+            if (c == '\n') {
+                pos++;
+
+                size_t before_newline = pos - 1;
+                if (before_newline > *line_start && data[before_newline - 1] == '\r') before_newline--;
+
+                // A backslash before the newline splices the next line onto this one
+                if (before_newline == *line_start || data[before_newline - 1] != '\\') {
+                    line_ended = true;
+                    break;
+                }
+            } else if (c == '/' && pos + 1 < size && data[pos + 1] == '*') {
+                pos += 2;
+                pos += find_comment_end(&data[pos], size - pos);
+                pos = pos + 2 < size ? pos + 2 : size;
+            } else if (c == '/' && pos + 1 < size && data[pos + 1] == '/') {
+                pos += find_newline(&data[pos], size - pos);
+            } else if (c == '"' || c == '\'') {
+                pos = skip_quoted(data, pos, size);
+            } else {
+                pos++;
+            }
+        }
+
+        if (!line_ended) {
+            *nesting = line_nesting;
+            return size;
+        }
+    }
+
+    *line_start = size;
+
+    return size;
+}
+
+// Leaves the body of the conditional group starting here unlexed until the preprocessor
+// knows if the group is active, see lex_deferred_group. Returns false if the group is empty
+static bool create_group_token(token *new_token) {
+    buff *buffer = &FILES_TOP.buffer;
+    const size_t group_start = buffer->offset + buffer->pos;
+    uint32_t nesting = 0;
+    size_t line_start;
+    size_t group_end = find_group_end(buffer->data, buffer->pos, buffer->size, &nesting, &line_start);
+
+    // Through a window, the search carries on from the start of the line the window ended in
+    while (group_end == buffer->size && buffer->stream != NULL) {
+        const size_t old_offset = buffer->offset;
+
+        buffer->pos = line_start;
+        refill_window(&FILES_TOP);
+
+        line_start -= buffer->offset - old_offset;
+        group_end = find_group_end(buffer->data, line_start, buffer->size, &nesting, &line_start);
+    }
+
+    if (buffer->offset + group_end == group_start) {
+        return false;
+    }
+
+    *new_token = (token) {.type = GROUP, .lexeme = empty_string, .loc = make_source_loc(FILES_TOP.file_id, group_start),
+                          .value = buffer->offset + group_end - group_start};
+
+    buffer->pos = group_end;
+    buffer->deferred_groups = true;
+
+    return true;
+}
+
+void create_blank_token(token *new_token) {
+    *new_token = (token) {.type = BLANK, .lexeme = empty_string, .loc = token_start_loc};
+}
+
+void create_end_token(token *new_token) {
+    *new_token = (token) {.type = END, .lexeme = empty_string, .loc = token_start_loc};
+}
+
+// Lexemes may point into the buffer when zero-copy lexing,
+// so it has to be kept around until the translation unit is finished
+void release_source_buffer(file_info *file) {
+    buff *buffer = &file->buffer;
+
+    if (buffer->stream != NULL) {
+        fclose(buffer->stream);
+        buffer->stream = NULL;
+    }
+
+    if (buffer->borrowed) {
+        return;
+    }
+
+    // A window's deferred groups are read back from the file, so only lexemes can point into it
+    if (buffer->windowed) {
+        if (zero_copy_lexing) {
+            retire_window(buffer->data);
+        } else {
+            free(buffer->data);
+        }
+
+        return;
+    }
+
+    // Deferred groups are lexed from the file's text as the preprocessor reaches them, so it's kept
+    // for the rest of the translation unit. If the file is lexed again after changing, the old text
+    // is left alone as lexemes and groups from earlier in the translation unit may point into it
+    if (buffer->deferred_groups) {
+        get_source_file(file->file_id)->text = buffer->data;
+    }
+
+    if (zero_copy_lexing || buffer->deferred_groups) {
+        if (num_retained_buffers == max_retained_buffers) {
+            max_retained_buffers = max_retained_buffers ? max_retained_buffers * 2 : MAX_NUM_FILES;
+            retained_buffers = realloc(retained_buffers, max_retained_buffers * sizeof(buff));
+        }
+
+        retained_buffers[num_retained_buffers++] = *buffer;
+        return;
+    }
+
+    if (buffer->mapped) {
+        munmap(buffer->data, buffer->size);
+    } else {
+        free(buffer->data);
+    }
+}
+
+token scan_token(void) {
+    bool follows_whitespace = false;
+    token new_token = {0};
+    new_token.loc = NO_SOURCE_LOC;
+
+    if (group_follows) {
+        group_follows = false;
+
+        if (create_group_token(&new_token)) {
+            return new_token;
+        }
+    }
+
+    while (new_token.loc == NO_SOURCE_LOC) {
+        if (FILES_TOP.buffer.size - FILES_TOP.buffer.pos < WINDOW_LOOKAHEAD) {
+            refill_window(&FILES_TOP);
+        }
+
+        token_start_loc = lexer_loc();
+        char c = consume_next_char();
+        switch (c) {
+            // Punctuators that need context, the rest are matched by the DFA below
+            case '/':
+                switch (peek_next_char()) {
+                    case '/': skip_line_comment(); create_newline_token(&new_token); break;
+                    case '*': skip_block_comment(); break;
+
+                    default: create_longest_punctuator_token(&new_token); break;
+                }
+            break;
+
+            case '<':
+                if (in_include) {
+                    create_header_token(&new_token, H_HEADER);
+                } else {
+                    create_longest_punctuator_token(&new_token);
+                }
+            break;
+
+            case '#':
+                if (in_define || peek_next_char() == '#') {
+                    create_longest_punctuator_token(&new_token);
+                } else {
+                    create_directive_token(&new_token);
+                }
+            break;
+
+            // White space characters
+            case '\n': create_newline_token(&new_token); break;
+            case '\r':
+            case '\t':
+            case ' ' :
+                consume_whitespace();
+                follows_whitespace = true; break;
+
+            // String literal
+            case '"':
+                if (in_include) {
+                    create_header_token(&new_token, Q_HEADER); break;
+                } else {
+                    create_string_literal_token(&new_token); break;
+                }
+
+            // Character constant
+            case '\'': create_character_token(&new_token, false); break;
+            case 'L':
+                if (peek_next_char() == '\'') {create_character_token(&new_token, true);}
+                else {create_identifier_or_keyword_token(&new_token);}
+                break;
+
+            // End of file
+            case EOF:
+                if (in_directive) {
+                    create_newline_token(&new_token);
+                    break;
+                }
+
+                create_end_token(&new_token);
+
+                in_conditional_directive = false;
+
+                release_source_buffer(&FILES_TOP);
+                files_top--;
+                return new_token;
+
+            // Backslash followed by new line
+            case '\\':
+                if (peek_next_char() == '\r') {consume_next_char();}
+                if (peek_next_char() == '\n') {consume_next_char();}
+                break;
+
+            default:
+                // Number
+                if (is_numeric(c)) {
+                    create_constant_token(&new_token, c);
+                }
+                // Keyword/Identifier
+                else if (is_alphanumeric(c)) {
+                    create_identifier_or_keyword_token(&new_token);
+                }
+                else if (punctuator_char_class[(uint8_t) c] != 0) {
+                    create_longest_punctuator_token(&new_token);
+                }
+                else {
+                    error(token_start_loc, "Unknown token");
+                }
+        }
+    }
+
+    new_token.follows_whitespace = follows_whitespace;
+
+    return new_token;
+}
+
+// Lexes the file that's just been added, all of it, and inserts its tokens after insert_point
+void scan_and_insert_tokens(tk_node insert_point) {
+    const int outer_files_top = files_top - 1;
+    tk_node ptr = tk.next[insert_point];
+    while (files_top > outer_files_top) {
+        const token new_token = scan_token();
+        const tk_node new_node = new_token_node(&new_token);
+
+        tk.next[insert_point] = new_node;
+        tk.next[new_node] = ptr;
+        insert_point = new_node;
+    }
+}
+
+// Whether a batch can end before the line the lexer is at the start of. A ( could hold the arguments for
+// a macro named at the end of the batch, so a line starting with one stays with the line before it,
+// as does a line starting with anything that could come before one, like a comment or another newline
+static bool line_can_start_batch(void) {
+    const buff *buffer = &FILES_TOP.buffer;
+    const size_t start = buffer->pos + scan_whitespace_run(&buffer->data[buffer->pos], buffer->size - buffer->pos);
+
+    if (start == buffer->size) {
+        return false;
+    }
+
+    const char c = buffer->data[start];
+
+    return c != '(' && c != '\n' && c != '\r' && c != '/' && c != '\\';
+}
+
+// Looks for an include guard in the header file_id as lex_more_tokens reads it. Only one header is
+// watched at a time, any other is left without its guard checked
+void watch_include_guard(uint16_t file_id) {
+    if (guarded_file_id == NO_FILE_ID) {
+        guarded_file_id = file_id;
+        guard_state = GUARD_START;
+    }
+}
+
+static void finish_guard_watch(atom guard) {
+    source_file *header = get_source_file(guarded_file_id);
+
+    header->include_guard = guard;
+    header->guard_checked = true;
+    guarded_file_id = NO_FILE_ID;
+}
+
+// Takes the watched header's tokens one at a time, outside of its deferred groups
+static void track_include_guard(const token *new_token) {
+    const enum subtype directive_type = new_token->type == DIRECTIVE ? new_token->subtype : DIRECTIVE_NULL;
+    const bool blank = new_token->type == NEWLINE || new_token->type == BLANK;
+    bool guarded = false;
+
+    switch (guard_state) {
+        case GUARD_START:
+            if (blank) return;
+            if (directive_type == DIRECTIVE_IFNDEF) {
+                guard_state = GUARD_NAME;
+                return;
+            }
+            break;
+        case GUARD_NAME:
+            if (new_token->type == IDENTIFIER) {
+                guard_name = new_token->atom;
+                guard_level = 1;
+                guard_state = GUARD_BODY;
+                return;
+            }
+            break;
+        case GUARD_BODY:
+            // An #else or #elif means some of the file is outside the guard
+            if (directive_type == DIRECTIVE_IF || directive_type == DIRECTIVE_IFDEF || directive_type == DIRECTIVE_IFNDEF) {
+                guard_level++;
+                return;
+            }
+            if (directive_type == DIRECTIVE_ENDIF && --guard_level == 0) {
+                guard_state = GUARD_ENDIF_LINE;
+                return;
+            }
+            if (new_token->type != END && (guard_level > 1 || (directive_type != DIRECTIVE_ELSE &&
+                                                                 directive_type != DIRECTIVE_ELIF))) {
+                return;
+            }
+            break;
+        case GUARD_ENDIF_LINE:
+            // Anything left on the #endif line is ignored
+            if (new_token->type == NEWLINE) guard_state = GUARD_TRAILING;
+            if (new_token->type != END) return;
+            guarded = true;
+            break;
+        case GUARD_TRAILING:
+            if (blank) return;
+            guarded = new_token->type == END;
+            break;
+    }
+
+    finish_guard_watch(guarded ? guard_name : NO_ATOM);
+}
+
+// Lexes the next batch of tokens and appends them after insert_point, the end of the token list.
+// With streaming_output, a batch is around STREAM_BATCH_TOKENS tokens, otherwise it's everything that's
+// left. A batch ends where its tokens can all be preprocessed without the ones after them, at the start
+// of a line outside of any parentheses, see line_can_start_batch. It also ends after an #include line
+// or a deferred group, so the header or group can be read as the next batch, see stream_deferred_group.
+// Returns false once every file has been read
+bool lex_more_tokens(tk_node insert_point) {
+    uint32_t num_lexed = 0;
+    uint16_t counted_file_id = NO_FILE_ID;
+    uint32_t num_counted = 0;
+    bool batch_ends = false;
+
+    while (files_top >= 0 && !batch_ends) {
+        const bool in_group = FILES_TOP.group;
+        const uint16_t file_id = FILES_TOP.file_id;
+        const token new_token = scan_token();
+
+        // The end of a deferred group isn't the end of its file
+        if (new_token.type == END && in_group) {
+            continue;
+        }
+
+        const tk_node new_node = new_token_node(&new_token);
+
+        tk.next[insert_point] = new_node;
+        insert_point = new_node;
+        num_lexed++;
+
+        // The file being timed may have included this one, so the tokens are counted for each run of a file
+        if (file_id != counted_file_id) {
+            add_lexed_tokens(counted_file_id, num_counted);
+            counted_file_id = file_id;
+            num_counted = 0;
+        }
+
+        num_counted++;
+
+        if (file_id == guarded_file_id && !in_group) {
+            track_include_guard(&new_token);
+        }
+
+        if (!streaming_output) {
+            continue;
+        }
+
+        switch (new_token.type) {
+            case DIRECTIVE:
+                in_directive_line = true;
+                in_include_line = new_token.subtype == DIRECTIVE_INCLUDE;
+                break;
+            case PUNCTUATOR:
+                if (in_directive_line) break;
+                if (new_token.subtype == PUN_LEFT_PARENTHESIS) paren_depth++;
+                if (new_token.subtype == PUN_RIGHT_PARENTHESIS && paren_depth > 0) paren_depth--;
+                break;
+            case GROUP:
+                batch_ends = paren_depth == 0;
+                break;
+            case NEWLINE:
+                batch_ends = paren_depth == 0 && (in_include_line || (num_lexed >= STREAM_BATCH_TOKENS &&
+                                                                      !group_follows && line_can_start_batch()));
+                in_directive_line = false;
+                in_include_line = false;
+                break;
+            default: break;
+        }
+    }
+
+    add_lexed_tokens(counted_file_id, num_counted);
+
+    return num_lexed > 0;
+}
+
+// Makes buffer a window onto the size bytes of stream from its current position, which is offset
+// in the file, and reads in the first of them
+static void open_window(buff *buffer, FILE *stream, size_t offset, size_t size) {
+    const size_t window_size = size < SOURCE_WINDOW_SIZE ? size : SOURCE_WINDOW_SIZE;
+
+    *buffer = (buff) {.data = malloc(window_size), .offset = offset, .stream = stream,
+                      .capacity = window_size, .windowed = true};
+
+    buffer->size = fread(buffer->data, 1, window_size, stream);
+    buffer->remaining = size - buffer->size;
+
+    if (buffer->size < window_size || buffer->remaining == 0) {
+        fclose(stream);
+        buffer->stream = NULL;
+    }
+}
+
+// Has lex_more_tokens read the conditional group the lexer deferred next, before the rest of its file.
+// The group has to be the last token lexed. It's lexed from the file's text if that was kept,
+// otherwise it's read back from the file. Returns false if it can't be
+bool stream_deferred_group(tk_node group) {
+    const uint16_t file_id = source_loc_file_id(tk.loc[group]);
+    const source_file *file = get_source_file(file_id);
+    const size_t group_start = tk.loc[group] - file->base;
+
+    assert(tk.type[group] == GROUP);
+
+    // The whole of the file's text is used so locations and looking behind work as usual
+    if (file->text != NULL) {
+        files[++files_top] = (file_info) {.file_id = file_id, .group = true, .buffer = {
+            .data = (char *) file->text, .pos = group_start, .size = group_start + tk.value[group], .borrowed = true
+        }};
+
+        return true;
+    }
+
+    FILE *stream = fopen(file->path.data, "rb");
+
+    if (stream == NULL || fseek(stream, (long) group_start, SEEK_SET) != 0) {
+        if (stream != NULL) fclose(stream);
+
+        error(tk.loc[group], "Cannot read the file again for a conditional group");
+        return false;
+    }
+
+    files[++files_top] = (file_info) {.file_id = file_id, .group = true};
+    open_window(&FILES_TOP.buffer, stream, group_start, tk.value[group]);
+
+    return true;
+}
+
+// Lexes the conditional group deferred by the lexer, replacing its GROUP token, which is after before_group
+void lex_deferred_group(tk_node before_group) {
+    const tk_node group = tk.next[before_group];
+    const tk_node rest = tk.next[group];
+    const uint16_t file_id = source_loc_file_id(tk.loc[group]);
+    const int outer_files_top = files_top;
+
+    tk_node insert_point = before_group;
+    const uint32_t first_new_token = tk.len;
+
+    if (stream_deferred_group(group)) {
+        while (files_top > outer_files_top) {
+            const token new_token = scan_token();
+
+            if (new_token.type == END) {
+                continue;
+            }
+
+            const tk_node new_node = new_token_node(&new_token);
+
+            tk.next[insert_point] = new_node;
+            insert_point = new_node;
+        }
+    }
+
+    tk.next[insert_point] = rest;
+
+    add_lexed_tokens(file_id, tk.len - first_new_token);
+}
+
+// Empties the token arena and frees the windows that have been moved on from, once the preprocessor
+// has written out every token so far apart from kept. kept's lexeme is copied into the emptied arena
+void release_written_tokens(token *kept) {
+    const string lexeme = kept->lexeme;
+    char *saved = malloc(lexeme.len + 1u);
+
+    memcpy(saved, lexeme.data, lexeme.len);
+
+    reset_arena(token_arena);
+    free_retired_windows();
+
+    kept->lexeme = create_heap_string(lexeme.len + 1, token_arena);
+    string_copy(&kept->lexeme, &(string) {.data = saved, .len = lexeme.len, .cap = lexeme.len + 1});
+
+    free(saved);
+}
+
+// Everything the lexer kept for the translation unit is let go once it's finished
+void release_source_buffers(void) {
+    for (size_t i = 0; i < num_retained_buffers; i++) {
+        if (retained_buffers[i].mapped) {
+            munmap(retained_buffers[i].data, retained_buffers[i].size);
+        } else {
+            free(retained_buffers[i].data);
+        }
+    }
+
+    num_retained_buffers = 0;
+
+    free_retired_windows();
+
+    paren_depth = 0;
+    in_directive_line = false;
+    in_include_line = false;
+    guarded_file_id = NO_FILE_ID;
+}
+
+void free_retained_buffers(void) {
+    release_source_buffers();
+    free(retained_buffers);
+    free(retired_windows);
+
+    retained_buffers = NULL;
+    max_retained_buffers = 0;
+    retired_windows = NULL;
+    max_retired_windows = 0;
+}
+
+// Maps the file read-only, falls back to add_file's usual read for empty files and ones larger than max_size
+bool map_file(const char *file_path_cstr, buff *buffer, size_t max_size) {
+    int fd = open(file_path_cstr, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd == -1) {
+        return false;
+    }
+
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size == 0 || (size_t) file_stat.st_size > max_size) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    posix_madvise(data, (size_t) file_stat.st_size, POSIX_MADV_SEQUENTIAL);
+
+    *buffer = (buff) {.data = data, .size = (size_t) file_stat.st_size, .pos = 0, .mapped = true};
+
+    return true;
+}
+
+// The manifest needs the hash of every file, see write_manifest. Otherwise, the header cache only compares
+// a file's contents with what was lexed if it was modified so recently that its modification time can't be
+// trusted, see cache_header_tokens, so only those files are hashed
+static bool content_hash_needed(const char *path) {
+    struct stat file_stat;
+
+    return record_content_hashes || stat(path, &file_stat) != 0 || file_stat.st_mtime + 1 >= time(NULL);
+}
+
+bool add_file(const string *file_path) {
+    char file_path_cstr[MAX_LEXEME_LENGTH];
+    buff buffer = {0};
+    size_t file_size;
+
+    strcpy(file_path_cstr, file_path->data);
+    file_path_cstr[file_path->len] = 0;
+
+    // When streaming, a large file is read through a window even if it could be mapped,
+    // so its pages don't stay in memory once they've been lexed
+    if (!zero_copy_lexing || !map_file(file_path_cstr, &buffer, streaming_output ? SOURCE_WINDOW_SIZE : SIZE_MAX)) {
+        FILE *file_stream = fopen(file_path_cstr, "rb");
+
+        if (file_stream == NULL) {
+            return NULL;
+        }
+
+        fseek(file_stream, 0, SEEK_END);
+        file_size = (size_t) ftell(file_stream);
+        rewind(file_stream);
+
+        // Large files are read a window at a time, the rest of the file is read in by refill_window
+        if (file_size > SOURCE_WINDOW_SIZE) {
+            open_window(&buffer, file_stream, 0, file_size);
+        } else {
+            buffer.data = malloc(file_size);
+            buffer.size = fread(buffer.data, 1, file_size, file_stream);
+            fclose(file_stream);
+        }
+    } else {
+        file_size = buffer.size;
+    }
+
+    const uint16_t file_id = add_source_file(file_path, file_size);
+
+    if (file_id == NO_FILE_ID) {
+        if (buffer.stream != NULL) {
+            fclose(buffer.stream);
+        }
+
+        if (buffer.mapped) {
+            munmap(buffer.data, buffer.size);
+        } else {
+            free(buffer.data);
+        }
+
+        return false;
+    }
+
+    files[++files_top] = (file_info) {.buffer = buffer, .file_id = file_id};
+
+    // So the header cache can tell if a file still holds what was lexed, see splice_cached_header
+    source_file *file = get_source_file(file_id);
+
+    file->windowed = buffer.windowed;
+    file->content_hashed = !buffer.windowed && content_hash_needed(file_path_cstr);
+    if (file->content_hashed) file->content_hash = hash_buffer_contents(buffer.data, buffer.size);
+
+    // Streamed tokens don't need the whole line table, just enough to find any line again
+    if (buffer.windowed && streaming_output && file->line_table_end == 0) {
+        keep_line_checkpoints(file_id);
+    }
+
+    build_line_table(FILES_TOP.file_id, FILES_TOP.buffer.data, 0, FILES_TOP.buffer.size);
+
+    return true;
+}
@@ -1,9 +1,9 @@
-#ifndef LEXER_H
-#define LEXER_H
-
-typedef enum {
-    H_HEADER,
-    Q_HEADER
-} header_type;
-
-#endif //LEXER_H
+#ifndef LEXER_H
+#define LEXER_H
+
+typedef enum {
+    H_HEADER,
+    Q_HEADER
+} header_type;
+
+#endif //LEXER_H
@@ -1,78 +1,320 @@
+#include "char_scan.h"
 #include "common.h"
 #include "debug.h"
+#include "file_table.h"
+#include "header_cache.h"
+#include "hideset.h"
+#include "intern.h"
 #include "parser.h"
 #include "helper_functions.h"
+#include "include_paths.h"
+#include "include_timing.h"
+#include "manifest.h"
+#include "pch.h"
+#include "preprocessor.h"
 #include "strings.h"
+#include "thread_pool.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-extern size_t max_macros;
+// Worker threads for -j
+#define MAX_THREADS 1024
 
 static string predefined_string = create_const_string("PREDEFINED");
 
 void add_predefined(void) {
-    const char predefined[] = {
-        "#define __x86_64__ 1\n"
-        "#define __LP64__ 1\n"
-    };
+    files[++files_top] = (file_info) {.buffer = {.size = strlen(predefined_macros), .pos = 0}};
+    FILES_TOP.buffer.data = malloc(strlen(predefined_macros) + 1);
 
-    files[++files_top] = (file_info) {.buffer = {.size = strlen(predefined), .pos = 0},
-                                      .current_pos = 0, .current_line = 1};
-    FILES_TOP.buffer.data = malloc(strlen(predefined) + 1);
+    strcpy(FILES_TOP.buffer.data, predefined_macros);
+    FILES_TOP.file_id = add_source_file(&predefined_string, FILES_TOP.buffer.size);
+    build_line_table(FILES_TOP.file_id, FILES_TOP.buffer.data, 0, FILES_TOP.buffer.size);
+}
+
+typedef struct {
+    const string *files_to_process;
+    bool preprocess_only;
+    bool line_markers;
+    bool write_depfiles;
+    bool incremental; // Skip files whose manifest shows nothing they read has changed
+    uint64_t options_hash; // Of every option that can change the output
+    message_buffer *diagnostics; // One for each file
+    include_timings *include_timings; // One for each file, NULL unless there's an include report or trace
+} driver_context;
+
+// Outputs go in output/, named after the source file with its extension replaced
+static void make_output_path(string *output_path, const string *file_to_process, const char *extension) {
+    string filename = string_rstr(file_to_process, '/');
+
+    if (filename.data == NULL) {
+        filename = *file_to_process;
+    } else {
+        filename = string_slice(&filename, 1, filename.len);
+    }
 
-    strcpy(FILES_TOP.buffer.data, predefined);
-    FILES_TOP.filepath = predefined_string;
+    filename.len--;
+
+    string_cat(output_path, &filename);
+    string_cat(output_path, &(string) {.data = (char *) extension, .len = (uint16_t) strlen(extension)});
 }
 
-int main(void) {
-    char *files_to_process[] = {
-        ""
-    };
+// Runs the whole pipeline on one file. Everything it touches belongs to the calling thread,
+// so any number of these can run at once on different threads
+static void process_translation_unit(size_t file_index, void *context) {
+    const driver_context *driver = context;
+    const string *file_to_process = &driver->files_to_process[file_index];
+    string filepath = create_local_string("", MAX_LEXEME_LENGTH);
+    string output_path = create_local_string("output/", MAX_FILEPATH_LENGTH);
+    string depfile_path = create_local_string("output/", MAX_FILEPATH_LENGTH);
+    string manifest_path = create_local_string("output/", MAX_FILEPATH_LENGTH);
+
+    make_output_path(&output_path, file_to_process, "i");
+    make_output_path(&depfile_path, file_to_process, "d");
+    make_output_path(&manifest_path, file_to_process, "manifest");
+
+    // A precompiled header is only written by actually preprocessing the file
+    if (driver->incremental && pch_output_path == NULL &&
+        manifest_up_to_date(&manifest_path, &output_path, driver->options_hash)) {
+        debugf("Up to date: %.*s\n", file_to_process->len, file_to_process->data);
+        return;
+    }
+
+    diagnostics = &driver->diagnostics[file_index];
+    include_timing = driver->include_timings != NULL ? &driver->include_timings[file_index] : NULL;
+
+    string_cat(&filepath, file_to_process);
+
+    // Without a parser or a precompiled header needing every token at once, they're written out as they're preprocessed
+    streaming_output = driver->preprocess_only && pch_output_path == NULL;
+
+    token_arena = create_arena(TOKEN_ARENA_BLOCK_SIZE);
+
+    reset_token_buffer();
+    tokens = new_token_node(&(token) {0});
 
-    for (size_t i = 0; i < sizeof(files_to_process) / sizeof(files_to_process[0]); i++) {
-        string filepath = create_local_string("", MAX_LEXEME_LENGTH);
+    begin_file_timing();
 
-        string_cat(&filepath, &files_to_process[i]);
+    if (!add_file(&filepath)) {
+        report("Cannot open %.*s\n", filepath.len, filepath.data);
+        cancel_file_timing();
+        delete_arena(token_arena);
+        diagnostics = NULL;
+        include_timing = NULL;
+        return;
+    }
 
-        add_file(&filepath);
-        add_predefined();
+    const uint16_t main_file_id = FILES_TOP.file_id;
 
-        token_arena = create_arena(TOKEN_ARENA_MAX_SIZE);
+    // The main file is lexed as the preprocessor needs it, its tokens are counted as they're lexed
+    end_file_lexing(main_file_id);
 
-        tokens = allocate_from_arena(token_arena, sizeof(tk_node));
-        tokens->token.lexeme = (string) {0};
-        tokens->next = NULL;
+    add_predefined();
 
-        // Lexer
-        scan_and_insert_tokens(tokens);
+    // Preprocessor, which has the lexer read the files a batch at a time
+    token_writer output;
+
+    if (streaming_output) {
+        open_token_writer(&output, &output_path, driver->line_markers);
+    }
 
-        // Preprocessor
-        process_preprocessing_tokens(tokens);
+    process_preprocessing_tokens(tokens, streaming_output ? &output : NULL);
+    finish_include_timing();
 
-        // Parser
+    // Parser
+    if (!driver->preprocess_only) {
         initialise_parser();
         create_ast_tree();
+        free_parser();
+    }
 
+    if (streaming_output) {
+        close_token_writer(&output);
+    } else {
+        save_tokens_to_file(&output_path, tk.next[tokens], driver->line_markers);
+    }
 
-        string output_path = create_local_string("output/", MAX_FILEPATH_LENGTH);
-        
-        string filename = string_rstr(&files_to_process[i], '/');
+    // A file with errors gets no manifest, so it's processed again and they're reported again
+    if (driver->incremental && diagnostics->len > 0) {
+        remove(manifest_path.data);
+    }
 
-        filename = string_slice(&filename, 1, filename.len);
+    if (driver->write_depfiles || (driver->incremental && diagnostics->len == 0)) {
+        write_dependencies(main_file_id, &output_path, driver->incremental && diagnostics->len == 0 ? &manifest_path : NULL,
+                           driver->write_depfiles ? &depfile_path : NULL, driver->options_hash);
+    }
+
+    debugf("File: %.*s\n", file_to_process->len, file_to_process->data);
+    debugf("Bytes used: %ld\n", token_arena->bytes_used);
+    debugf("Nodes created: %u\n", tk.len - 1);
+    debugf("Max Macros: %ld\n\n", max_macros);
 
-        string_cat(&output_path, &filename);
-output_path.data[output_path.len-1] = 'i';
+    delete_arena(token_arena);
+    release_source_buffers();
+    unload_pch();
+    reset_file_table();
+    num_macros = 0;
 
-        save_tokens_to_file(&output_path, tokens->next);
+    diagnostics = NULL;
+    include_timing = NULL;
+}
 
-        debugf("File: %.*s\n", files_to_process[i].len, files_to_process[i].data);
-        debugf("Bytes used: %ld\n", token_arena->bytes_used);
-        debugf("Nodes created: %ld\n", token_arena->bytes_used / sizeof(tk_node));
-        debugf("Max Macros: %ld\n\n", max_macros);
+// Frees everything the thread kept from one translation unit to the next, once it's run its last one
+static void finish_worker(void *context) {
+    (void) context;
 
-        delete_arena(token_arena);
-        num_macros = 0;
+    free_token_buffer();
+    free_retained_buffers();
+    free_preprocessor();
+    free_pch_atoms();
+    free_file_hashes();
+    free_open_files();
+    free_file_table();
+    free_hidesets();
+    free_intern_table();
+}
+
+int main(int argc, char **argv) {
+    bool preprocess_only = false;
+    bool line_markers = false;
+    const char *include_report_path = NULL;
+    const char *include_trace_path = NULL;
+    string files_to_process[argc];
+    size_t num_files = 0;
+    bool write_depfiles = false;
+    bool incremental = false;
+    uint64_t options_hash = INITIAL_CONTENT_HASH;
+    unsigned num_threads = 1;
+
+    init_char_scan();
+
+    for (int i = 1; i < argc; i++) {
+        const int option_start = i;
+        bool affects_output = true;
+
+        if (strcmp(argv[i], "--mmap") == 0) {
+            zero_copy_lexing = true;
+        } else if (strcmp(argv[i], "--line-markers") == 0) {
+            line_markers = true;
+        } else if (strcmp(argv[i], "-MD") == 0) {
+            write_depfiles = true;
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            incremental = true;
+            record_content_hashes = true;
+            affects_output = false;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            affects_output = false;
+
+            // The number of threads can be attached to the option or be the next argument
+            const char *count = argv[i][2] == 0 && i + 1 < argc ? argv[++i] : argv[i] + 2;
+            char *count_end;
+            const long parsed_count = strtol(count, &count_end, 10);
+
+            if (*count == 0 || *count_end != 0 || parsed_count < 1 || parsed_count > MAX_THREADS) {
+                fprintf(stderr, "Expected a number of threads from 1 to %d after -j\n", MAX_THREADS);
+                return 1;
+            }
+
+            num_threads = (unsigned) parsed_count;
+        } else if (strcmp(argv[i], "--pch") == 0 || strcmp(argv[i], "--emit-pch") == 0) {
+            // --emit-pch saves the state after the translation unit, --pch uses it for the header it was built from
+            if (i + 1 == argc) {
+                fprintf(stderr, "Missing file after %s\n", argv[i]);
+                return 1;
+            }
+
+            if (strcmp(argv[i], "--emit-pch") == 0) {
+                pch_output_path = argv[++i];
+            } else {
+                open_pch(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--include-report") == 0 || strcmp(argv[i], "--include-trace") == 0) {
+            // A table of what each header cost, or the same as Chrome trace events
+            if (i + 1 == argc) {
+                fprintf(stderr, "Missing file after %s\n", argv[i]);
+                return 1;
+            }
+
+            if (strcmp(argv[i], "--include-report") == 0) {
+                include_report_path = argv[++i];
+            } else {
+                include_trace_path = argv[++i];
+            }
+
+            affects_output = false;
+        } else if (strcmp(argv[i], "-E") == 0) {
+            preprocess_only = true;
+        } else if (strncmp(argv[i], "-I", 2) == 0 || strncmp(argv[i], "-isystem", 8) == 0) {
+            const bool is_system = argv[i][1] == 'i';
+            const char *dir = argv[i] + (is_system ? 8 : 2);
+
+            // The directory can be attached to the option or be the next argument
+            if (*dir == 0) {
+                if (i + 1 == argc) {
+                    fprintf(stderr, "Missing directory after %s\n", argv[i]);
+                    return 1;
+                }
+
+                dir = argv[++i];
+            }
+
+            add_include_dir(dir, is_system);
+        } else {
+            const uint16_t len = (uint16_t) strlen(argv[i]);
+            files_to_process[num_files++] = (string) {.data = argv[i], .len = len, .cap = len + 1};
+            affects_output = false;
+        }
+
+        for (int j = option_start; affects_output && j <= i; j++) {
+            options_hash = hash_bytes(options_hash, argv[j], strlen(argv[j]) + 1);
+        }
+    }
+
+    add_default_include_dirs();
+
+    if (pch_output_path != NULL && num_files > 1) {
+        fprintf(stderr, "--emit-pch takes a single file\n");
+        return 1;
     }
+
+    driver_context driver = {.files_to_process = files_to_process, .preprocess_only = preprocess_only,
+                             .line_markers = line_markers, .write_depfiles = write_depfiles,
+                             .incremental = incremental, .options_hash = options_hash,
+                             .diagnostics = calloc(num_files, sizeof(message_buffer))};
+
+    if (include_report_path != NULL || include_trace_path != NULL) {
+        driver.include_timings = calloc(num_files, sizeof(include_timings));
+        start_include_timing();
+    }
+
+    run_tasks(num_files, num_threads, process_translation_unit, finish_worker, &driver);
+
+    // Shared by all the threads
+    free_header_cache();
+    free_include_cache();
+
+    // Each file's messages are printed together, in the order the files were given
+    for (size_t i = 0; i < num_files; i++) {
+        if (driver.diagnostics[i].len > 0) {
+            fwrite(driver.diagnostics[i].data, 1, driver.diagnostics[i].len, stderr);
+        }
+        free(driver.diagnostics[i].data);
+    }
+
+    free(driver.diagnostics);
+
+    if (include_report_path != NULL && !write_include_report(include_report_path, driver.include_timings, num_files)) {
+        fprintf(stderr, "Cannot write %s\n", include_report_path);
+    }
+
+    if (include_trace_path != NULL && !write_include_trace(include_trace_path, driver.include_timings, num_files)) {
+        fprintf(stderr, "Cannot write %s\n", include_trace_path);
+    }
+
+    if (driver.include_timings != NULL) {
+        free_include_timings(driver.include_timings, num_files);
+    }
+
+    free_token_buffer();
 }
@@ -0,0 +1,316 @@
+#include "manifest.h"
+#include "common.h"
+#include "file_table.h"
+#include "hash_table.h"
+#include "memory.h"
+#include "preprocessor.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// A manifest lists every file a translation unit read, with a hash of its contents, so a later run
+// can tell the output would come out the same without preprocessing it again. The last line marks
+// the manifest as complete, one cut short by a crash must not look like a shorter list of files
+#define MANIFEST_HEADER "untitled_compiler_project manifest 1\n"
+#define MANIFEST_END "end\n"
+
+#define MAX_HASHED_FILES (1 << 16)
+#define HASH_ARENA_BLOCK_SIZE (sizeof(ht) + sizeof(ht_entry) * MAX_HASHED_FILES + (1 << 20))
+#define HASH_CHUNK_SIZE (1 << 16)
+
+// A file's content hash, with the size and modification time it was worked out for
+typedef struct {
+    uint64_t hash;
+    time_t mtime;
+    off_t size;
+    time_t hashed_at;
+} file_hash;
+
+// Set for --incremental, so add_file hashes what it reads for the manifest, see write_manifest
+bool record_content_hashes = false;
+
+// Headers are shared by most translation units, so each is only hashed once per thread while it's unchanged
+static THREAD_LOCAL memory_arena *file_hash_arena;
+static THREAD_LOCAL ht *file_hashes; // Keyed by path
+
+// Mixes data into hash 8 bytes at a time, like ht_hash does.
+// Hashing the same pieces of data in the same order always gives the same result
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    static const uint64_t MULTIPLIER = 0xFF51AFD7ED558CCD;
+
+    const char *bytes = data;
+    uint64_t word;
+
+    for (; len >= sizeof(word); bytes += sizeof(word), len -= sizeof(word)) {
+        memcpy(&word, bytes, sizeof(word));
+
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+
+    if (len > 0) {
+        word = 0;
+        memcpy(&word, bytes, len);
+
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+void free_file_hashes(void) {
+    if (file_hash_arena != NULL) {
+        delete_arena(file_hash_arena);
+    }
+
+    file_hash_arena = NULL;
+    file_hashes = NULL;
+}
+
+// The hash of data, as hash_file_contents would give it for a file holding just that
+uint64_t hash_buffer_contents(const char *data, size_t size) {
+    const uint64_t total_size = size;
+
+    return hash_bytes(hash_bytes(INITIAL_CONTENT_HASH, data, size), &total_size, sizeof(total_size));
+}
+
+// Reads the whole file, without looking at the cache of hashes. Returns false if it can't be read
+bool hash_file_contents(const char *path, uint64_t *hash) {
+    FILE *file_stream = fopen(path, "rb");
+
+    if (file_stream == NULL) {
+        return false;
+    }
+
+    // Chunks are a multiple of 8 bytes, so the hash doesn't depend on how the file was read
+    char *chunk = malloc(HASH_CHUNK_SIZE);
+    uint64_t content_hash = INITIAL_CONTENT_HASH;
+    uint64_t total_size = 0;
+    size_t bytes_read;
+
+    while ((bytes_read = fread(chunk, 1, HASH_CHUNK_SIZE, file_stream)) > 0) {
+        content_hash = hash_bytes(content_hash, chunk, bytes_read);
+        total_size += bytes_read;
+    }
+
+    content_hash = hash_bytes(content_hash, &total_size, sizeof(total_size));
+
+    free(chunk);
+    fclose(file_stream);
+
+    *hash = content_hash;
+
+    return true;
+}
+
+// Returns false if the file can't be read
+static bool hash_file(const char *path, uint64_t *hash) {
+    const size_t path_len = strlen(path);
+    const string key = {.data = (char *) path, .len = (uint16_t) path_len, .cap = (uint16_t) (path_len + 1)};
+    struct stat file_stat;
+
+    if (path_len >= MAX_FILEPATH_LENGTH || stat(path, &file_stat) != 0) {
+        return false;
+    }
+
+    if (file_hashes == NULL) {
+        file_hash_arena = create_arena(HASH_ARENA_BLOCK_SIZE);
+        file_hashes = ht_alloc(MAX_HASHED_FILES, ht_compare_strcmp, file_hash_arena);
+    }
+
+    file_hash *known_hash = (file_hash *) ht_get(file_hashes, &key);
+
+    // A file can be rewritten within the same second without its size changing,
+    // so the hash is only reused if the file had been left alone for longer than that
+    if (known_hash != NULL && known_hash->mtime == file_stat.st_mtime && known_hash->size == file_stat.st_size &&
+        known_hash->mtime + 1 < known_hash->hashed_at) {
+        *hash = known_hash->hash;
+        return true;
+    }
+
+    uint64_t content_hash;
+
+    if (!hash_file_contents(path, &content_hash)) {
+        return false;
+    }
+
+    // Past half full, files are just hashed every time
+    if (known_hash == NULL && file_hashes->length * 2 < file_hashes->capacity) {
+        string *path_copy = allocate_from_arena(file_hash_arena, sizeof(string));
+
+        *path_copy = create_heap_string((uint16_t) (path_len + 1), file_hash_arena);
+        string_copy(path_copy, &key);
+
+        known_hash = allocate_from_arena(file_hash_arena, sizeof(file_hash));
+        ht_add(file_hashes, known_hash, path_copy);
+    }
+
+    if (known_hash != NULL) {
+        *known_hash = (file_hash) {.hash = content_hash, .mtime = file_stat.st_mtime, .size = file_stat.st_size,
+                                   .hashed_at = time(NULL)};
+    }
+
+    *hash = content_hash;
+
+    return true;
+}
+
+// Whether the output is still what the translation unit the manifest was written for would produce:
+// it exists, the options that affect it are the same, and every file it read has the same contents
+bool manifest_up_to_date(const string *manifest_path, const string *output_path, uint64_t options_hash) {
+    char line[MAX_FILEPATH_LENGTH + 32];
+    struct stat output_stat;
+    FILE *manifest = fopen(manifest_path->data, "r");
+    bool up_to_date = false;
+
+    if (manifest == NULL) {
+        return false;
+    }
+
+    if (stat(output_path->data, &output_stat) == 0 && fgets(line, sizeof(line), manifest) != NULL &&
+        strcmp(line, MANIFEST_HEADER) == 0 && fgets(line, sizeof(line), manifest) != NULL &&
+        strncmp(line, "options ", 8) == 0 && strtoull(line + 8, NULL, 16) == options_hash) {
+        up_to_date = true;
+
+        // Each line is the file's hash and then its path
+        while (up_to_date && fgets(line, sizeof(line), manifest) != NULL && strcmp(line, MANIFEST_END) != 0) {
+            char *path = NULL;
+            const uint64_t recorded_hash = strtoull(line, &path, 16);
+            const size_t line_len = strlen(line);
+            uint64_t current_hash;
+
+            if (*path != ' ' || line_len == 0 || line[line_len - 1] != '\n') {
+                up_to_date = false;
+                break;
+            }
+
+            line[line_len - 1] = 0;
+            up_to_date = hash_file(path + 1, &current_hash) && current_hash == recorded_hash;
+        }
+
+        up_to_date &= strcmp(line, MANIFEST_END) == 0;
+    }
+
+    fclose(manifest);
+
+    return up_to_date;
+}
+
+// The main file comes first, the headers are sorted, so the list doesn't depend
+// on which thread ran the translation unit or what it ran before
+static int compare_paths(const void *file_one, const void *file_two) {
+    return string_cmp(&(*(const source_file *const *) file_one)->path, &(*(const source_file *const *) file_two)->path);
+}
+
+// Spaces and # are escaped with a backslash and $ is doubled, so make reads the path back as it is
+static void write_make_path(FILE *out_file, const string *path) {
+    for (uint16_t i = 0; i < path->len; i++) {
+        if (path->data[i] == ' ' || path->data[i] == '#') fputc('\\', out_file);
+        if (path->data[i] == '$') fputc('$', out_file);
+
+        fputc(path->data[i], out_file);
+    }
+}
+
+// Every header also gets an empty rule, so make doesn't fail once one has been deleted
+static void write_depfile(const string *depfile_path, const string *target,
+                          const source_file **files_read, uint16_t num_files_read) {
+    FILE *depfile = fopen(depfile_path->data, "w");
+
+    if (depfile == NULL) {
+        report("Cannot write %.*s\n", depfile_path->len, depfile_path->data);
+        return;
+    }
+
+    write_make_path(depfile, target);
+    fputc(':', depfile);
+
+    for (uint16_t i = 0; i < num_files_read; i++) {
+        fputs(i == 0 ? " " : " \\\n ", depfile);
+        write_make_path(depfile, &files_read[i]->path);
+    }
+
+    fputc('\n', depfile);
+
+    for (uint16_t i = 1; i < num_files_read; i++) {
+        fputc('\n', depfile);
+        write_make_path(depfile, &files_read[i]->path);
+        fputs(":\n", depfile);
+    }
+
+    fclose(depfile);
+}
+
+static void write_manifest(const string *manifest_path, const source_file **files_read, uint16_t num_files_read,
+                           uint64_t options_hash) {
+    FILE *manifest = fopen(manifest_path->data, "w");
+    bool complete = manifest != NULL;
+
+    if (manifest == NULL) {
+        return;
+    }
+
+    fprintf(manifest, MANIFEST_HEADER "options %016llx\n", (unsigned long long) options_hash);
+
+    // Files are hashed as they're read, so the hashes are of what the output was made from even if
+    // they've changed since. Only files read through a window have to be read again
+    for (uint16_t i = 0; complete && i < num_files_read; i++) {
+        uint64_t content_hash = files_read[i]->content_hash;
+
+        if (!files_read[i]->content_hashed) {
+            complete = hash_file(files_read[i]->path.data, &content_hash);
+        }
+
+        fprintf(manifest, "%016llx %.*s\n", (unsigned long long) content_hash,
+                files_read[i]->path.len, files_read[i]->path.data);
+    }
+
+    // A file that couldn't be hashed can't be checked next time, so there's no manifest at all
+    if (complete) {
+        fputs(MANIFEST_END, manifest);
+    }
+
+    fclose(manifest);
+
+    if (!complete) {
+        remove(manifest_path->data);
+    }
+}
+
+// Records the files the translation unit read: the main file and every header included in it,
+// including ones that came from the header cache or a precompiled header. Writes a make rule
+// for target to depfile_path and a manifest to manifest_path, either can be NULL
+void write_dependencies(uint16_t main_file_id, const string *target, const string *manifest_path,
+                        const string *depfile_path, uint64_t options_hash) {
+    const source_file **files_read = malloc(source_file_count() * sizeof(source_file *));
+    uint16_t num_files_read = 0;
+
+    files_read[num_files_read++] = get_source_file(main_file_id);
+
+    // A file that changed while it was being read has more than one entry, only the last is listed
+    for (uint16_t file_id = 0; file_id < source_file_count(); file_id++) {
+        const source_file *file = get_source_file(file_id);
+
+        if (file_id != main_file_id && included_in_translation_unit(file) && find_source_file(&file->path) == file_id) {
+            files_read[num_files_read++] = file;
+        }
+    }
+
+    qsort(&files_read[1], num_files_read - 1u, sizeof(source_file *), compare_paths);
+
+    if (depfile_path != NULL) {
+        write_depfile(depfile_path, target, files_read, num_files_read);
+    }
+
+    if (manifest_path != NULL) {
+        write_manifest(manifest_path, files_read, num_files_read, options_hash);
+    }
+
+    free(files_read);
+}
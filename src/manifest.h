@@ -0,0 +1,23 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "strings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define INITIAL_CONTENT_HASH 0x9E3779B97F4A7C15
+
+extern bool record_content_hashes;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_buffer_contents(const char *data, size_t size);
+bool hash_file_contents(const char *path, uint64_t *hash);
+
+bool manifest_up_to_date(const string *manifest_path, const string *output_path, uint64_t options_hash);
+void free_file_hashes(void);
+void write_dependencies(uint16_t main_file_id, const string *target, const string *manifest_path,
+                        const string *depfile_path, uint64_t options_hash);
+
+#endif // MANIFEST_H
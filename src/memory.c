@@ -1,33 +1,67 @@
-#include "memory.h"
-
-#include <stdlib.h>
-#include <stdio.h>
-
-#define MAX_ALIGNMENT 8
-
-memory_arena *create_arena(size_t capacity) {
-    memory_arena *arena = malloc(sizeof(memory_arena));
-    arena->data = malloc(capacity);
-    arena->bytes_used = 0;
-    arena->capacity = capacity;
-
-    return arena;
-}
-
-void *allocate_from_arena(memory_arena* arena, size_t size) {
-    size_t aligned_size = size + (-size & (MAX_ALIGNMENT - 1));
-
-    if (arena->bytes_used + aligned_size > arena->capacity) {
-        printf("\033[91mOut of Memory! Goodbye!\033[0m\n");
-        exit(1);
-    }
-
-    arena->bytes_used += aligned_size;
-
-    return (char*) arena->data + arena->bytes_used - aligned_size;
-}
-
-void delete_arena(memory_arena *arena) {
-    free(arena->data);
-    free(arena);
-}
+#include "memory.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAX_ALIGNMENT 8
+
+memory_arena *create_arena(size_t capacity) {
+    memory_arena *arena = malloc(sizeof(memory_arena));
+    arena->data = malloc(capacity);
+    arena->bytes_used = 0;
+    arena->capacity = capacity;
+    arena->full_blocks = NULL;
+
+    return arena;
+}
+
+// Moves the current block onto the list of full blocks and starts a new one,
+// at least as large as the last so the number of blocks stays small
+static void grow_arena(memory_arena *arena, size_t min_size) {
+    memory_arena *full_block = malloc(sizeof(memory_arena));
+    const size_t new_capacity = arena->capacity > min_size ? arena->capacity : min_size;
+    void *new_data = malloc(new_capacity);
+
+    if (full_block == NULL || new_data == NULL) {
+        printf("\033[91mOut of Memory! Goodbye!\033[0m\n");
+        exit(1);
+    }
+
+    *full_block = *arena;
+
+    arena->data = new_data;
+    arena->bytes_used = 0;
+    arena->capacity = new_capacity;
+    arena->full_blocks = full_block;
+}
+
+void *allocate_from_arena(memory_arena* arena, size_t size) {
+    size_t aligned_size = size + (-size & (MAX_ALIGNMENT - 1));
+
+    if (arena->bytes_used + aligned_size > arena->capacity) {
+        grow_arena(arena, aligned_size);
+    }
+
+    arena->bytes_used += aligned_size;
+
+    return (char*) arena->data + arena->bytes_used - aligned_size;
+}
+
+// Frees every allocation, keeping the current block for the next ones
+void reset_arena(memory_arena *arena) {
+    delete_arena(arena->full_blocks);
+
+    arena->bytes_used = 0;
+    arena->full_blocks = NULL;
+}
+
+void delete_arena(memory_arena *arena) {
+    while (arena != NULL) {
+        memory_arena *full_blocks = arena->full_blocks;
+
+        free(arena->data);
+        free(arena);
+
+        arena = full_blocks;
+    }
+}
@@ -1,17 +1,21 @@
-#ifndef MEMORY_H
-#define MEMORY_H
-
-#include <stddef.h>
-
-typedef struct {
-    void *data;
-    size_t bytes_used;
-    size_t capacity;
-} memory_arena;
-
-memory_arena *create_arena(size_t capacity);
-
-void *allocate_from_arena(memory_arena *arena, size_t size);
-void delete_arena(memory_arena *arena);
-
-#endif //MEMORY_H
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+typedef struct memory_arena {
+    void *data;
+    size_t bytes_used;
+    size_t capacity;
+
+    // Blocks that filled up, kept until the arena is deleted so their allocations stay valid
+    struct memory_arena *full_blocks;
+} memory_arena;
+
+memory_arena *create_arena(size_t capacity);
+
+void *allocate_from_arena(memory_arena *arena, size_t size);
+void reset_arena(memory_arena *arena);
+void delete_arena(memory_arena *arena);
+
+#endif //MEMORY_H
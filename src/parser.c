@@ -3,6 +3,7 @@
 #include "memory.h"
 #include "parser.h"
 #include "helper_functions.h"
+#include "thread_pool.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,18 +13,18 @@
 #define AST_ARENA_MAX_SIZE (sizeof(AST_node) * (1 << 20))
 #define TK_STREAM_ARENA_MAX_SIZE (sizeof(token) * (1 << 20))
 
-memory_arena *ast_arena;
-memory_arena *token_stream_arena;
+THREAD_LOCAL memory_arena *ast_arena;
+THREAD_LOCAL memory_arena *token_stream_arena;
 
-AST_node *ast_tree;
-token *token_stream;
-uint64_t tk_stream_pos = 0;
-uint64_t tk_stream_len = 0;
+THREAD_LOCAL AST_node *ast_tree;
+THREAD_LOCAL token *token_stream;
+THREAD_LOCAL uint64_t tk_stream_pos = 0;
+THREAD_LOCAL uint64_t tk_stream_len = 0;
 
-token *current_token;
-token end_token = {.type = END, 0};
+THREAD_LOCAL token *current_token;
+THREAD_LOCAL token end_token = {.type = END, 0};
 
-AST_node error_node = {0};
+THREAD_LOCAL AST_node error_node = {0};
 
 typedef enum {
     MULTIPLICATIVE_EXPR,
@@ -458,9 +459,9 @@ AST_node *create_expression(int precedence) {
 void initialise_parser(void) {
     size_t token_count = 0;
 
-    for (tk_node *ptr = tokens->next; ptr != NULL; ptr = advance_list(ptr, 1)) {
+    for (tk_node ptr = tk.next[tokens]; ptr != TK_NONE; ptr = tk.next[ptr]) {
         // END and NEWLINE tokens aren't needed from the parser onwards
-        if (ptr->token.type == END || ptr->token.type == NEWLINE) continue;
+        if (tk.type[ptr] == END || tk.type[ptr] == NEWLINE) continue;
 
         token_count++;
     }
@@ -472,19 +473,29 @@ void initialise_parser(void) {
     tk_stream_len = token_count;
     token_count = 0;
 
-    for (tk_node *ptr = tokens->next; ptr != NULL; ptr = advance_list(ptr, 1)) {
+    for (tk_node ptr = tk.next[tokens]; ptr != TK_NONE; ptr = tk.next[ptr]) {
         // END and NEWLINE tokens aren't needed from the parser onwards
-        if (ptr->token.type == END || ptr->token.type == NEWLINE) continue;
+        if (tk.type[ptr] == END || tk.type[ptr] == NEWLINE) continue;
 
-        token_stream[token_count] = ptr->token;
+        token_stream[token_count] = get_token(ptr);
         token_count++;
     }
 }
 
+// Frees the token stream and the tree made by initialise_parser and create_ast_tree
+void free_parser(void) {
+    delete_arena(ast_arena);
+    delete_arena(token_stream_arena);
+
+    ast_arena = NULL;
+    token_stream_arena = NULL;
+    ast_tree = NULL;
+    token_stream = NULL;
+}
+
 AST_node *create_ast_tree(void) {
     AST_node *node = NULL;
     token *token = NULL;
-    ast_arena = create_arena(AST_ARENA_MAX_SIZE);
 
 
     while ((token = peek_token()) != NULL) {
@@ -503,7 +514,7 @@ AST_node *create_ast_tree(void) {
 }
 
 void ast_error(token *error_token, char *message) {
-    error(error_token->src_filepath, error_token->line, message);
+    error(error_token->loc, message);
 }
 
 void print_ast(const AST_node *root, uint8_t level) {
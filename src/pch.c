@@ -0,0 +1,783 @@
+#include "pch.h"
+#include "common.h"
+#include "debug.h"
+#include "file_table.h"
+#include "hash_table.h"
+#include "include_paths.h"
+#include "memory.h"
+#include "preprocessor.h"
+#include "strings.h"
+#include "thread_pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PCH_MAGIC "UCPCH\r\n"
+#define PCH_VERSION 2
+
+#define PCH_ARENA_BLOCK_SIZE (1 << 20)
+
+#define NO_PCH_INDEX UINT32_MAX
+
+// A precompiled header is the state left by preprocessing a header as its own translation unit:
+// the macro table it ended with, and the tokens it produced. The file is mapped and used in place,
+// so each section is an array of fixed size records, 8-byte aligned, referring to strings and files
+// by their index. Strings are NULL terminated, so lexemes can point straight into the mapping
+
+enum pch_section {
+    PCH_STRINGS,
+    PCH_STRING_DATA,
+    PCH_FILES,
+    PCH_LINE_OFFSETS,
+    PCH_MACROS,
+    PCH_PARAMETERS,
+    PCH_MACRO_TOKENS,
+    PCH_TOKENS,
+    PCH_OPTIONS,
+    NUM_PCH_SECTIONS
+};
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size; // In bytes
+} pch_section_range;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_file; // The file that was precompiled
+    pch_section_range sections[NUM_PCH_SECTIONS];
+} pch_header;
+
+typedef struct {
+    uint32_t offset; // Into the string data
+    uint32_t len;
+} pch_string;
+
+// Every file the header was built from, which all have to be unchanged for it to be used
+typedef struct {
+    uint32_t path;
+    uint32_t size;
+    int64_t mtime;
+    uint32_t first_line; // Into the line offsets
+    uint32_t num_lines;
+    uint32_t include_guard; // NO_PCH_INDEX if there isn't one
+    uint32_t pragma_once;
+} pch_file;
+
+typedef struct {
+    uint32_t name;
+    uint32_t first_parameter; // Into the parameters
+    uint32_t num_params;
+    uint32_t first_token; // Into the macro tokens
+    uint32_t replacement_len;
+    uint32_t defined_file;
+    uint32_t defined_offset;
+    uint8_t is_function_like;
+    uint8_t is_variadic;
+    uint8_t padding[2];
+} pch_macro;
+
+// What the header was built with besides its files, which has to be the same for it to be used:
+// the include directories decided which files its #includes found, and its macro table
+// started with the predefined macros
+enum pch_option_kind {
+    PCH_OPTION_USER_DIR,
+    PCH_OPTION_SYSTEM_DIR,
+    PCH_OPTION_PREDEFINED, // One for each line
+};
+
+typedef struct {
+    uint32_t kind;
+    uint32_t value;
+} pch_option;
+
+typedef struct {
+    uint64_t value;
+    uint32_t lexeme;
+    uint32_t atom;
+    uint32_t file; // NO_PCH_INDEX for tokens with no location
+    uint32_t offset;
+    uint8_t type;
+    uint8_t subtype;
+    uint8_t flags;
+    uint8_t padding[5];
+} pch_token;
+
+static const size_t pch_element_sizes[NUM_PCH_SECTIONS] = {
+    [PCH_STRINGS] = sizeof(pch_string),
+    [PCH_STRING_DATA] = 1,
+    [PCH_FILES] = sizeof(pch_file),
+    [PCH_LINE_OFFSETS] = sizeof(uint32_t),
+    [PCH_MACROS] = sizeof(pch_macro),
+    [PCH_PARAMETERS] = sizeof(uint32_t),
+    [PCH_MACRO_TOKENS] = sizeof(pch_token),
+    [PCH_TOKENS] = sizeof(pch_token),
+    [PCH_OPTIONS] = sizeof(pch_option),
+};
+
+const char *pch_output_path = NULL;
+
+// Gets the option at index in the order they're saved, returns false past the last one
+static bool get_pch_option(uint32_t index, enum pch_option_kind *kind, string *value) {
+    size_t num_dirs[2];
+    const string *dirs[2] = {get_include_dirs(false, &num_dirs[0]), get_include_dirs(true, &num_dirs[1])};
+
+    for (int is_system = 0; is_system < 2; is_system++) {
+        if (index < num_dirs[is_system]) {
+            *kind = is_system ? PCH_OPTION_SYSTEM_DIR : PCH_OPTION_USER_DIR;
+            *value = dirs[is_system][index];
+            return true;
+        }
+
+        index -= (uint32_t) num_dirs[is_system];
+    }
+
+    const char *line = predefined_macros;
+
+    for (; index > 0 && *line != 0; index--) {
+        line += strcspn(line, "\n");
+        line += *line == '\n';
+    }
+
+    if (*line == 0) {
+        return false;
+    }
+
+    const size_t len = strcspn(line, "\n");
+
+    *kind = PCH_OPTION_PREDEFINED;
+    *value = (string) {.data = (char *) line, .len = (uint16_t) len, .cap = (uint16_t) (len + 1)};
+
+    return true;
+}
+
+// Writing
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+} pch_buffer;
+
+typedef struct {
+    pch_buffer sections[NUM_PCH_SECTIONS];
+
+    // Each string is only saved once, the table maps it to its index
+    ht *string_indices;
+    memory_arena *arena;
+
+    // Indexed by file ID, NO_PCH_INDEX for files the header wasn't built from
+    uint32_t *file_indices;
+} pch_writer;
+
+static void append_to_buffer(pch_buffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->cap) {
+        while (buffer->size + size > buffer->cap) buffer->cap = buffer->cap ? buffer->cap * 2 : 4096;
+        buffer->data = realloc(buffer->data, buffer->cap);
+    }
+
+    memcpy(&buffer->data[buffer->size], data, size);
+    buffer->size += size;
+}
+
+static uint32_t save_pch_string(pch_writer *writer, const string *str) {
+    if (str->data == NULL) {
+        return NO_PCH_INDEX;
+    }
+
+    const uint32_t *existing_index = ht_get(writer->string_indices, str);
+
+    if (existing_index != NULL) {
+        return *existing_index;
+    }
+
+    pch_buffer *strings = &writer->sections[PCH_STRINGS];
+    pch_buffer *string_data = &writer->sections[PCH_STRING_DATA];
+    const pch_string new_string = {.offset = (uint32_t) string_data->size, .len = str->len};
+
+    append_to_buffer(string_data, str->data, str->len);
+    append_to_buffer(string_data, "", 1);
+
+    // The table keeps the key, so it needs a copy that lasts as long as the writer
+    string *key = allocate_from_arena(writer->arena, sizeof(string));
+    uint32_t *index = allocate_from_arena(writer->arena, sizeof(uint32_t));
+
+    *key = create_heap_string((uint16_t) (str->len + 1), writer->arena);
+    string_copy(key, str);
+    *index = (uint32_t) (strings->size / sizeof(pch_string));
+
+    append_to_buffer(strings, &new_string, sizeof(pch_string));
+    ht_add(writer->string_indices, index, key);
+
+    return *index;
+}
+
+static void save_pch_loc(const pch_writer *writer, source_loc loc, uint32_t *file, uint32_t *offset) {
+    *file = NO_PCH_INDEX;
+    *offset = 0;
+
+    if (loc == NO_SOURCE_LOC) {
+        return;
+    }
+
+    const uint16_t file_id = source_loc_file_id(loc);
+
+    if (writer->file_indices[file_id] != NO_PCH_INDEX) {
+        *file = writer->file_indices[file_id];
+        *offset = loc - get_source_file(file_id)->base;
+    }
+}
+
+static void save_pch_token(pch_writer *writer, enum pch_section section, const token *saved_token) {
+    pch_token new_token = {
+        .value = saved_token->value,
+        .lexeme = save_pch_string(writer, &saved_token->lexeme),
+        .atom = saved_token->atom == NO_ATOM ? NO_PCH_INDEX : save_pch_string(writer, atom_to_string(saved_token->atom)),
+        .type = (uint8_t) saved_token->type,
+        .subtype = (uint8_t) saved_token->subtype,
+        .flags = saved_token->follows_whitespace ? TK_FOLLOWS_WHITESPACE : 0
+    };
+
+    save_pch_loc(writer, saved_token->loc, &new_token.file, &new_token.offset);
+    append_to_buffer(&writer->sections[section], &new_token, sizeof(pch_token));
+}
+
+static bool save_pch_files(pch_writer *writer) {
+    for (uint16_t file_id = 0; file_id < source_file_count(); file_id++) {
+        if (writer->file_indices[file_id] == NO_PCH_INDEX) {
+            continue;
+        }
+
+        const source_file *file = get_source_file(file_id);
+        struct stat file_stat;
+
+        if (stat(file->path.data, &file_stat) != 0) {
+            return false;
+        }
+
+        const pch_file new_file = {
+            .path = save_pch_string(writer, &file->path),
+            .size = file->size,
+            .mtime = (int64_t) file_stat.st_mtime,
+            .first_line = (uint32_t) (writer->sections[PCH_LINE_OFFSETS].size / sizeof(uint32_t)),
+            .num_lines = file->num_lines,
+            .include_guard = file->include_guard == NO_ATOM ? NO_PCH_INDEX :
+                             save_pch_string(writer, atom_to_string(file->include_guard)),
+            .pragma_once = file->pragma_once
+        };
+
+        append_to_buffer(&writer->sections[PCH_FILES], &new_file, sizeof(pch_file));
+        append_to_buffer(&writer->sections[PCH_LINE_OFFSETS], file->line_offsets, file->num_lines * sizeof(uint32_t));
+    }
+
+    return true;
+}
+
+static void save_pch_options(pch_writer *writer) {
+    enum pch_option_kind kind;
+    string value;
+
+    for (uint32_t i = 0; get_pch_option(i, &kind, &value); i++) {
+        const pch_option new_option = {.kind = kind, .value = save_pch_string(writer, &value)};
+
+        append_to_buffer(&writer->sections[PCH_OPTIONS], &new_option, sizeof(pch_option));
+    }
+}
+
+static void save_pch_macros(pch_writer *writer) {
+    for (size_t i = 0; i < macro_hash_table->capacity; i++) {
+        if (macro_hash_table->entries[i].status != OCCUPIED) {
+            continue;
+        }
+
+        const macro *saved_macro = macro_hash_table->entries[i].value;
+        pch_macro new_macro = {
+            .name = save_pch_string(writer, atom_to_string(saved_macro->name)),
+            .first_parameter = (uint32_t) (writer->sections[PCH_PARAMETERS].size / sizeof(uint32_t)),
+            .num_params = (uint32_t) saved_macro->num_params,
+            .first_token = (uint32_t) (writer->sections[PCH_MACRO_TOKENS].size / sizeof(pch_token)),
+            .replacement_len = saved_macro->replacement_len,
+            .is_function_like = saved_macro->is_function_like,
+            .is_variadic = saved_macro->is_variadic
+        };
+
+        save_pch_loc(writer, saved_macro->defined_loc, &new_macro.defined_file, &new_macro.defined_offset);
+        append_to_buffer(&writer->sections[PCH_MACROS], &new_macro, sizeof(pch_macro));
+
+        for (short j = 0; j < saved_macro->num_params; j++) {
+            const uint32_t parameter = save_pch_string(writer, atom_to_string(saved_macro->parameters[j]));
+
+            append_to_buffer(&writer->sections[PCH_PARAMETERS], &parameter, sizeof(uint32_t));
+        }
+
+        for (uint32_t j = 0; j < saved_macro->replacement_len; j++) {
+            save_pch_token(writer, PCH_MACRO_TOKENS, &saved_macro->replacement[j]);
+        }
+    }
+}
+
+// Saves the macro table and the preprocessed tokens of the translation unit, first is its first token.
+// The main file and the headers it included are recorded, tokens left over from the file before
+// the main one (the predefined macros, which every translation unit starts with) are left out
+void write_pch(const char *path, tk_node first, uint32_t translation_unit) {
+    pch_writer writer = {0};
+    size_t max_strings = 1;
+    tk_node last = first;
+
+    if (first == TK_NONE) {
+        return;
+    }
+
+    for (tk_node ptr = first; ptr != TK_NONE; ptr = tk.next[ptr]) {
+        last = ptr;
+        max_strings += 2;
+    }
+
+    for (size_t i = 0; i < macro_hash_table->capacity; i++) {
+        if (macro_hash_table->entries[i].status == OCCUPIED) {
+            const macro *saved_macro = macro_hash_table->entries[i].value;
+            max_strings += 1 + (size_t) saved_macro->num_params + 2 * saved_macro->replacement_len;
+        }
+    }
+
+    enum pch_option_kind option_kind;
+    string option_value;
+
+    for (uint32_t i = 0; get_pch_option(i, &option_kind, &option_value); i++) max_strings++;
+
+    // The main file's END token is always the last
+    const uint16_t prefix_file_id = source_loc_file_id(tk.loc[first]);
+    const uint16_t main_file_id = source_loc_file_id(tk.loc[last]);
+
+    writer.file_indices = malloc(source_file_count() * sizeof(uint32_t));
+    uint32_t num_files = 0;
+
+    for (uint16_t file_id = 0; file_id < source_file_count(); file_id++) {
+        const bool included = file_id == main_file_id || get_source_file(file_id)->last_included == translation_unit;
+
+        writer.file_indices[file_id] = included ? num_files++ : NO_PCH_INDEX;
+        max_strings += 2;
+    }
+
+    writer.arena = create_arena(sizeof(ht) + sizeof(ht_entry) * 2 * max_strings + PCH_ARENA_BLOCK_SIZE);
+    writer.string_indices = ht_alloc(2 * max_strings, ht_compare_strcmp, writer.arena);
+
+    pch_header header = {.magic = PCH_MAGIC, .version = PCH_VERSION, .header_file = writer.file_indices[main_file_id]};
+    bool saved = save_pch_files(&writer);
+
+    save_pch_options(&writer);
+    save_pch_macros(&writer);
+
+    for (tk_node ptr = first; ptr != TK_NONE; ptr = tk.next[ptr]) {
+        if (prefix_file_id != main_file_id && tk.loc[ptr] != NO_SOURCE_LOC &&
+            source_loc_file_id(tk.loc[ptr]) == prefix_file_id) {
+            continue;
+        }
+
+        const token saved_token = get_token(ptr);
+        save_pch_token(&writer, PCH_TOKENS, &saved_token);
+    }
+
+    FILE *pch_file_stream = saved ? fopen(path, "wb") : NULL;
+
+    if (pch_file_stream != NULL) {
+        static const char padding[8] = {0};
+        uint64_t offset = sizeof(pch_header);
+
+        for (enum pch_section section = 0; section < NUM_PCH_SECTIONS; section++) {
+            header.sections[section] = (pch_section_range) {.offset = offset, .size = writer.sections[section].size};
+            offset += writer.sections[section].size + (-writer.sections[section].size & 7);
+        }
+
+        saved = fwrite(&header, sizeof(pch_header), 1, pch_file_stream) == 1;
+
+        for (enum pch_section section = 0; saved && section < NUM_PCH_SECTIONS; section++) {
+            const size_t size = writer.sections[section].size;
+
+            // An empty section has no data to write
+            saved = (size == 0 || fwrite(writer.sections[section].data, 1, size, pch_file_stream) == size) &&
+                    fwrite(padding, 1, -size & 7, pch_file_stream) == (-size & 7);
+        }
+
+        saved &= fclose(pch_file_stream) == 0;
+    } else {
+        saved = false;
+    }
+
+    if (!saved) {
+        report("Cannot write precompiled header %s\n", path);
+    }
+
+    for (enum pch_section section = 0; section < NUM_PCH_SECTIONS; section++) {
+        free(writer.sections[section].data);
+    }
+
+    free(writer.file_indices);
+    delete_arena(writer.arena);
+}
+
+// Reading
+
+static const char *pch_data;
+static const pch_header *pch;
+
+// Only worked out the first time a header the precompiled one could stand in for is included
+static THREAD_LOCAL bool pch_checked = false;
+static THREAD_LOCAL bool pch_valid = false;
+static THREAD_LOCAL dev_t header_device;
+static THREAD_LOCAL ino_t header_inode;
+
+static THREAD_LOCAL atom *pch_atoms; // Indexed by string, NO_ATOM until the string is first needed as an atom
+
+// The files and macros are loaded again for each translation unit that uses them, as file IDs
+// only last for one translation unit. Everything is freed by unload_pch once it's finished
+static THREAD_LOCAL bool pch_loaded = false;
+static THREAD_LOCAL bool pch_load_failed = false;
+static THREAD_LOCAL memory_arena *pch_arena;
+static THREAD_LOCAL uint16_t *pch_file_ids;
+static THREAD_LOCAL macro *loaded_macros;
+
+static const void *pch_section(enum pch_section section) {
+    return pch_data + pch->sections[section].offset;
+}
+
+static uint32_t pch_count(enum pch_section section) {
+    return (uint32_t) (pch->sections[section].size / pch_element_sizes[section]);
+}
+
+static string pch_string_at(uint32_t index) {
+    if (index >= pch_count(PCH_STRINGS)) {
+        return (string) {0};
+    }
+
+    const pch_string *saved_string = &((const pch_string *) pch_section(PCH_STRINGS))[index];
+    const char *string_data = pch_section(PCH_STRING_DATA);
+
+    return (string) {.data = (char *) &string_data[saved_string->offset], .len = (uint16_t) saved_string->len,
+                     .cap = (uint16_t) (saved_string->len + 1)};
+}
+
+static atom pch_atom(uint32_t index) {
+    if (index >= pch_count(PCH_STRINGS)) {
+        return NO_ATOM;
+    }
+
+    if (pch_atoms[index] == NO_ATOM) {
+        const string saved_string = pch_string_at(index);
+        pch_atoms[index] = intern(&saved_string);
+    }
+
+    return pch_atoms[index];
+}
+
+static source_loc load_pch_loc(uint32_t file, uint32_t offset) {
+    if (file >= pch_count(PCH_FILES) || offset > ((const pch_file *) pch_section(PCH_FILES))[file].size) {
+        return NO_SOURCE_LOC;
+    }
+
+    return make_source_loc(pch_file_ids[file], offset);
+}
+
+static token load_pch_token(const pch_token *saved_token) {
+    token loaded_token = {
+        .type = (enum token_type) saved_token->type,
+        .subtype = (enum subtype) saved_token->subtype,
+        .loc = load_pch_loc(saved_token->file, saved_token->offset),
+        .lexeme = pch_string_at(saved_token->lexeme),
+        .atom = pch_atom(saved_token->atom),
+        .value = saved_token->value,
+        .follows_whitespace = (saved_token->flags & TK_FOLLOWS_WHITESPACE) != 0
+    };
+
+    // Identifiers use their interned spelling, like the ones from the lexer
+    if (loaded_token.type == IDENTIFIER && loaded_token.atom != NO_ATOM) {
+        loaded_token.lexeme = *atom_to_string(loaded_token.atom);
+    }
+
+    return loaded_token;
+}
+
+// Maps the precompiled header at path, nothing in it is read until it's used
+bool open_pch(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open precompiled header %s\n", path);
+        return false;
+    }
+
+    if (fstat(fd, &file_stat) == -1 || (size_t) file_stat.st_size < sizeof(pch_header)) {
+        fprintf(stderr, "%s is not a precompiled header\n", path);
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t) file_stat.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map precompiled header %s\n", path);
+        return false;
+    }
+
+    const pch_header *header = data;
+    bool valid = memcmp(header->magic, PCH_MAGIC, sizeof(header->magic)) == 0 && header->version == PCH_VERSION;
+
+    for (enum pch_section section = 0; valid && section < NUM_PCH_SECTIONS; section++) {
+        const pch_section_range range = header->sections[section];
+
+        valid = range.offset % 8 == 0 && range.offset <= size && range.size <= size - range.offset &&
+                range.size % pch_element_sizes[section] == 0;
+    }
+
+    if (!valid || header->header_file >= header->sections[PCH_FILES].size / sizeof(pch_file)) {
+        fprintf(stderr, "%s is not a precompiled header for this version\n", path);
+        munmap(data, size);
+        return false;
+    }
+
+    // The mapping is kept for the rest of the run, lexemes point into it
+    pch_data = data;
+    pch = header;
+
+    return true;
+}
+
+static bool check_pch_ranges(void) {
+    const pch_string *strings = pch_section(PCH_STRINGS);
+    const char *string_data = pch_section(PCH_STRING_DATA);
+    const pch_file *saved_files = pch_section(PCH_FILES);
+    const pch_macro *saved_macros = pch_section(PCH_MACROS);
+
+    for (uint32_t i = 0; i < pch_count(PCH_STRINGS); i++) {
+        if (strings[i].len >= MAX_LEXEME_LENGTH || strings[i].offset + (uint64_t) strings[i].len >= pch_count(PCH_STRING_DATA) ||
+            string_data[strings[i].offset + strings[i].len] != 0) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < pch_count(PCH_FILES); i++) {
+        if (saved_files[i].path >= pch_count(PCH_STRINGS) || saved_files[i].num_lines == 0 ||
+            saved_files[i].first_line + (uint64_t) saved_files[i].num_lines > pch_count(PCH_LINE_OFFSETS)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < pch_count(PCH_MACROS); i++) {
+        if (saved_macros[i].num_params > INT16_MAX ||
+            saved_macros[i].first_parameter + (uint64_t) saved_macros[i].num_params > pch_count(PCH_PARAMETERS) ||
+            saved_macros[i].first_token + (uint64_t) saved_macros[i].replacement_len > pch_count(PCH_MACRO_TOKENS)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Whether this run has the same options the header was built with
+static bool pch_options_match(void) {
+    const pch_option *saved_options = pch_section(PCH_OPTIONS);
+    enum pch_option_kind kind;
+    string value;
+    uint32_t i = 0;
+
+    for (; get_pch_option(i, &kind, &value); i++) {
+        if (i == pch_count(PCH_OPTIONS)) {
+            return false;
+        }
+
+        const string saved_value = pch_string_at(saved_options[i].value);
+
+        if (saved_options[i].kind != kind || saved_value.data == NULL || string_cmp(&saved_value, &value) != 0) {
+            return false;
+        }
+    }
+
+    return i == pch_count(PCH_OPTIONS);
+}
+
+// The header can only be used with the options it was built with,
+// and if none of the files it was built from have changed since
+static bool pch_up_to_date(void) {
+    const pch_file *saved_files = pch_section(PCH_FILES);
+
+    if (!pch_options_match()) {
+        report("Precompiled header was built with different include directories or predefined macros\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < pch_count(PCH_FILES); i++) {
+        const string path = pch_string_at(saved_files[i].path);
+        struct stat file_stat;
+
+        if (stat(path.data, &file_stat) != 0 || (uint64_t) file_stat.st_size != saved_files[i].size ||
+            (int64_t) file_stat.st_mtime != saved_files[i].mtime) {
+            report("Precompiled header is out of date, %.*s has changed\n", path.len, path.data);
+            return false;
+        }
+
+        if (i == pch->header_file) {
+            header_device = file_stat.st_dev;
+            header_inode = file_stat.st_ino;
+        }
+    }
+
+    return true;
+}
+
+// Adds the files to the file table, and loads the macros.
+// Returns false if the translation unit has no room left for the files
+static bool load_pch(void) {
+    const pch_file *saved_files = pch_section(PCH_FILES);
+    const pch_macro *saved_macros = pch_section(PCH_MACROS);
+    const uint32_t *line_offsets = pch_section(PCH_LINE_OFFSETS);
+    const uint32_t *parameters = pch_section(PCH_PARAMETERS);
+    const pch_token *macro_tokens = pch_section(PCH_MACRO_TOKENS);
+
+    pch_arena = create_arena(PCH_ARENA_BLOCK_SIZE);
+    pch_file_ids = allocate_from_arena(pch_arena, pch_count(PCH_FILES) * sizeof(uint16_t));
+
+    for (uint32_t i = 0; i < pch_count(PCH_FILES); i++) {
+        const string path = pch_string_at(saved_files[i].path);
+
+        pch_file_ids[i] = add_source_file(&path, saved_files[i].size);
+
+        if (pch_file_ids[i] == NO_FILE_ID) {
+            return false;
+        }
+
+        source_file *file = get_source_file(pch_file_ids[i]);
+
+        set_line_table(pch_file_ids[i], &line_offsets[saved_files[i].first_line], saved_files[i].num_lines);
+
+        if (!file->guard_checked) {
+            file->include_guard = pch_atom(saved_files[i].include_guard);
+            file->guard_checked = true;
+        }
+
+        file->pragma_once |= saved_files[i].pragma_once != 0;
+    }
+
+    loaded_macros = allocate_from_arena(pch_arena, pch_count(PCH_MACROS) * sizeof(macro));
+
+    for (uint32_t i = 0; i < pch_count(PCH_MACROS); i++) {
+        const pch_macro *saved_macro = &saved_macros[i];
+        macro *loaded_macro = &loaded_macros[i];
+
+        *loaded_macro = (macro) {
+            .name = pch_atom(saved_macro->name),
+            .num_params = (short) saved_macro->num_params,
+            .parameters = allocate_from_arena(pch_arena, saved_macro->num_params * sizeof(atom)),
+            .is_function_like = saved_macro->is_function_like,
+            .is_variadic = saved_macro->is_variadic,
+            .replacement = allocate_from_arena(pch_arena, (saved_macro->replacement_len + 1) * sizeof(token)),
+            .replacement_len = saved_macro->replacement_len,
+            .defined_loc = load_pch_loc(saved_macro->defined_file, saved_macro->defined_offset)
+        };
+
+        for (uint32_t j = 0; j < saved_macro->num_params; j++) {
+            loaded_macro->parameters[j] = pch_atom(parameters[saved_macro->first_parameter + j]);
+        }
+
+        for (uint32_t j = 0; j < saved_macro->replacement_len; j++) {
+            loaded_macro->replacement[j] = load_pch_token(&macro_tokens[saved_macro->first_token + j]);
+        }
+
+        loaded_macro->replacement[saved_macro->replacement_len] = (token) {0};
+    }
+
+    return true;
+}
+
+// Frees what was loaded for the translation unit that's just finished
+void unload_pch(void) {
+    if (pch_arena != NULL) {
+        delete_arena(pch_arena);
+        pch_arena = NULL;
+    }
+
+    pch_loaded = false;
+    pch_load_failed = false;
+}
+
+// The header is checked again by the next thread to use it
+void free_pch_atoms(void) {
+    unload_pch();
+    free(pch_atoms);
+
+    pch_atoms = NULL;
+    pch_checked = false;
+    pch_valid = false;
+}
+
+// Whether the precompiled header was built from the header at path, and can be used in its place
+bool pch_covers(const string *header_path) {
+    char path_cstr[MAX_FILEPATH_LENGTH + 1];
+    struct stat file_stat;
+
+    if (pch == NULL) {
+        return false;
+    }
+
+    if (!pch_checked) {
+        pch_checked = true;
+        pch_valid = check_pch_ranges() && pch_up_to_date();
+
+        if (pch_valid) {
+            pch_atoms = calloc(pch_count(PCH_STRINGS), sizeof(atom));
+        }
+    }
+
+    snprintf(path_cstr, sizeof(path_cstr), "%.*s", header_path->len, header_path->data);
+
+    if (!pch_valid || stat(path_cstr, &file_stat) != 0 ||
+        file_stat.st_dev != header_device || file_stat.st_ino != header_inode) {
+        return false;
+    }
+
+    // Only loaded once the header it was built from is included
+    if (!pch_loaded) {
+        pch_loaded = true;
+        pch_load_failed = !load_pch();
+    }
+
+    return !pch_load_failed;
+}
+
+// The macro table the precompiled header ended with, only once pch_covers has found it can be used
+const macro *pch_macros(uint32_t *count) {
+    *count = pch_count(PCH_MACROS);
+
+    return loaded_macros;
+}
+
+// Inserts the precompiled header's tokens after insert_point, and marks the files it was built
+// from as included in this translation unit. Returns the last token, which is its END token
+tk_node splice_pch_tokens(tk_node insert_point, uint32_t translation_unit) {
+    const pch_token *saved_tokens = pch_section(PCH_TOKENS);
+    const tk_node rest = tk.next[insert_point];
+
+    for (uint32_t i = 0; i < pch_count(PCH_FILES); i++) {
+        get_source_file(pch_file_ids[i])->last_included = translation_unit;
+    }
+
+    for (uint32_t i = 0; i < pch_count(PCH_TOKENS); i++) {
+        const token loaded_token = load_pch_token(&saved_tokens[i]);
+        const tk_node new_node = new_token_node(&loaded_token);
+
+        tk.next[insert_point] = new_node;
+        insert_point = new_node;
+    }
+
+    tk.next[insert_point] = rest;
+
+    return insert_point;
+}
@@ -0,0 +1,21 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set to write a precompiled header of each translation unit once it's been preprocessed
+extern const char *pch_output_path;
+
+void write_pch(const char *path, tk_node first, uint32_t translation_unit);
+
+bool open_pch(const char *path);
+bool pch_covers(const string *header_path);
+const macro *pch_macros(uint32_t *count);
+tk_node splice_pch_tokens(tk_node insert_point, uint32_t translation_unit);
+void unload_pch(void);
+void free_pch_atoms(void);
+
+#endif // PCH_H
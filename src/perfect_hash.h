@@ -0,0 +1,19 @@
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <stdint.h>
+
+// Shared by the lexer and tools/gen_lexer_tables.c, which picks a seed per set of
+// strings (keywords, directives) so that no two strings in the set collide.
+// The length, first, second and last characters are packed into a key,
+// which is then hashed with a multiplicative hash. str must not be empty
+static inline uint32_t perfect_hash(const char *str, uint16_t len, uint32_t seed, uint8_t bits) {
+    const uint32_t key = (uint32_t) len |
+                         (uint32_t) (uint8_t) str[0] << 8 |
+                         (uint32_t) (uint8_t) str[len > 1] << 16 |
+                         (uint32_t) (uint8_t) str[len - 1] << 24;
+
+    return (key * seed) >> (32 - bits);
+}
+
+#endif // PERFECT_HASH_H
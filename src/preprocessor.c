@@ -1,967 +1,1386 @@
-#include "enums.h"
-#include "common.h"
-#include "preprocessor.h"
-
-#include <assert.h>
-#include <stdio.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <assert.h>
-#include <string.h>
-#include <unistd.h>
-
-#include "debug.h"
-#include "memory.h"
-#include "hash_table.h"
-#include "helper_functions.h"
-#include "strings.h"
-
-#define MEMORY_ARENA_MAX_SIZE ((sizeof(ht) + sizeof(ht_entry) * MAX_NUM_MACROS) + sizeof(macro) * MAX_NUM_MACROS)
-
-bool in_define = 0;
-bool in_include = 0;
-
-ht *macro_hash_table;
-size_t num_macros = 0;
-size_t max_macros = 0;
-
-memory_arena *macro_arena;
-
-// Some commonly used strings
-static string one_string = create_const_string("1");
-static string zero_string = create_const_string("0");
-static string defined_string = create_const_string("defined");
-static string exclamation_string = create_const_string("!");
-
-const string *current_src_file;
-int current_line;
-
-bool macros_equal(const macro *macro_one, const macro *macro_two) {
-    bool macros_equal = true;
-
-    const size_t replacement_length = sizeof(macro_one->replacement)/sizeof(macro_one->replacement[0]);
-    const size_t parameter_length = sizeof(macro_one->parameters)/sizeof(macro_one->parameters[0]);
-
-    macros_equal &= (string_cmp(&macro_one->name, &macro_two->name) == 0);
-    macros_equal &= (macro_one->is_function_like == macro_two->is_function_like);
-
-    for (size_t i = 0; i < replacement_length; i++) {
-        macros_equal &= (string_cmp(&macro_one->replacement[i].lexeme, &macro_two->replacement[i].lexeme) == 0);
-        macros_equal &= (macro_one->replacement[i].type == macro_two->replacement[i].type);
-        macros_equal &= (macro_one->replacement[i].subtype == macro_two->replacement[i].subtype);
-    }
-
-    macros_equal &= (macro_one->num_params == macro_two->num_params);
-
-    if (macro_one->is_function_like) {
-        for (size_t i = 0; i < parameter_length; i++) {
-            macros_equal &= (string_cmp(&macro_one->parameters[i], &macro_two->parameters[i]) == 0);
-        }
-    }
-
-    return macros_equal;
-}
-
-void add_macro(const macro new_macro) {
-    const macro* ht_entry = ht_get(macro_hash_table, &new_macro.name);
-
-    if (ht_entry != NULL) {
-        if (!macros_equal(&new_macro, ht_entry)) {
-            error(current_src_file, current_line, "Duplicate macro");
-        }
-        return;
-    }
-
-    macro *new_entry = allocate_from_arena(macro_arena, sizeof(macro));
-    *new_entry = new_macro;
-
-    ht_add(macro_hash_table, new_entry, &new_entry->name);
-
-    if (num_macros > max_macros)
-    {
-        max_macros = num_macros;
-    }
-}
-
-void remove_macro(const string *macro_name) {
-    ht_remove(macro_hash_table, macro_name);
-    return;
-}
-
-const macro *macro_exists(tk_node *token_node) {
-    if (token_node->token.type != IDENTIFIER) {
-        return NULL;
-    }
-
-    return ht_get(macro_hash_table, &token_node->token.lexeme);
-}
-
-void handle_include_directive(tk_node *token_node) {
-    // token_node points to the include token
-
-    // TODO: Use own standard library
-    const string include_dirs[] = {create_const_string("./standard_library_ready/"),
-                                   create_const_string("/usr/local/lib/clang/21/include/"),
-                                   create_const_string("/usr/local/include/"),
-                                   create_const_string("/usr/include/x86_64-linux-gnu/"),
-                                   create_const_string("/usr/include/")};
-
-    string header_path = create_local_string("", MAX_LEXEME_LENGTH);
-
-    bool found_header = false;
-
-    token_node = token_node->next;
-
-    token *header_token = &token_node->token;
-
-    // If the header name uses quotes, search in the current directory for the header
-    if (header_token->subtype == HEADER_Q) {
-        string_copy(&header_path, &header_token->src_filepath);
-        header_path.len = header_token->filename_index;
-        string_cat(&header_path, &header_token->lexeme);
-
-        found_header = add_file(&header_path);
-    }
-
-    // Try to open the header file in different include directories until successful
-    for (size_t i = 0; !found_header && i < sizeof(include_dirs)/sizeof(include_dirs[0]); i++) {
-        string_copy(&header_path, &include_dirs[i]);
-        string_cat(&header_path, &token_node->token.lexeme);
-
-        found_header = add_file(&header_path);
-    }
-
-    if (!found_header) {
-        char error_msg[64] = "Cannot find ";
-        strcat(error_msg, token_node->token.lexeme.data);
-
-        error(&token_node->token.src_filepath, token_node->token.line, error_msg);
-        return;
-    }
-
-    token_node = token_node->next;
-
-    debugf("Including: %.*s\n", header_path.len, header_path.data);
-    scan_and_insert_tokens(token_node);
-}
-
-void handle_define_directive(tk_node *token_node) {
-    in_define = 1;
-
-    macro new_macro = {0};
-
-    token *identifier_token = &token_node->token;
-
-    new_macro.defined_file = identifier_token->src_filepath;
-    new_macro.defined_line = identifier_token->line;
-
-    token_node = token_node->next;
-
-    if (identifier_token->type != IDENTIFIER) {
-        error(&identifier_token->src_filepath, identifier_token->line, "Expected identifier after #define");
-    }
-
-    new_macro.name = identifier_token->lexeme;
-    new_macro.hash = hash(&new_macro.name);
-
-    // If the token is a left parenthesis, and if there was no whitespace before it, it's function-like
-    if (token_node->token.subtype == PUN_LEFT_PARENTHESIS &&
-        token_node->token.follows_whitespace == false) {
-        token_node = token_node->next;
-
-        new_macro.is_function_like = true;
-
-        while (token_node->token.subtype != PUN_RIGHT_PARENTHESIS) {
-
-            if (token_node->token.type != IDENTIFIER && token_node->token.subtype != PUN_ELLIPSIS) {
-                error(&token_node->token.src_filepath, token_node->token.line,
-                     "Expected identifier or ... in macro parameter list");
-                return;
-            }
-
-            if (token_node->token.subtype == PUN_ELLIPSIS &&
-                token_node->next->token.subtype != PUN_RIGHT_PARENTHESIS) {
-                error(&token_node->token.src_filepath, token_node->token.line,
-                 "Expected ... to be the last argument");
-                return;
-            }
-
-            new_macro.parameters[new_macro.num_params++] = token_node->token.lexeme;
-
-            token_node = token_node->next;
-
-            if (token_node->token.subtype == PUN_COMMA) {
-                token_node = token_node->next;
-            }
-
-        }
-        token_node = token_node->next;
-    }
-
-    // Build up the replacement list
-    token *replacement_ptr = new_macro.replacement;
-
-    while (token_node->token.type != NEWLINE) {
-        *replacement_ptr = token_node->token;
-
-        for (short i = 0; i < new_macro.num_params; i++) {
-            if (string_cmp(&token_node->token.lexeme, &new_macro.parameters[i]) == 0) {
-                replacement_ptr->type = ARGUMENT;
-            }
-        }
-        replacement_ptr++;
-        token_node = token_node->next;
-    }
-
-    add_macro(new_macro);
-
-    in_define = 0;
-}
-
-void handle_undef_directive(tk_node *token_node) {
-    if (token_node->token.type != IDENTIFIER) {
-        error(&token_node->token.src_filepath, token_node->token.line, "Expected identifier after #undef");
-        return;
-    }
-
-    remove_macro(&token_node->token.lexeme);
-}
-
-void handle_defined(tk_node *token_node) {
-    // token_node should point to token before "defined" token
-
-    tk_node *before_defined = token_node;
-    bool remove_right_parenthesis = false;
-
-    token_node = token_node->next->next;
-
-    if (token_node->token.subtype == PUN_LEFT_PARENTHESIS) {
-        token_node = token_node->next;
-        before_defined->next->next = token_node;
-        remove_right_parenthesis = true;
-    }
-
-    if (macro_exists(token_node)) {
-        token_node->token.lexeme = one_string;
-    }
-    else {
-        token_node->token.lexeme = zero_string;
-    }
-
-    token_node->token.type = CONSTANT;
-    token_node->token.subtype = CONST_INTEGER;
-
-    before_defined->next = token_node;
-
-    if (remove_right_parenthesis && token_node->next->token.subtype == PUN_RIGHT_PARENTHESIS) {
-        token_node->next = token_node->next->next;
-    }
-}
-
-bool evaluate_if(tk_node *token_node) {
-    // token_node should point to #if token
-    tk_node *before_token_ptr = token_node;
-
-    token RPN_tokens[64];
-    token *RPN_pointer = RPN_tokens;
-
-    token op_stack[64];
-    token *op_stack_pointer = op_stack;
-
-    int number_stack[64];
-    int *number_stack_pointer = number_stack;
-
-    token_node = token_node->next;
-
-    // Shunting Yard Algorithm
-    while (token_node->token.type != NEWLINE) {
-        if (token_node->token.type == IDENTIFIER) {
-            if (string_cmp(&token_node->token.lexeme, &defined_string) == 0) {
-                handle_defined(before_token_ptr);
-            }
-            else {
-                token_node->token.type = CONSTANT;
-                token_node->token.subtype = CONST_INTEGER;
-                token_node->token.lexeme = zero_string;
-
-                *RPN_pointer++ = token_node->token;
-            }
-        }
-        else if (token_node->token.subtype >= CONST_INTEGER &&
-                 token_node->token.subtype <= CONST_WIDE_CHAR) {
-            *RPN_pointer++ = token_node->token;
-        }
-        else if (token_node->token.subtype == PUN_LEFT_PARENTHESIS) {
-            *op_stack_pointer++ = token_node->token;
-        }
-        else if (token_node->token.subtype == PUN_RIGHT_PARENTHESIS) {
-            while (op_stack_pointer != op_stack && op_stack_pointer[-1].subtype != PUN_LEFT_PARENTHESIS) {
-                *RPN_pointer++ = *--op_stack_pointer;
-            }
-            op_stack_pointer--; // Discard the left parenthesis
-        }
-        // For the ternary operator, the '?' is kept, it's treated like a normal operator
-        else if (token_node->token.subtype == PUN_COLON) {
-            while (op_stack_pointer != op_stack && op_stack_pointer[-1].subtype != PUN_QUESTION_MARK) {
-                *RPN_pointer++ = *--op_stack_pointer;
-            }
-        }
-        else if (token_node->token.type == BLANK) {
-            // Ignore any blank tokens
-        }
-        else if (token_node->token.type != PUNCTUATOR) {
-            error(&token_node->token.src_filepath, token_node->token.line, "Expected punctuator");
-            return false;
-        }
-        else {
-            while (op_stack_pointer != op_stack &&
-                   operator_precedence[token_node->token.subtype]
-                   <= operator_precedence[op_stack_pointer[-1].subtype]) {
-                *RPN_pointer++ = *--op_stack_pointer;
-            }
-            *op_stack_pointer++ = token_node->token;
-        }
-        before_token_ptr = token_node;
-        token_node = token_node->next;
-    }
-
-    while (op_stack_pointer != op_stack) {
-        *RPN_pointer++ = *--op_stack_pointer;
-    }
-
-    for (token *ptr = RPN_tokens; ptr < RPN_pointer; ptr++) {
-        if (ptr->subtype >= CONST_INTEGER && ptr->subtype <= CONST_UNSIGNED_LONG_LONG) {
-            *number_stack_pointer++ = atoi(ptr->lexeme.data); // TODO: Implement this conversion
-        }
-        else if (ptr->subtype == CONST_CHAR || ptr->subtype == CONST_WIDE_CHAR) {
-            *number_stack_pointer++ = ptr->lexeme.data[0]; // TODO: Might need to handle wide char differently
-        }
-        else if (ptr->type == PUNCTUATOR) {
-            int r_operand = *--number_stack_pointer;
-            int m_operand = 0; // Only used for ternary operator (a ? b : c)
-            int l_operand = 0;
-            if (ptr->subtype == PUN_QUESTION_MARK) m_operand = *--number_stack_pointer;
-            if (ptr->subtype != PUN_EXCLAMATION_MARK) l_operand = *--number_stack_pointer;
-
-            switch (ptr->subtype) {
-                case PUN_PLUS: *number_stack_pointer++ = l_operand + r_operand; break;
-                case PUN_MINUS: *number_stack_pointer++ = l_operand - r_operand; break;
-                case PUN_ASTERISK: *number_stack_pointer++ = l_operand * r_operand; break;
-                case PUN_FWD_SLASH: *number_stack_pointer++ = l_operand / r_operand; break;
-                case PUN_LOGICAL_AND: *number_stack_pointer++ = l_operand && r_operand; break;
-                case PUN_LOGICAL_OR: *number_stack_pointer++ = l_operand || r_operand; break;
-                case PUN_GREATER_THAN: *number_stack_pointer++ = l_operand > r_operand; break;
-                case PUN_GREATER_THAN_EQUAL: *number_stack_pointer++ = l_operand >= r_operand; break;
-                case PUN_LESS_THAN: *number_stack_pointer++ = l_operand < r_operand; break;
-                case PUN_LESS_THAN_EQUAL: *number_stack_pointer++ = l_operand <= r_operand; break;
-                case PUN_EQUALITY: *number_stack_pointer++ = l_operand == r_operand; break;
-                case PUN_INEQUALITY: *number_stack_pointer++ = l_operand != r_operand; break;
-                case PUN_EXCLAMATION_MARK: *number_stack_pointer++ = !r_operand; break;
-                case PUN_QUESTION_MARK: *number_stack_pointer++ = l_operand ? m_operand : r_operand; break;
-                default: error(&ptr->src_filepath, ptr->line, "#if: Unknown operator"); return false;
-            }
-        }
-    }
-
-    return number_stack[0];
-}
-
-void handle_if_directives(tk_node *token_node, enum subtype if_type) {
-    tk_node *if_directive = token_node;
-    short current_if_level = 0;
-    bool cond;
-    bool if_cond;
-    bool any_cond_true = false;
-
-    if (if_type == DIRECTIVE_IFDEF || if_type == DIRECTIVE_IFNDEF) {
-        tk_node *new_list_entry = allocate_from_arena(token_arena, sizeof(tk_node));
-
-        new_list_entry->token = (token) {.type = IDENTIFIER, .line = token_node->token.line};
-        new_list_entry->token.lexeme = defined_string;
-
-        new_list_entry->token.src_filepath = token_node->token.src_filepath;
-        new_list_entry->token.filename_index = token_node->token.filename_index;
-
-        new_list_entry->next = token_node->next;
-        token_node->next = new_list_entry;
-
-        // Feels like the wrong way round (it's not)
-        if (if_type == DIRECTIVE_IFNDEF) {
-            new_list_entry = allocate_from_arena(token_arena, sizeof(tk_node));
-
-            new_list_entry->token = (token) {.type = PUNCTUATOR, .subtype = PUN_EXCLAMATION_MARK,
-                                             .line = token_node->token.line};
-
-            new_list_entry->token.lexeme = exclamation_string;
-
-            new_list_entry->token.src_filepath = token_node->token.src_filepath;
-            new_list_entry->token.filename_index = token_node->token.filename_index;
-
-            new_list_entry->next = token_node->next;
-            token_node->next = new_list_entry;
-        }
-    }
-
-    cond = evaluate_if(token_node);
-
-
-    if_cond = cond;
-    any_cond_true |= cond;
-
-    while (token_node->token.subtype != DIRECTIVE_ENDIF) {
-        // Move to the end of the directive
-        while (token_node->token.type != NEWLINE) {
-            token_node = advance_list(token_node, 1);
-        }
-
-        tk_node *before_remove = token_node;
-
-        token_node = advance_list(token_node, 1);
-
-        tk_node *remove_start = token_node;
-
-        if (if_directive->token.subtype == DIRECTIVE_ELIF) {
-
-            // Basically a copy
-            tk_node *ptr = if_directive;
-            while (ptr->next->token.type != NEWLINE) {
-                if (string_cmp(&ptr->token.lexeme, &defined_string) != 0 && macro_exists(ptr->next)) {
-                    tk_list_segment expanded_macro_segment = expand_macro(ptr->next);
-
-                    // Move to the end of the expanded macro
-                    ptr = advance_list(ptr, expanded_macro_segment.len);
-                } else {
-                    ptr = advance_list(ptr, 1);
-                }
-            }
-
-            // Only want the elif condition to be true if
-            // the original condition and the previous condition was false
-            cond = !if_cond && !cond && evaluate_if(if_directive);
-            any_cond_true |= cond;
-        }
-
-        while (current_if_level > 0 || (token_node->token.subtype != DIRECTIVE_ELIF &&
-                                        token_node->token.subtype != DIRECTIVE_ELSE &&
-                                        token_node->token.subtype != DIRECTIVE_ENDIF)) {
-
-            if (token_node->token.subtype == DIRECTIVE_IF) current_if_level++;
-            if (token_node->token.subtype == DIRECTIVE_IFDEF) current_if_level++;
-            if (token_node->token.subtype == DIRECTIVE_IFNDEF) current_if_level++;
-            if (token_node->token.subtype == DIRECTIVE_ENDIF) current_if_level--;
-            token_node = token_node->next;
-        }
-
-        tk_node *remove_end = token_node;
-
-        if (!cond && (if_directive->token.subtype == DIRECTIVE_IF || if_directive->token.subtype == DIRECTIVE_ELIF ||
-                      if_directive->token.subtype == DIRECTIVE_IFDEF || if_directive->token.subtype == DIRECTIVE_IFNDEF)) {
-            remove_from_list(before_remove, remove_start, remove_end);
-        }
-
-        if (any_cond_true && if_directive->token.subtype == DIRECTIVE_ELSE) {
-            remove_from_list(before_remove, remove_start, remove_end);
-        }
-
-        if (token_node->token.subtype != DIRECTIVE_ENDIF) {
-            if_directive = token_node;
-            token_node = token_node->next;
-        }
-    }
-}
-
-short find_parameter_index(const string *parameter_name, const macro *replacement_macro) {
-    for (short param_num = 0; param_num < replacement_macro->num_params; param_num++) {
-        if (string_cmp(parameter_name, &replacement_macro->parameters[param_num]) == 0) {
-            return param_num;
-        }
-    }
-
-    error(current_src_file, current_line, "Parameter not found");
-    return -1;
-}
-
-tk_list_segment substitute_argument(tk_node *arg_tk_ptr, const macro *replacement_macro, token arguments[8][32]) {
-    tk_list_segment arg_sub_segment = {NULL, NULL, 0};
-    tk_node *seg_ptr = NULL;
-
-    const int token_line = arg_tk_ptr->token.line;
-    short param_index = -1;
-
-    string token_source_file = create_heap_string(arg_tk_ptr->token.src_filepath.len + 1, token_arena);
-
-    uint16_t token_filename_index;
-
-    string_copy(&token_source_file, &arg_tk_ptr->token.src_filepath);
-    token_filename_index = arg_tk_ptr->token.filename_index;
-
-    param_index = find_parameter_index(&arg_tk_ptr->token.lexeme, replacement_macro);
-
-    // Parameter not found
-    if (param_index == -1) {
-        return arg_sub_segment;
-    }
-
-    arg_tk_ptr->token = arguments[param_index][0];
-    arg_tk_ptr->token.line = token_line;
-
-    arg_tk_ptr->token.src_filepath = token_source_file;
-    arg_tk_ptr->token.filename_index = token_filename_index;
-
-    // While still more argument tokens, add them to the token list
-
-    tk_node *new_entry;
-    for (token *arg_token_ptr = &arguments[param_index][1]; arg_token_ptr->line != 0; arg_token_ptr++) {
-        if (arg_sub_segment.start == NULL) {
-            arg_sub_segment.start = allocate_from_arena(token_arena, sizeof(tk_node));
-            new_entry = seg_ptr = arg_sub_segment.start;
-        } else {
-            new_entry = allocate_from_arena(token_arena, sizeof(tk_node));
-        }
-
-        arg_sub_segment.len++;
-
-        new_entry->token = *arg_token_ptr;
-        new_entry->token.line = token_line;
-
-        new_entry->token.src_filepath = token_source_file;
-        new_entry->token.filename_index = arg_tk_ptr->token.filename_index;
-
-        if (seg_ptr != new_entry) {
-            new_entry->next = seg_ptr->next;
-            seg_ptr->next = new_entry;
-            seg_ptr = new_entry;
-        }
-    }
-
-    arg_sub_segment.end = seg_ptr;
-    return arg_sub_segment;
-}
-
-tk_node *consume_argument(tk_node *token_node, token *argument_tokens) {
-    // Idea is once here, the tokens from token_node should be in the form:
-    // ARG0, ARG1, ARG2 )
-
-    size_t parenthesis_level = 0;
-    size_t argument_counter = 0;
-
-    if (token_node->token.subtype == PUN_COMMA ||
-        token_node->token.subtype == PUN_RIGHT_PARENTHESIS) { // Empty argument
-        *argument_tokens = (token) {.type = BLANK, .lexeme = {0}, .line = token_node->token.line,
-                                    .filename_index = token_node->token.filename_index};
-
-        argument_tokens->src_filepath = token_node->token.src_filepath;
-
-        return token_node;
-    }
-
-    while (parenthesis_level > 0 || (token_node->token.subtype != PUN_COMMA &&
-                                     token_node->token.subtype != PUN_RIGHT_PARENTHESIS)) {
-
-        if (token_node->token.subtype == PUN_LEFT_PARENTHESIS) parenthesis_level++;
-        if (token_node->token.subtype == PUN_RIGHT_PARENTHESIS) parenthesis_level--;
-
-        *argument_tokens++ = token_node->token;
-        argument_counter++;
-
-        token_node = advance_list(token_node, 1);
-    }
-
-    // Ignore whitespace before the first argument token.
-    // Used for stringification
-    (argument_tokens-argument_counter)->follows_whitespace = false;
-
-    return token_node;
-}
-
-// stringify_argument will find the correct parameter, combine the lexemes of all tokens
-// in the argument, taking into account the whitespace between them.
-token stringify_argument(const string *parameter_name, const macro *replacement_macro, token arguments[8][32]) {
-    token stringified_token = {.type = STRING_LITERAL, .lexeme = {0}, .line = current_line};
-    short param_index = -1;
-    uint32_t required_lexeme_length = 0;
-
-    param_index = find_parameter_index(parameter_name, replacement_macro);
-
-    // Parameter not found
-    if (param_index == -1) {
-        return (token) {0};
-    }
-
-    // Calculate how much space is needed for the stringified token's lexeme
-    for (token *argument_ptr = arguments[param_index]; argument_ptr->line != 0; argument_ptr++) {
-        required_lexeme_length += argument_ptr->lexeme.len;
-        required_lexeme_length += (argument_ptr->follows_whitespace);
-    }
-
-    // Remove length for whitespace before the first token
-    required_lexeme_length -= (arguments[param_index])->follows_whitespace;
-
-    if (required_lexeme_length > UINT16_MAX) {
-        error(current_src_file, current_line, "Failed to stringify argument: Required length > UINT16_MAX");
-        return (token) {0};
-    }
-
-    stringified_token.lexeme = create_heap_string((uint16_t) required_lexeme_length + 1, token_arena);
-
-    for (token *argument_ptr = arguments[param_index]; argument_ptr->line != 0; argument_ptr++) {
-        string_cat(&stringified_token.lexeme, &argument_ptr->lexeme);
-
-        // Ignore any whitespace before the argument's first token
-        if ((argument_ptr+1)->line != 0 && argument_ptr->follows_whitespace) {
-            string_cat_c(&stringified_token.lexeme, ' ');
-        }
-    }
-
-    return stringified_token;
-}
-
-tk_list_segment expand_macro(tk_node *token_node) {
-    const macro *replacement_macro = NULL;
-    token arguments[8][32] = {0};
-
-    tk_list_segment macro_expanded_segment = {NULL, NULL, 0};
-    tk_node *end_entry = token_node->next;
-
-    replacement_macro = macro_exists(token_node);
-    assert(replacement_macro != NULL);
-
-    if (replacement_macro->is_function_like) {
-        tk_node *arg_ptr = advance_list(token_node, 2); // Set to after the opening parenthesis
-
-        for (short arg_num = 0; arg_num < replacement_macro->num_params; arg_num++) {
-            arg_ptr = consume_argument(arg_ptr, arguments[arg_num]);
-            arg_ptr = advance_list(arg_ptr, 1); // Move past the comma or closing parenthesis
-        }
-
-        // If no parameters, still need to move past the closing parenthesis
-        if (replacement_macro->num_params == 0) {
-            arg_ptr = advance_list(arg_ptr, 1);
-        }
-
-        remove_from_list(token_node, advance_list(token_node, 1), arg_ptr);
-        end_entry = arg_ptr;
-    }
-
-    const token *replacement_tk_ptr = replacement_macro->replacement;
-
-    tk_node *new_entry = NULL;
-
-    while (replacement_tk_ptr->line != 0) {
-        if (macro_expanded_segment.start == NULL) {
-            macro_expanded_segment.start = token_node;
-            new_entry = macro_expanded_segment.start;
-            *new_entry = (tk_node) {.next = new_entry->next};
-        } else if (new_entry->token.line != 0) { // If new_entry is "something", reuse it as it isn't included
-            new_entry->next = allocate_from_arena(token_arena, sizeof(tk_node));
-            *new_entry->next = (tk_node) {0};
-
-            new_entry = advance_list(new_entry, 1);
-        }
-
-        macro_expanded_segment.len++;
-
-        new_entry->token = *replacement_tk_ptr++;
-        new_entry->token.irreplaceable = (string_cmp(&new_entry->token.lexeme, &replacement_macro->name) == 0);
-        new_entry->token.line = token_node->token.line;
-        new_entry->token.filename_index = token_node->token.filename_index;
-        new_entry->token.src_filepath = token_node->token.src_filepath;
-
-
-        // Stringification #
-        // -----------------
-        if (new_entry->token.subtype == PUN_HASH) {
-            const token * parameter_token = replacement_tk_ptr++;
-
-            if (parameter_token->type != ARGUMENT) {
-                error(&token_node->token.src_filepath, token_node->token.line, "# not followed by parameter");
-                return (tk_list_segment) {0};
-            }
-
-            new_entry->token = stringify_argument(&parameter_token->lexeme, replacement_macro, arguments);
-        }
-        // -----------------
-
-        // Argument substitution
-        // ---------------------
-        tk_list_segment arg_sub_segment = {NULL, NULL, 0};
-        tk_node *first_arg_sub = NULL;
-        if (new_entry->token.type == ARGUMENT) {
-            arg_sub_segment = substitute_argument(new_entry, replacement_macro, arguments);
-            first_arg_sub = new_entry;
-
-            if (arg_sub_segment.len > 0) {
-                arg_sub_segment.end->next = new_entry->next;
-                new_entry->next = arg_sub_segment.start;
-
-                new_entry = arg_sub_segment.end;
-
-                macro_expanded_segment.len += arg_sub_segment.len;
-            }
-        }
-        // ---------------------
-
-        // Token concatination ##
-        // ----------------------
-        if (new_entry->token.subtype == PUN_DOUBLE_HASH) {
-            // If the ## is the first replacement token
-            error(&token_node->token.src_filepath, token_node->token.line, "Found ## at start of replacement list");
-            return (tk_list_segment) {0};
-        }
-
-        bool concatenated = false;
-
-        // Checks if the next replacement token is a ##
-        // no +1 since the ptr is already incremented
-        while (replacement_tk_ptr->subtype == PUN_DOUBLE_HASH) {
-            // If the ## is the last replacement token (i.e. the next token is invalid), throw an error
-            if ((replacement_tk_ptr+1)->line == 0) {
-                error(&token_node->token.src_filepath, token_node->token.line, "Found ## at end of replacement list");
-                return (tk_list_segment) {0};
-            }
-
-            concatenated = true;
-
-            // new_entry contains the token to the left of the ##
-
-            // concat_tk_list contains the token to concatenate as well as any
-            // argument tokens if the token to the right of the ## is an argument
-            tk_node concat_tk_list = {*(replacement_tk_ptr+1), NULL};
-
-            if (concat_tk_list.token.type == ARGUMENT) {
-                tk_list_segment arg_sub_segment = substitute_argument(&concat_tk_list, replacement_macro, arguments);
-
-                if (arg_sub_segment.len > 0) {
-                    arg_sub_segment.end->next = new_entry->next;
-                    new_entry->next = arg_sub_segment.start;
-
-                    new_entry = arg_sub_segment.end;
-                }
-            }
-
-            // If tokens are not the same type, set the type to an identifier
-            if (new_entry->token.type != concat_tk_list.token.type || new_entry->token.subtype != concat_tk_list.token.subtype) {
-                new_entry->token.type = IDENTIFIER;
-            }
-
-            uint32_t concat_length = new_entry->token.lexeme.len + concat_tk_list.token.lexeme.len;
-
-            if (concat_length >= UINT16_MAX) {
-                error(current_src_file, current_line, "Failed to concat tokens: Required length > UINT16_MAX");
-            }
-            else if (concat_tk_list.token.type != BLANK) {
-                string concat_string = create_heap_string((uint16_t) concat_length + 1, token_arena);
-
-                string_copy(&concat_string, &new_entry->token.lexeme);
-                string_cat(&concat_string, &concat_tk_list.token.lexeme);
-
-                new_entry->token.lexeme = concat_string;
-            }
-
-            replacement_tk_ptr += 2; // Skip the ## token and the token to the right of it
-        }
-        // ----------------------
-
-        // Expand substituted tokens
-        // -------------------------
-        if (first_arg_sub != NULL) {
-            for (tk_node *ptr = first_arg_sub; ptr != end_entry && ptr != NULL; ptr = advance_list(ptr, 1)) {
-                if (ptr->token.type == BLANK || (ptr == first_arg_sub && concatenated)) continue;
-
-                const macro *potential_macro = macro_exists(ptr);
-
-                if (potential_macro && !ptr->token.irreplaceable) {
-                    // Expand any remaining argument tokens
-                    tk_list_segment arg_macro_segment = expand_macro(ptr);
-
-                    // If function-like, need to re-evaluate length,
-                    // as argument tokens will have been removed
-                    if (potential_macro->is_function_like) {
-                        size_t old_len = arg_sub_segment.len;
-                        tk_node *len_ptr = first_arg_sub->next;
-
-                        arg_sub_segment.start = first_arg_sub->next;
-                        arg_sub_segment.len = 0;
-
-                        // Only need to loop through if the new length is > 0
-                        if (len_ptr != NULL && len_ptr != end_entry) {
-                            for (;len_ptr->next != NULL; len_ptr = advance_list(len_ptr, 1)) {
-                                arg_sub_segment.len++;
-                            }
-
-                            arg_sub_segment.len++;
-                            arg_sub_segment.end = len_ptr;
-                        } else {
-                            arg_sub_segment.end = arg_sub_segment.start;
-                        }
-
-                        if (arg_sub_segment.len > 0) {
-                            // Sanity check that arg_sub_segment.len is correct
-                            assert(advance_list(arg_sub_segment.start, arg_sub_segment.len - 1) == arg_sub_segment.end);
-                            assert(advance_list(arg_sub_segment.end, 1) == NULL);
-                        }
-
-                        macro_expanded_segment.len -= (old_len - arg_sub_segment.len);
-                    }
-                    else if (arg_macro_segment.len > 0) {
-                        macro_expanded_segment.len += arg_macro_segment.len - 1;
-                        arg_sub_segment.len += arg_macro_segment.len - 1;
-                    }
-                    else {
-                        ptr->token.type = BLANK;
-                        ptr->token.lexeme = (string) {0};
-                    }
-                }
-            }
-
-            new_entry = advance_list(first_arg_sub, arg_sub_segment.len);
-
-            // Sanity check that new_entry is at the end of the list
-            assert(new_entry != NULL);
-            assert(new_entry->next == NULL || new_entry->next == end_entry);
-        }
-        // -------------------------
-    }
-
-    if (macro_expanded_segment.start == NULL) {
-        macro_expanded_segment.start = token_node;
-        macro_expanded_segment.start->token.type = BLANK;
-        macro_expanded_segment.start->token.lexeme = (string) {0};
-    } else {
-        new_entry->next = end_entry;
-    }
-
-    // Rescan and expansion
-    // --------------------
-    for (tk_node * sub_tk_ptr = macro_expanded_segment.start; sub_tk_ptr != NULL && sub_tk_ptr != end_entry;
-         sub_tk_ptr = advance_list(sub_tk_ptr, 1)) {
-
-        const macro *potential_macro = macro_exists(sub_tk_ptr);
-        if (potential_macro != NULL && !sub_tk_ptr->token.irreplaceable) {
-            expand_macro(sub_tk_ptr);
-
-            // If function-like, need to re-evaluate length,
-            // as argument tokens will have been removed
-            if (potential_macro->is_function_like) {
-                macro_expanded_segment.len = 0;
-                for (tk_node *len_ptr = macro_expanded_segment.start; len_ptr != NULL && len_ptr != end_entry;
-                     len_ptr = advance_list(len_ptr, 1)) {
-                        macro_expanded_segment.len++;
-                }
-            }
-        }
-    }
-    // --------------------
-
-    // Only set the segment end if the segment isn't empty.
-    // If the segment is empty, the end will remain NULL,
-    // otherwise set the end to "start + length - 1"
-    if (macro_expanded_segment.len > 0) {
-        macro_expanded_segment.end = advance_list(macro_expanded_segment.start, macro_expanded_segment.len - 1);
-    }
-    return macro_expanded_segment;
-}
-
-void process_preprocessing_tokens(tk_node *token_node) {
-    tk_node* ptr = token_node;
-    tk_node* before_directive = NULL;
-
-    macro_arena = create_arena(MEMORY_ARENA_MAX_SIZE);
-    macro_hash_table = ht_alloc(MAX_NUM_MACROS, ht_compare_strcmp, macro_arena);
-
-    while(ptr->next != NULL) {
-        current_src_file = &ptr->token.src_filepath;
-        current_line = ptr->token.line;
-
-         if (ptr->token.type != DIRECTIVE) {
-            before_directive = ptr;
-
-            if (macro_exists(ptr->next)) {
-                tk_list_segment expanded_macro_segment = expand_macro(ptr->next);
-
-                // Move to end of expanded macro
-                ptr = advance_list(ptr, expanded_macro_segment.len);
-            } else {
-                ptr = advance_list(ptr, 1);
-            }
-            continue;
-        }
-
-        tk_node *directive = ptr;
-
-        // Expand any macros within the directive
-        while (ptr->next->token.type != NEWLINE) {
-
-            // Skip expansion for `defined` operator
-            if (string_cmp(&ptr->token.lexeme, &defined_string) == 0) {
-
-                // If a ( is found, make sure there's a matching )
-                if (ptr->next->token.subtype == PUN_LEFT_PARENTHESIS) {
-                    ptr = advance_list(ptr, 3);
-
-                    if (ptr->token.subtype != PUN_RIGHT_PARENTHESIS) {
-                        error(&ptr->token.src_filepath, ptr->token.line, "Expected ) after defined");
-                    }
-
-                    continue;
-                }
-
-                ptr = advance_list(ptr, 1);
-                continue;
-            }
-
-            if (macro_exists(ptr->next) &&
-                directive->token.subtype != DIRECTIVE_UNDEF && directive->token.subtype != DIRECTIVE_DEFINE &&
-                directive->token.subtype != DIRECTIVE_IFDEF && directive->token.subtype != DIRECTIVE_IFNDEF) {
-                tk_list_segment expanded_macro_segment = expand_macro(ptr->next);
-
-                // Move to the end of the expanded macro
-                ptr = advance_list(ptr, expanded_macro_segment.len);
-            } else {
-                ptr = advance_list(ptr, 1);
-            }
-        }
-
-        ptr = directive;
-
-        switch (directive->token.subtype) {
-            case DIRECTIVE_DEFINE:
-                handle_define_directive(directive->next);
-                break;
-            case DIRECTIVE_UNDEF:
-                handle_undef_directive(directive->next);
-                break;
-            case DIRECTIVE_IFDEF:
-                handle_if_directives(directive, directive->token.subtype);
-                break;
-            case DIRECTIVE_IFNDEF:
-                handle_if_directives(directive, directive->token.subtype);
-            break;
-            case DIRECTIVE_IF:
-                handle_if_directives(directive, directive->token.subtype);
-                break;
-            case DIRECTIVE_INCLUDE:
-                handle_include_directive(directive);
-                break;
-            case DIRECTIVE_PRAGMA:
-                // Leave in Pragma directives for now
-                while (ptr->next->token.type != NEWLINE) {
-                    ptr = advance_list(ptr, 1);
-                }
-                continue;
-            default: break;
-        }
-
-        // Go to end of directive line
-        while (ptr->next->token.type != NEWLINE) {
-            ptr = advance_list(ptr, 1);
-        }
-
-        // Remove the directive
-        remove_from_list(before_directive, directive, ptr->next->next);
-        ptr = before_directive;
-    }
-
-    delete_arena(macro_arena);
-}
+#include "enums.h"
+#include "common.h"
+#include "preprocessor.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "file_table.h"
+#include "memory.h"
+#include "hash_table.h"
+#include "header_cache.h"
+#include "helper_functions.h"
+#include "if_expression.h"
+#include "include_paths.h"
+#include "include_timing.h"
+#include "pch.h"
+#include "strings.h"
+
+// Holds the macro table, the macros and their parameter and replacement lists,
+// it grows by another block of this size whenever it fills up
+#define MACRO_ARENA_BLOCK_SIZE ((sizeof(ht) + sizeof(ht_entry) * MAX_NUM_MACROS) + (1 << 20))
+
+THREAD_LOCAL bool in_define = 0;
+THREAD_LOCAL bool in_include = 0;
+
+THREAD_LOCAL ht *macro_hash_table;
+THREAD_LOCAL size_t num_macros = 0;
+THREAD_LOCAL size_t max_macros = 0;
+
+THREAD_LOCAL memory_arena *macro_arena;
+
+// Some commonly used strings
+static string defined_string = create_const_string("defined");
+static string exclamation_string = create_const_string("!");
+static string once_string = create_const_string("once");
+static string va_args_string = create_const_string("__VA_ARGS__");
+
+const char predefined_macros[] = {
+    "#define __x86_64__ 1\n"
+    "#define __LP64__ 1\n"
+};
+
+static THREAD_LOCAL atom defined_atom;
+static THREAD_LOCAL atom once_atom;
+static THREAD_LOCAL atom va_args_atom;
+
+// Counts translation units, so headers know whether they've been included in this one
+static THREAD_LOCAL uint32_t translation_unit = 0;
+
+THREAD_LOCAL source_loc current_loc;
+
+// Set until the translation unit has defined, undefined or included anything itself, while its macro
+// table is still the one every translation unit starts with. The predefined macros come from the
+// first file of the translation unit, and a precompiled header is only used while this is set
+static THREAD_LOCAL bool pch_prefix_intact = false;
+static THREAD_LOCAL uint16_t prefix_file_id;
+
+// Set while the macros on a directive's line are expanded, an invocation can't continue past the line
+static THREAD_LOCAL bool expanding_directive = false;
+
+// Where the tokens go once they're preprocessed when only preprocessing, NULL if they're all kept
+static THREAD_LOCAL token_writer *output;
+
+#define INITIAL_CONDITIONALS 64
+
+// One for each #if, #ifdef or #ifndef the preprocessor is in, innermost last.
+// Set once one of its groups has been taken, so the rest are skipped
+static THREAD_LOCAL bool *conditionals;
+static THREAD_LOCAL uint32_t num_conditionals = 0;
+static THREAD_LOCAL uint32_t max_conditionals = 0;
+
+#define INITIAL_ARGUMENT_TOKENS 1024
+
+// Tokens of the arguments of the macro invocations being expanded, each argument ends with a
+// token with no location. Expansions nest, so these are used as stacks, with each expansion
+// popping the arguments it pushed once it's done
+static THREAD_LOCAL token *argument_tokens;
+static THREAD_LOCAL uint32_t num_argument_tokens = 0;
+static THREAD_LOCAL uint32_t max_argument_tokens = 0;
+
+static THREAD_LOCAL uint32_t *argument_starts; // Index of each argument's first token
+static THREAD_LOCAL uint32_t num_argument_starts = 0;
+static THREAD_LOCAL uint32_t max_argument_starts = 0;
+
+#define INITIAL_MACRO_NAMES 4096
+
+// The full expansion of an object-like macro, so later uses of it are just a copy. It's out of date
+// once any name that was looked up while expanding it has been defined or undefined since
+typedef struct {
+    token *tokens;
+    uint32_t len;
+    bool rescan_last; // The last token is a function-like macro's name, which can take arguments after the use
+    bool complete; // False if an invocation in it took arguments from after the use, so it can't be reused
+
+    atom *dependencies;
+    uint32_t num_dependencies;
+    uint32_t generation; // macro_generation when it was expanded
+} cached_expansion;
+
+// Indexed by atom, reset for each translation unit
+typedef struct {
+    uint32_t changed_at; // macro_generation when the name was last defined or undefined
+    cached_expansion *expansion; // Allocated from the macro arena, NULL until the name's macro is used
+} macro_name_info;
+
+static THREAD_LOCAL macro_name_info *macro_names;
+static THREAD_LOCAL uint32_t max_macro_names = 0;
+
+// Counts every #define and #undef
+static THREAD_LOCAL uint32_t macro_generation = 0;
+
+// Names looked up while an expansion is being cached
+static THREAD_LOCAL atom *dependencies;
+static THREAD_LOCAL uint32_t num_dependencies = 0;
+static THREAD_LOCAL uint32_t max_dependencies = 0;
+static THREAD_LOCAL bool recording_dependencies = false;
+static THREAD_LOCAL bool expansion_incomplete = false;
+
+// The macro table is keyed by interned names, so the hash computed when the name was
+// interned by the lexer is reused rather than hashing the name again on every lookup
+static const macro *find_macro(atom name) {
+    return ht_get_with_hash(macro_hash_table, atom_to_string(name), atom_hash(name));
+}
+
+bool macros_equal(const macro *macro_one, const macro *macro_two) {
+    bool macros_equal = true;
+
+    macros_equal &= (macro_one->name == macro_two->name);
+    macros_equal &= (macro_one->is_function_like == macro_two->is_function_like);
+    macros_equal &= (macro_one->is_variadic == macro_two->is_variadic);
+    macros_equal &= (macro_one->replacement_len == macro_two->replacement_len);
+
+    for (uint32_t i = 0; macros_equal && i < macro_one->replacement_len; i++) {
+        macros_equal &= (string_cmp(&macro_one->replacement[i].lexeme, &macro_two->replacement[i].lexeme) == 0);
+        macros_equal &= (macro_one->replacement[i].type == macro_two->replacement[i].type);
+        macros_equal &= (macro_one->replacement[i].subtype == macro_two->replacement[i].subtype);
+    }
+
+    macros_equal &= (macro_one->num_params == macro_two->num_params);
+
+    if (macros_equal && macro_one->is_function_like) {
+        for (short i = 0; i < macro_one->num_params; i++) {
+            macros_equal &= (macro_one->parameters[i] == macro_two->parameters[i]);
+        }
+    }
+
+    return macros_equal;
+}
+
+static macro_name_info *get_macro_name_info(atom name) {
+    if (name >= max_macro_names) {
+        uint32_t new_max = max_macro_names ? max_macro_names : INITIAL_MACRO_NAMES;
+
+        while (new_max <= name) new_max *= 2;
+
+        macro_names = realloc(macro_names, new_max * sizeof(macro_name_info));
+        memset(&macro_names[max_macro_names], 0, (new_max - max_macro_names) * sizeof(macro_name_info));
+        max_macro_names = new_max;
+    }
+
+    return &macro_names[name];
+}
+
+// Marks every cached expansion that looked up name as out of date
+static void macro_changed(atom name) {
+    macro_name_info *info = get_macro_name_info(name);
+
+    info->changed_at = ++macro_generation;
+    info->expansion = NULL;
+}
+
+void add_macro(const macro new_macro) {
+    const macro* ht_entry = find_macro(new_macro.name);
+
+    if (ht_entry != NULL) {
+        if (!macros_equal(&new_macro, ht_entry)) {
+            error(current_loc, "Duplicate macro");
+        }
+        return;
+    }
+
+    macro *new_entry = allocate_from_arena(macro_arena, sizeof(macro));
+    *new_entry = new_macro;
+
+    ht_add_with_hash(macro_hash_table, new_entry, atom_to_string(new_entry->name), atom_hash(new_entry->name));
+    macro_changed(new_entry->name);
+
+    if (num_macros > max_macros)
+    {
+        max_macros = num_macros;
+    }
+}
+
+void remove_macro(atom macro_name) {
+    ht_remove_with_hash(macro_hash_table, atom_to_string(macro_name), atom_hash(macro_name));
+    macro_changed(macro_name);
+}
+
+const macro *macro_exists(tk_node token_node) {
+    if (tk.type[token_node] != IDENTIFIER) {
+        return NULL;
+    }
+
+    return find_macro(tk.atom[token_node]);
+}
+
+// Looks for an #ifndef wrapping the whole of a file that's just been lexed,
+// first is the file's first token. Returns the macro it checks, or NO_ATOM
+atom find_include_guard(tk_node first) {
+    tk_node ptr = first;
+    short if_level = 1;
+
+    while (tk.type[ptr] == NEWLINE || tk.type[ptr] == BLANK) ptr = tk.next[ptr];
+
+    if (tk.subtype[ptr] != DIRECTIVE_IFNDEF || tk.type[tk.next[ptr]] != IDENTIFIER) {
+        return NO_ATOM;
+    }
+
+    const atom guard = tk.atom[tk.next[ptr]];
+
+    // Find the matching #endif, an #else or #elif means some of the file is outside the guard
+    for (ptr = tk.next[ptr]; if_level > 0; ptr = tk.next[ptr]) {
+        switch (tk.type[ptr] == DIRECTIVE ? tk.subtype[ptr] : DIRECTIVE_NULL) {
+            case DIRECTIVE_IF:
+            case DIRECTIVE_IFDEF:
+            case DIRECTIVE_IFNDEF: if_level++; break;
+            case DIRECTIVE_ENDIF: if_level--; break;
+            case DIRECTIVE_ELSE:
+            case DIRECTIVE_ELIF: if (if_level == 1) return NO_ATOM; break;
+            default: if (tk.type[ptr] == END) return NO_ATOM; break;
+        }
+    }
+
+    // Anything left on the #endif line is ignored, but nothing else may follow it
+    while (tk.type[ptr] != NEWLINE && tk.type[ptr] != END) ptr = tk.next[ptr];
+    while (tk.type[ptr] == NEWLINE || tk.type[ptr] == BLANK) ptr = tk.next[ptr];
+
+    return tk.type[ptr] == END ? guard : NO_ATOM;
+}
+
+bool included_in_translation_unit(const source_file *file) {
+    return file->last_included == translation_unit;
+}
+
+// A header included earlier can be skipped without being read again if it has #pragma once,
+// or if the macro its include guard checks is still defined
+bool can_skip_header(const source_file *header) {
+    if (header->pragma_once && header->last_included == translation_unit) {
+        return true;
+    }
+
+    return header->include_guard != NO_ATOM && find_macro(header->include_guard);
+}
+
+// Lexes the header at path and inserts its tokens after insert_point,
+// reusing the tokens from an earlier translation unit if it's been lexed before.
+// When insert_point ends the token list, a large header is left for lex_more_tokens
+// to read a batch at a time instead. Returns false if the header doesn't exist
+bool include_header(const string *header_path, tk_node insert_point) {
+    const int32_t known_file_id = find_source_file(header_path);
+    uint16_t file_id;
+
+    if (known_file_id != -1 && can_skip_header(get_source_file((uint16_t) known_file_id))) {
+        debugf("Skipping: %.*s\n", header_path->len, header_path->data);
+        record_skipped_file((uint16_t) known_file_id);
+        return true;
+    }
+
+    begin_file_timing();
+
+    file_id = splice_cached_header(header_path, insert_point);
+
+    if (file_id != NO_FILE_ID) {
+        debugf("Including from cache: %.*s\n", header_path->len, header_path->data);
+    } else {
+        if (!add_file(header_path)) {
+            cancel_file_timing();
+            return false;
+        }
+
+        file_id = FILES_TOP.file_id;
+
+        // The lexer stops after an #include line when streaming, so the header's tokens are next.
+        // Its include guard is looked for as they're lexed
+        if (tk.next[insert_point] == TK_NONE && FILES_TOP.buffer.windowed) {
+            debugf("Including a batch at a time: %.*s\n", header_path->len, header_path->data);
+            end_file_lexing(file_id);
+            get_source_file(file_id)->last_included = translation_unit;
+
+            if (!get_source_file(file_id)->guard_checked) {
+                watch_include_guard(file_id);
+            }
+
+            return true;
+        }
+
+        debugf("Including: %.*s\n", header_path->len, header_path->data);
+        scan_and_insert_tokens(insert_point);
+
+        cache_header_tokens(file_id, tk.next[insert_point]);
+    }
+
+    end_file_lexing(file_id);
+
+    source_file *header = get_source_file(file_id);
+    header->last_included = translation_unit;
+
+    if (!header->guard_checked) {
+        header->include_guard = find_include_guard(tk.next[insert_point]);
+        header->guard_checked = true;
+    }
+
+    return true;
+}
+
+// A precompiled header stands in for the whole of the header it was built from. Its macro table
+// replaces this one, and its tokens are already preprocessed, so they aren't scanned again
+static tk_node include_precompiled_header(tk_node insert_point) {
+    uint32_t num_pch_macros;
+    const macro *pch_macro_table = pch_macros(&num_pch_macros);
+
+    for (size_t i = 0; i < macro_hash_table->capacity; i++) {
+        if (macro_hash_table->entries[i].status == OCCUPIED) {
+            remove_macro(((const macro *) macro_hash_table->entries[i].value)->name);
+        }
+    }
+
+    for (uint32_t i = 0; i < num_pch_macros; i++) {
+        add_macro(pch_macro_table[i]);
+    }
+
+    return splice_pch_tokens(insert_point, translation_unit);
+}
+
+// Returns the last of the header's tokens if they've already been preprocessed, otherwise TK_NONE
+tk_node handle_include_directive(tk_node token_node) {
+    // token_node points to the include token
+    token_node = tk.next[token_node];
+
+    const string header_name = tk.lexeme[token_node];
+
+    // The header's tokens go after the end of the directive
+    const tk_node insert_point = tk.next[token_node];
+
+    // Header names in quotes are looked for next to the including file first
+    const source_file *including_file = get_source_file(source_loc_file_id(tk.loc[token_node]));
+    const string including_dir = {.data = including_file->path.data, .len = including_file->dir_len,
+                                  .cap = including_file->path.cap};
+
+    const string *header_path = find_include(&header_name, tk.subtype[token_node] != HEADER_Q, &including_dir);
+
+    if (header_path != NULL && pch_prefix_intact && pch_covers(header_path)) {
+        debugf("Including precompiled: %.*s\n", header_path->len, header_path->data);
+        begin_file_timing();
+
+        const tk_node pch_end = include_precompiled_header(insert_point);
+        end_file_lexing(source_loc_file_id(tk.loc[pch_end]));
+
+        return pch_end;
+    }
+
+    if (header_path == NULL || !include_header(header_path, insert_point)) {
+        char error_msg[MAX_LEXEME_LENGTH + 64];
+        snprintf(error_msg, sizeof(error_msg), header_path != NULL && file_table_full() ?
+                 "Cannot include %.*s, the translation unit has too many files or too much source" : "Cannot find %.*s",
+                 header_name.len, header_name.data);
+
+        error(tk.loc[token_node], error_msg);
+    }
+
+    return TK_NONE;
+}
+
+// Macros and their cached expansions outlast the tokens they're made from, whose lexemes can be
+// in the token arena or the source, which are dropped a batch at a time when streaming the output.
+// Otherwise they last longer than the macro arena, as expansions are written out after it's gone
+static string macro_lexeme(const token *source) {
+    if (output == NULL) {
+        return source->lexeme;
+    }
+
+    if (source->type == IDENTIFIER && source->lexeme.len > 0) {
+        return *atom_to_string(source->atom);
+    }
+
+    string lexeme = create_heap_string(source->lexeme.len + 1, macro_arena);
+    string_copy(&lexeme, &source->lexeme);
+
+    return lexeme;
+}
+
+void handle_define_directive(tk_node token_node) {
+    macro new_macro = {0};
+
+    const tk_node identifier_node = token_node;
+
+    new_macro.defined_loc = tk.loc[identifier_node];
+
+    token_node = tk.next[token_node];
+
+    if (tk.type[identifier_node] != IDENTIFIER) {
+        error(tk.loc[identifier_node], "Expected identifier after #define");
+    }
+
+    new_macro.name = tk.atom[identifier_node];
+
+    // If the token is a left parenthesis, and if there was no whitespace before it, it's function-like
+    if (tk.subtype[token_node] == PUN_LEFT_PARENTHESIS &&
+        !(tk.flags[token_node] & TK_FOLLOWS_WHITESPACE)) {
+        token_node = tk.next[token_node];
+
+        new_macro.is_function_like = true;
+
+        // Every token up to the ) that isn't a comma is a parameter, or an error
+        short max_params = 0;
+
+        for (tk_node ptr = token_node; tk.subtype[ptr] != PUN_RIGHT_PARENTHESIS && tk.type[ptr] != NEWLINE;
+             ptr = tk.next[ptr]) {
+            if (tk.subtype[ptr] != PUN_COMMA) max_params++;
+        }
+
+        new_macro.parameters = allocate_from_arena(macro_arena, (size_t) max_params * sizeof(atom));
+
+        while (tk.subtype[token_node] != PUN_RIGHT_PARENTHESIS) {
+
+            if (tk.type[token_node] != IDENTIFIER && tk.subtype[token_node] != PUN_ELLIPSIS) {
+                error(tk.loc[token_node],
+                     "Expected identifier or ... in macro parameter list");
+                return;
+            }
+
+            if (tk.subtype[token_node] == PUN_ELLIPSIS &&
+                tk.subtype[tk.next[token_node]] != PUN_RIGHT_PARENTHESIS) {
+                error(tk.loc[token_node],
+                 "Expected ... to be the last argument");
+                return;
+            }
+
+            // The variable arguments are substituted for __VA_ARGS__
+            if (tk.subtype[token_node] == PUN_ELLIPSIS) {
+                new_macro.is_variadic = true;
+                new_macro.parameters[new_macro.num_params++] = va_args_atom;
+            } else {
+                new_macro.parameters[new_macro.num_params++] = tk.atom[token_node];
+            }
+
+            token_node = tk.next[token_node];
+
+            if (tk.subtype[token_node] == PUN_COMMA) {
+                token_node = tk.next[token_node];
+            }
+
+        }
+        token_node = tk.next[token_node];
+    }
+
+    // Build up the replacement list
+    for (tk_node ptr = token_node; tk.type[ptr] != NEWLINE; ptr = tk.next[ptr]) {
+        new_macro.replacement_len++;
+    }
+
+    new_macro.replacement = allocate_from_arena(macro_arena, (new_macro.replacement_len + 1) * sizeof(token));
+    new_macro.replacement[new_macro.replacement_len] = (token) {0};
+
+    token *replacement_ptr = new_macro.replacement;
+
+    while (tk.type[token_node] != NEWLINE) {
+        *replacement_ptr = get_token(token_node);
+        replacement_ptr->lexeme = macro_lexeme(replacement_ptr);
+
+        for (short i = 0; i < new_macro.num_params; i++) {
+            if (tk.type[token_node] == IDENTIFIER && tk.atom[token_node] == new_macro.parameters[i]) {
+                replacement_ptr->type = ARGUMENT;
+                replacement_ptr->value = (uint64_t) i; // Index of the parameter
+            }
+        }
+        replacement_ptr++;
+        token_node = tk.next[token_node];
+    }
+
+    add_macro(new_macro);
+}
+
+void handle_undef_directive(tk_node token_node) {
+    if (tk.type[token_node] != IDENTIFIER) {
+        error(tk.loc[token_node], "Expected identifier after #undef");
+        return;
+    }
+
+    remove_macro(tk.atom[token_node]);
+}
+
+// Expands the macros on a directive's line, apart from the operands of defined
+static void expand_directive_line(tk_node directive) {
+    tk_node ptr = directive;
+
+    expanding_directive = true;
+
+    while (tk.type[tk.next[ptr]] != NEWLINE) {
+
+        // Skip expansion for the operand of `defined`, with or without parentheses
+        if (tk.atom[ptr] == defined_atom) {
+            if (tk.subtype[tk.next[ptr]] == PUN_LEFT_PARENTHESIS) ptr = tk.next[ptr];
+            if (tk.type[tk.next[ptr]] != NEWLINE) ptr = tk.next[ptr];
+            continue;
+        }
+
+        if (macro_exists(tk.next[ptr])) {
+            const tk_list_segment expanded_macro_segment = expand_macro(ptr);
+
+            // Move to the end of the expanded macro
+            if (expanded_macro_segment.len > 0) {
+                ptr = expanded_macro_segment.end;
+            }
+        } else {
+            ptr = tk.next[ptr];
+        }
+    }
+
+    expanding_directive = false;
+}
+
+// Evaluates the condition of an #if, #ifdef, #ifndef or #elif
+static bool evaluate_condition(tk_node directive, enum subtype if_type) {
+    if (if_type == DIRECTIVE_IFDEF || if_type == DIRECTIVE_IFNDEF) {
+        token defined_token = {.type = IDENTIFIER, .lexeme = defined_string, .atom = defined_atom,
+                               .loc = tk.loc[directive]};
+
+        insert_token_into_list(directive, defined_token);
+
+        // Feels like the wrong way round (it's not)
+        if (if_type == DIRECTIVE_IFNDEF) {
+            token not_token = {.type = PUNCTUATOR, .subtype = PUN_EXCLAMATION_MARK, .lexeme = exclamation_string,
+                               .loc = tk.loc[directive]};
+
+            insert_token_into_list(directive, not_token);
+        }
+    }
+
+    // An #elif is only expanded once it's known no earlier group was taken
+    if (if_type == DIRECTIVE_ELIF) {
+        expand_directive_line(directive);
+    }
+
+    return evaluate_if(directive);
+}
+
+// Works out if the group after a conditional directive is taken, keeping track of which conditionals the
+// preprocessor is in. Returns true if the group is to be skipped, see skip_group
+static bool handle_conditional_directive(tk_node directive, enum subtype directive_type) {
+    if (directive_type == DIRECTIVE_IF || directive_type == DIRECTIVE_IFDEF || directive_type == DIRECTIVE_IFNDEF) {
+        if (num_conditionals == max_conditionals) {
+            max_conditionals = max_conditionals ? max_conditionals * 2 : INITIAL_CONDITIONALS;
+            conditionals = realloc(conditionals, max_conditionals * sizeof(bool));
+        }
+
+        const bool cond = evaluate_condition(directive, directive_type);
+
+        conditionals[num_conditionals++] = cond;
+
+        return !cond;
+    }
+
+    if (num_conditionals == 0) {
+        error(tk.loc[directive], "Missing #if");
+        return false;
+    }
+
+    bool *group_taken = &conditionals[num_conditionals - 1];
+    bool skip = *group_taken;
+
+    switch (directive_type) {
+        case DIRECTIVE_ELIF:
+            // Once a group has been taken, the conditions of the rest aren't expanded or evaluated
+            skip = skip || !evaluate_condition(directive, directive_type);
+            *group_taken |= !skip;
+            break;
+        case DIRECTIVE_ELSE:
+            *group_taken = true;
+            break;
+        default:
+            num_conditionals--;
+            skip = false;
+            break;
+    }
+
+    return skip;
+}
+
+static bool read_more_tokens(tk_node *last);
+
+// Removes the tokens of the group being skipped, which starts after before, up to the #elif, #else or
+// #endif that ends it. More tokens are lexed as needed, which can move before to a new node
+static void skip_group(tk_node *before) {
+    uint32_t nesting = 0;
+
+    while (true) {
+        const tk_node ptr = tk.next[*before];
+
+        if (ptr == TK_NONE) {
+            if (!read_more_tokens(before)) return;
+            continue;
+        }
+
+        // A conditional can't carry on past the end of the file it's in
+        if (tk.type[ptr] == END) {
+            return;
+        }
+
+        if (tk.type[ptr] == DIRECTIVE) {
+            switch (tk.subtype[ptr]) {
+                case DIRECTIVE_IF:
+                case DIRECTIVE_IFDEF:
+                case DIRECTIVE_IFNDEF: nesting++; break;
+                case DIRECTIVE_ENDIF:
+                    if (nesting == 0) return;
+                    nesting--;
+                    break;
+                case DIRECTIVE_ELIF:
+                case DIRECTIVE_ELSE: if (nesting == 0) return; break;
+                default: break;
+            }
+        }
+
+        tk.next[*before] = tk.next[ptr];
+    }
+}
+
+// A group the lexer deferred is only reached by the preprocessor if it's taken, so it's lexed now.
+// If it's the last token lexed, it's read as the next batch instead, see stream_deferred_group
+static void take_deferred_group(tk_node before_group) {
+    const tk_node group = tk.next[before_group];
+
+    if (tk.next[group] == TK_NONE) {
+        tk.next[before_group] = TK_NONE;
+        stream_deferred_group(group);
+        return;
+    }
+
+    lex_deferred_group(before_group);
+}
+
+static void push_argument_token(const token *argument_token) {
+    if (num_argument_tokens == max_argument_tokens) {
+        max_argument_tokens = max_argument_tokens ? max_argument_tokens * 2 : INITIAL_ARGUMENT_TOKENS;
+        argument_tokens = realloc(argument_tokens, max_argument_tokens * sizeof(token));
+    }
+
+    argument_tokens[num_argument_tokens++] = *argument_token;
+}
+
+static void push_argument_start(void) {
+    if (num_argument_starts == max_argument_starts) {
+        max_argument_starts = max_argument_starts ? max_argument_starts * 2 : INITIAL_ARGUMENT_TOKENS;
+        argument_starts = realloc(argument_starts, max_argument_starts * sizeof(uint32_t));
+    }
+
+    argument_starts[num_argument_starts++] = num_argument_tokens;
+}
+
+// Returns the tokens of an invocation's argument, first_argument is where its arguments start.
+// Only valid until more arguments are pushed
+static token *get_argument(uint32_t first_argument, uint16_t param_index) {
+    return &argument_tokens[argument_starts[first_argument + param_index]];
+}
+
+static tk_list_segment expand_tokens(tk_node before, size_t count);
+
+// Returns the macro invoked at token_node, or NULL if it isn't an invocation. A name in its own
+// hide set came from an expansion of that macro, and a function-like macro's name is only an
+// invocation when it's followed by a (
+static const macro *find_invocation(tk_node token_node) {
+    if (tk.type[token_node] != IDENTIFIER || hideset_contains(tk.hideset[token_node], tk.atom[token_node])) {
+        return NULL;
+    }
+
+    if (recording_dependencies && (num_dependencies == 0 || dependencies[num_dependencies - 1] != tk.atom[token_node])) {
+        if (num_dependencies == max_dependencies) {
+            max_dependencies = max_dependencies ? max_dependencies * 2 : INITIAL_ARGUMENT_TOKENS;
+            dependencies = realloc(dependencies, max_dependencies * sizeof(atom));
+        }
+
+        dependencies[num_dependencies++] = tk.atom[token_node];
+    }
+
+    const macro *invoked_macro = find_macro(tk.atom[token_node]);
+
+    if (invoked_macro == NULL || !invoked_macro->is_function_like) {
+        return invoked_macro;
+    }
+
+    tk_node ptr = tk.next[token_node];
+
+    while (ptr != TK_NONE && (tk.type[ptr] == BLANK || (tk.type[ptr] == NEWLINE && !expanding_directive))) {
+        ptr = tk.next[ptr];
+    }
+
+    return ptr != TK_NONE && tk.subtype[ptr] == PUN_LEFT_PARENTHESIS ? invoked_macro : NULL;
+}
+
+// Pushes the arguments of the invocation at name onto the argument stack, each ending with a token
+// with no location. Newlines between them are dropped, and an empty argument has no tokens.
+// Returns the invocation's closing ), or TK_NONE if it isn't a valid invocation.
+// num_consumed is incremented for every token after the name up to the )
+static tk_node collect_arguments(tk_node name, const macro *invoked_macro, size_t *num_consumed) {
+    tk_node ptr = name;
+    short num_arguments = 1;
+    size_t parenthesis_level = 0;
+
+    do {
+        ptr = tk.next[ptr];
+        (*num_consumed)++;
+    } while (tk.subtype[ptr] != PUN_LEFT_PARENTHESIS);
+
+    push_argument_start();
+
+    while (true) {
+        ptr = tk.next[ptr];
+
+        // An expansion being cached is expanded on its own, so the arguments may still follow the use
+        if (ptr == TK_NONE && recording_dependencies) {
+            expansion_incomplete = true;
+            return TK_NONE;
+        }
+
+        if (ptr == TK_NONE || tk.type[ptr] == END || (tk.type[ptr] == NEWLINE && expanding_directive)) {
+            error(tk.loc[name], "Unterminated macro invocation");
+            return TK_NONE;
+        }
+
+        (*num_consumed)++;
+
+        if (tk.subtype[ptr] == PUN_RIGHT_PARENTHESIS && parenthesis_level == 0) break;
+
+        if (tk.subtype[ptr] == PUN_LEFT_PARENTHESIS) parenthesis_level++;
+        if (tk.subtype[ptr] == PUN_RIGHT_PARENTHESIS) parenthesis_level--;
+
+        if (tk.type[ptr] == NEWLINE || tk.type[ptr] == BLANK) continue;
+
+        // Commas in the last argument of a variadic macro are part of __VA_ARGS__
+        if (tk.subtype[ptr] == PUN_COMMA && parenthesis_level == 0 &&
+            !(invoked_macro->is_variadic && num_arguments == invoked_macro->num_params)) {
+            push_argument_token(&(token) {0});
+            push_argument_start();
+            num_arguments++;
+            continue;
+        }
+
+        const token argument_token = get_token(ptr);
+        push_argument_token(&argument_token);
+    }
+
+    push_argument_token(&(token) {0});
+
+    // The variable arguments can be left out completely
+    if (invoked_macro->is_variadic && num_arguments == invoked_macro->num_params - 1) {
+        push_argument_start();
+        push_argument_token(&(token) {0});
+        num_arguments++;
+    }
+
+    // A macro with no parameters takes a single empty argument
+    const bool no_arguments = num_arguments == 1 && argument_starts[num_argument_starts - 1] == num_argument_tokens - 1;
+
+    if (num_arguments != invoked_macro->num_params && !(invoked_macro->num_params == 0 && no_arguments)) {
+        error(tk.loc[name], "Wrong number of macro arguments");
+        return TK_NONE;
+    }
+
+    return ptr;
+}
+
+// stringify_argument combines the lexemes of all tokens in the argument,
+// with a space wherever there was whitespace between them
+token stringify_argument(uint16_t param_index, uint32_t first_argument) {
+    token stringified_token = {.type = STRING_LITERAL, .lexeme = {0}, .loc = current_loc};
+    uint32_t required_lexeme_length = 0;
+
+    const token *argument = get_argument(first_argument, param_index);
+
+    // Calculate how much space is needed for the stringified token's lexeme
+    for (const token *argument_ptr = argument; argument_ptr->loc != NO_SOURCE_LOC; argument_ptr++) {
+        required_lexeme_length += argument_ptr->lexeme.len;
+
+        // Ignore any whitespace before the argument's first token
+        if (argument_ptr != argument && argument_ptr->follows_whitespace) required_lexeme_length++;
+    }
+
+    if (required_lexeme_length > UINT16_MAX) {
+        error(current_loc, "Failed to stringify argument: Required length > UINT16_MAX");
+        return (token) {0};
+    }
+
+    stringified_token.lexeme = create_heap_string((uint16_t) required_lexeme_length + 1, token_arena);
+
+    for (const token *argument_ptr = argument; argument_ptr->loc != NO_SOURCE_LOC; argument_ptr++) {
+        if (argument_ptr != argument && argument_ptr->follows_whitespace) {
+            string_cat_c(&stringified_token.lexeme, ' ');
+        }
+
+        string_cat(&stringified_token.lexeme, &argument_ptr->lexeme);
+    }
+
+    return stringified_token;
+}
+
+// Pastes right onto the end of the token at left for ##
+static void paste_token(tk_node left, const token *right) {
+    // If tokens are not the same type, set the type to an identifier
+    if (tk.type[left] != right->type || tk.subtype[left] != right->subtype) {
+        tk.type[left] = IDENTIFIER;
+    }
+
+    const uint32_t concat_length = tk.lexeme[left].len + right->lexeme.len;
+
+    if (concat_length >= UINT16_MAX) {
+        error(current_loc, "Failed to concat tokens: Required length > UINT16_MAX");
+    } else {
+        string concat_string = create_heap_string((uint16_t) concat_length + 1, token_arena);
+
+        string_copy(&concat_string, &tk.lexeme[left]);
+        string_cat(&concat_string, &right->lexeme);
+
+        tk.lexeme[left] = concat_string;
+    }
+
+    if (tk.type[left] == IDENTIFIER && tk.lexeme[left].len > 0) {
+        tk.atom[left] = intern(&tk.lexeme[left]);
+    }
+
+    // Pasting onto an integer constant makes a new number, e.g. 1 ## 2
+    if (tk.type[left] == CONSTANT && tk.subtype[left] >= CONST_INTEGER && tk.subtype[left] <= CONST_UNSIGNED_LONG_LONG) {
+        token pasted_constant = get_token(left);
+        parse_integer_constant(&pasted_constant);
+        set_token(left, &pasted_constant);
+    }
+
+    tk.hideset[left] = hideset_union(tk.hideset[left], right->hideset);
+}
+
+// An invocation's expansion as it's built, linked after the token before the invocation
+typedef struct {
+    tk_node tail;
+    size_t len;
+    source_loc loc; // Every token of an expansion is located at its invocation
+    hideset hideset; // Added to the hide set of every token of the expansion
+} expansion;
+
+static void append_to_expansion(expansion *output, const token *new_token) {
+    const tk_node new_node = new_token_node(new_token);
+
+    tk.loc[new_node] = output->loc;
+    tk.hideset[new_node] = hideset_union(tk.hideset[new_node], output->hideset);
+
+    tk.next[output->tail] = new_node;
+    output->tail = new_node;
+    output->len++;
+}
+
+// Copies an argument into a list of its own and expands it, as it's substituted fully expanded
+// wherever it's not an operand of # or ##. Returns the list's head, a token that isn't part of it
+static tk_node expand_argument(uint32_t first_argument, uint16_t param_index) {
+    const tk_node head = new_token_node(&(token) {.type = BLANK});
+    tk_node tail = head;
+    size_t num_argument_tokens_copied = 0;
+
+    for (const token *argument = get_argument(first_argument, param_index); argument->loc != NO_SOURCE_LOC; argument++) {
+        const tk_node new_node = new_token_node(argument);
+
+        tk.next[tail] = new_node;
+        tail = new_node;
+        num_argument_tokens_copied++;
+    }
+
+    expand_tokens(head, num_argument_tokens_copied);
+
+    return head;
+}
+
+// Replaces the invocation of invoked_macro after before with its expansion, which isn't rescanned yet.
+// Returns how many tokens the expansion has, and sets num_consumed to how many the invocation had
+static size_t replace_invocation(tk_node before, const macro *invoked_macro, size_t *num_consumed) {
+    const tk_node name = tk.next[before];
+    const uint32_t first_argument = num_argument_starts;
+    const uint32_t first_argument_token = num_argument_tokens;
+
+    expansion output = {.tail = before, .len = 0, .loc = tk.loc[name], .hideset = tk.hideset[name]};
+    tk_node last = name;
+
+    *num_consumed = 1;
+
+    if (invoked_macro->is_function_like) {
+        last = collect_arguments(name, invoked_macro, num_consumed);
+
+        if (last == TK_NONE) {
+            num_argument_starts = first_argument;
+            num_argument_tokens = first_argument_token;
+
+            // Leave the name as it is, without taking it for an invocation again
+            tk.hideset[name] = hideset_add(tk.hideset[name], invoked_macro->name);
+            *num_consumed = 1;
+
+            return 1;
+        }
+
+        // Only the macros that both the name and the ) came from stay hidden
+        output.hideset = hideset_intersection(output.hideset, tk.hideset[last]);
+    }
+
+    output.hideset = hideset_add(output.hideset, invoked_macro->name);
+
+    const tk_node after = tk.next[last];
+    const bool follows_whitespace = (tk.flags[name] & TK_FOLLOWS_WHITESPACE) != 0;
+
+    const token *replacement = invoked_macro->replacement;
+    const uint32_t replacement_len = invoked_macro->replacement_len;
+
+    // Each argument is only expanded the first time it's needed
+    tk_node expanded_arguments[invoked_macro->num_params + 1];
+    memset(expanded_arguments, 0, sizeof(expanded_arguments));
+
+    // Set when the last operand of ## was an empty argument, so there's nothing to paste onto
+    bool placemarker = false;
+
+    for (uint32_t i = 0; i < replacement_len; i++) {
+        const token *replacement_token = &replacement[i];
+
+        // Token concatenation ##
+        // ----------------------
+        if (replacement_token->subtype == PUN_DOUBLE_HASH) {
+            if (i == 0 || i + 1 == replacement_len) {
+                error(output.loc, i == 0 ? "Found ## at start of replacement list" : "Found ## at end of replacement list");
+                continue;
+            }
+
+            const token *right = &replacement[++i];
+
+            if (right->type == ARGUMENT) {
+                const token *argument = get_argument(first_argument, (uint16_t) right->value);
+
+                // Pasting an empty argument leaves the left operand as it is
+                if (argument->loc == NO_SOURCE_LOC) continue;
+
+                if (placemarker) {
+                    append_to_expansion(&output, argument);
+                } else {
+                    paste_token(output.tail, argument);
+                    tk.hideset[output.tail] = hideset_union(tk.hideset[output.tail], output.hideset);
+                }
+
+                for (argument++; argument->loc != NO_SOURCE_LOC; argument++) {
+                    append_to_expansion(&output, argument);
+                }
+            } else if (placemarker) {
+                append_to_expansion(&output, right);
+            } else {
+                paste_token(output.tail, right);
+                tk.hideset[output.tail] = hideset_union(tk.hideset[output.tail], output.hideset);
+            }
+
+            placemarker = false;
+            continue;
+        }
+        // ----------------------
+
+        placemarker = false;
+
+        // Stringification #
+        // -----------------
+        if (invoked_macro->is_function_like && replacement_token->subtype == PUN_HASH) {
+            if (i + 1 == replacement_len || replacement[i + 1].type != ARGUMENT) {
+                error(output.loc, "# not followed by parameter");
+                continue;
+            }
+
+            const token stringified_token = stringify_argument((uint16_t) replacement[++i].value, first_argument);
+            append_to_expansion(&output, &stringified_token);
+            continue;
+        }
+        // -----------------
+
+        if (replacement_token->type != ARGUMENT) {
+            append_to_expansion(&output, replacement_token);
+            continue;
+        }
+
+        // Argument substitution
+        // ---------------------
+        const uint16_t param_index = (uint16_t) replacement_token->value;
+
+        // The left operand of ## is substituted as it was written
+        if (i + 1 < replacement_len && replacement[i + 1].subtype == PUN_DOUBLE_HASH) {
+            const token *argument = get_argument(first_argument, param_index);
+
+            placemarker = argument->loc == NO_SOURCE_LOC;
+
+            for (; argument->loc != NO_SOURCE_LOC; argument++) {
+                append_to_expansion(&output, argument);
+            }
+            continue;
+        }
+
+        if (expanded_arguments[param_index] == TK_NONE) {
+            expanded_arguments[param_index] = expand_argument(first_argument, param_index);
+        }
+
+        for (tk_node ptr = tk.next[expanded_arguments[param_index]]; ptr != TK_NONE; ptr = tk.next[ptr]) {
+            const token expanded_token = get_token(ptr);
+            append_to_expansion(&output, &expanded_token);
+        }
+        // ---------------------
+    }
+
+    tk.next[output.tail] = after;
+
+    if (output.len > 0) {
+        const tk_node first = tk.next[before];
+
+        tk.flags[first] = (uint8_t) ((tk.flags[first] & ~TK_FOLLOWS_WHITESPACE) |
+                                     (follows_whitespace ? TK_FOLLOWS_WHITESPACE : 0));
+    }
+
+    num_argument_starts = first_argument;
+    num_argument_tokens = first_argument_token;
+
+    return output.len;
+}
+
+static bool cached_expansion_valid(const cached_expansion *expansion) {
+    for (uint32_t i = 0; i < expansion->num_dependencies; i++) {
+        if (get_macro_name_info(expansion->dependencies[i])->changed_at > expansion->generation) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Fully expands the object-like macro invoked at name on its own, and saves the result
+static cached_expansion *cache_expansion(tk_node name, const macro *invoked_macro) {
+    const token name_token = get_token(name);
+    const tk_node head = new_token_node(&(token) {.type = BLANK});
+    size_t num_consumed;
+
+    tk.next[head] = new_token_node(&name_token);
+
+    // Errors found while caching are only kept if the expansion can be used, otherwise
+    // the use is expanded again and reports them itself
+    const size_t diagnostics_len = diagnostics != NULL ? diagnostics->len : 0;
+
+    num_dependencies = 0;
+    recording_dependencies = true;
+    expansion_incomplete = false;
+
+    const size_t num_produced = replace_invocation(head, invoked_macro, &num_consumed);
+    const tk_list_segment expanded_segment = expand_tokens(head, num_produced);
+
+    recording_dependencies = false;
+
+    if (expansion_incomplete && diagnostics != NULL) {
+        diagnostics->len = diagnostics_len;
+    }
+
+    cached_expansion *expansion = allocate_from_arena(macro_arena, sizeof(cached_expansion));
+
+    *expansion = (cached_expansion) {
+        .tokens = allocate_from_arena(macro_arena, expanded_segment.len * sizeof(token)),
+        .len = (uint32_t) expanded_segment.len,
+        .dependencies = allocate_from_arena(macro_arena, num_dependencies * sizeof(atom)),
+        .num_dependencies = num_dependencies,
+        .generation = macro_generation,
+        .complete = !expansion_incomplete
+    };
+
+    tk_node ptr = expanded_segment.start;
+
+    for (uint32_t i = 0; i < expansion->len; i++, ptr = tk.next[ptr]) {
+        expansion->tokens[i] = get_token(ptr);
+        expansion->tokens[i].lexeme = macro_lexeme(&expansion->tokens[i]);
+    }
+
+    if (num_dependencies > 0) {
+        memcpy(expansion->dependencies, dependencies, num_dependencies * sizeof(atom));
+    }
+
+    if (expanded_segment.len > 0 && tk.type[expanded_segment.end] == IDENTIFIER) {
+        const macro *last_macro = find_macro(tk.atom[expanded_segment.end]);
+
+        expansion->rescan_last = last_macro != NULL && last_macro->is_function_like &&
+                                 !hideset_contains(tk.hideset[expanded_segment.end], last_macro->name);
+    }
+
+    return expansion;
+}
+
+// Returns the expansion of the object-like macro used at name, expanding and caching it first if it
+// hasn't been or it's out of date. Returns NULL if it depends on the tokens after the use
+static const cached_expansion *find_cached_expansion(tk_node name, const macro *invoked_macro) {
+    macro_name_info *info = get_macro_name_info(invoked_macro->name);
+
+    if (info->expansion == NULL || !cached_expansion_valid(info->expansion)) {
+        cached_expansion *expansion = cache_expansion(name, invoked_macro);
+
+        // The table of names can move while the expansion is expanded
+        info = get_macro_name_info(invoked_macro->name);
+        info->expansion = expansion;
+    }
+
+    return info->expansion->complete ? info->expansion : NULL;
+}
+
+// Replaces the use of an object-like macro after before with a copy of its cached expansion.
+// Sets expanded to the tokens that can't be expanded any further, and returns how many tokens
+// after them still need to be rescanned
+static size_t splice_cached_expansion(tk_node before, const cached_expansion *expansion, tk_list_segment *expanded) {
+    const tk_node name = tk.next[before];
+    const tk_node after = tk.next[name];
+    const uint32_t num_expanded = expansion->len - (expansion->rescan_last ? 1 : 0);
+    tk_node tail = before;
+
+    *expanded = (tk_list_segment) {TK_NONE, TK_NONE, 0};
+
+    for (uint32_t i = 0; i < expansion->len; i++) {
+        const tk_node new_node = new_token_node(&expansion->tokens[i]);
+
+        tk.loc[new_node] = tk.loc[name];
+        tk.next[tail] = new_node;
+        tail = new_node;
+
+        if (i < num_expanded) {
+            if (expanded->start == TK_NONE) {
+                expanded->start = new_node;
+            }
+
+            expanded->end = new_node;
+            expanded->len++;
+        }
+    }
+
+    tk.next[tail] = after;
+
+    if (expansion->len > 0) {
+        const tk_node first = tk.next[before];
+
+        tk.flags[first] = (uint8_t) ((tk.flags[first] & ~TK_FOLLOWS_WHITESPACE) |
+                                     (tk.flags[name] & TK_FOLLOWS_WHITESPACE));
+    }
+
+    return expansion->len - num_expanded;
+}
+
+// Expands the invocations in the count tokens after before, then rescans their expansions along with
+// the rest of the tokens, so every token is only looked at once. An invocation can take its arguments
+// from past the last of the tokens. Returns the tokens that are left once nothing more can be expanded
+static tk_list_segment expand_tokens(tk_node before, size_t count) {
+    tk_list_segment expanded_segment = {TK_NONE, TK_NONE, 0};
+    tk_node ptr = before;
+
+    while (count > 0 && tk.next[ptr] != TK_NONE) {
+        const macro *invoked_macro = find_invocation(tk.next[ptr]);
+
+        // Object-like macros used outside of any expansion always expand the same way, until a
+        // name their expansion depends on changes, so their expansion is cached
+        const cached_expansion *expansion = NULL;
+
+        if (invoked_macro != NULL && !invoked_macro->is_function_like && tk.hideset[tk.next[ptr]] == EMPTY_HIDESET) {
+            expansion = find_cached_expansion(tk.next[ptr], invoked_macro);
+        }
+
+        if (expansion != NULL) {
+            tk_list_segment cached_segment;
+            const size_t num_unscanned = splice_cached_expansion(ptr, expansion, &cached_segment);
+
+            count = count - 1 + num_unscanned;
+
+            if (cached_segment.len > 0) {
+                if (expanded_segment.start == TK_NONE) {
+                    expanded_segment.start = cached_segment.start;
+                }
+
+                expanded_segment.end = cached_segment.end;
+                expanded_segment.len += cached_segment.len;
+                ptr = cached_segment.end;
+            }
+            continue;
+        }
+
+        if (invoked_macro != NULL) {
+            size_t num_consumed;
+            const size_t num_produced = replace_invocation(ptr, invoked_macro, &num_consumed);
+
+            count = (num_consumed >= count ? 0 : count - num_consumed) + num_produced;
+            continue;
+        }
+
+        ptr = tk.next[ptr];
+        count--;
+
+        if (expanded_segment.start == TK_NONE) {
+            expanded_segment.start = ptr;
+        }
+
+        expanded_segment.end = ptr;
+        expanded_segment.len++;
+    }
+
+    return expanded_segment;
+}
+
+// Expands the macro invocation after before. Returns the tokens it became, which are empty
+// if it expanded to nothing, or just the token after before if it isn't an invocation
+tk_list_segment expand_macro(tk_node before) {
+    return expand_tokens(before, 1);
+}
+
+// Frees the buffers kept from one translation unit to the next
+void free_preprocessor(void) {
+    free(argument_tokens);
+    free(argument_starts);
+    free(macro_names);
+    free(dependencies);
+    free(conditionals);
+
+    argument_tokens = NULL;
+    argument_starts = NULL;
+    macro_names = NULL;
+    dependencies = NULL;
+    conditionals = NULL;
+    max_argument_tokens = max_argument_starts = max_macro_names = max_dependencies = max_conditionals = 0;
+}
+
+// Lexes the next batch of tokens after last, the end of the token list, once every token before it has been
+// preprocessed. When streaming, those tokens are written out first and everything they used is dropped,
+// leaving the token buffer with just a new head and last, which moves. Returns false once there's nothing left
+static bool read_more_tokens(tk_node *last) {
+    if (output != NULL && *last != tokens) {
+        token kept = get_token(*last);
+
+        write_tokens(output, tk.next[tokens], *last);
+        release_written_tokens(&kept);
+        reset_token_buffer();
+
+        tokens = new_token_node(&(token) {0});
+        *last = new_token_node(&kept);
+        tk.next[tokens] = *last;
+    }
+
+    return lex_more_tokens(*last);
+}
+
+// Preprocesses the translation unit, lexing it a batch at a time, see lex_more_tokens. token_node is the head
+// of the token list, which the preprocessed tokens are left in, unless they're streamed out to the writer
+void process_preprocessing_tokens(tk_node token_node, token_writer *writer) {
+    tk_node ptr = token_node;
+    tk_node before_directive = TK_NONE;
+
+    output = writer;
+    num_conditionals = 0;
+
+    macro_arena = create_arena(MACRO_ARENA_BLOCK_SIZE);
+
+    // Cached expansions are allocated from the macro arena, so they only last for one translation unit
+    if (macro_names != NULL) {
+        memset(macro_names, 0, max_macro_names * sizeof(macro_name_info));
+    }
+    macro_hash_table = ht_alloc(MAX_NUM_MACROS, ht_compare_ptr, macro_arena);
+
+    defined_atom = intern(&defined_string);
+    once_atom = intern(&once_string);
+    va_args_atom = intern(&va_args_string);
+
+    translation_unit++;
+
+    pch_prefix_intact = lex_more_tokens(token_node);
+    prefix_file_id = pch_prefix_intact ? source_loc_file_id(tk.loc[tk.next[token_node]]) : 0;
+
+    while (tk.next[ptr] != TK_NONE || read_more_tokens(&ptr)) {
+        current_loc = tk.loc[ptr];
+
+        // Reaching a header's END token means everything in it has been preprocessed
+        if (tk.type[ptr] == END && include_timing != NULL) {
+            end_file_timing(source_loc_file_id(current_loc));
+        }
+
+        if (tk.type[ptr] != DIRECTIVE) {
+            before_directive = ptr;
+
+            if (tk.type[tk.next[ptr]] == GROUP) {
+                take_deferred_group(ptr);
+            } else if (macro_exists(tk.next[ptr])) {
+                const tk_list_segment expanded_macro_segment = expand_macro(ptr);
+
+                // Move to end of expanded macro, if it expanded to nothing the next token is already after it
+                if (expanded_macro_segment.len > 0) {
+                    ptr = expanded_macro_segment.end;
+                }
+            } else {
+                ptr = tk.next[ptr];
+            }
+            continue;
+        }
+
+        tk_node directive = ptr;
+        const enum subtype directive_type = tk.subtype[directive];
+        tk_node preprocessed_end = TK_NONE;
+        bool skip = false;
+
+        // Expand any macros within the directive
+        if (directive_type != DIRECTIVE_UNDEF && directive_type != DIRECTIVE_DEFINE &&
+            directive_type != DIRECTIVE_IFDEF && directive_type != DIRECTIVE_IFNDEF &&
+            directive_type != DIRECTIVE_ELIF) {
+            expand_directive_line(directive);
+        }
+
+        switch (directive_type) {
+            case DIRECTIVE_DEFINE:
+                handle_define_directive(tk.next[directive]);
+                break;
+            case DIRECTIVE_UNDEF:
+                handle_undef_directive(tk.next[directive]);
+                break;
+            case DIRECTIVE_IF:
+            case DIRECTIVE_IFDEF:
+            case DIRECTIVE_IFNDEF:
+            case DIRECTIVE_ELIF:
+            case DIRECTIVE_ELSE:
+            case DIRECTIVE_ENDIF:
+                skip = handle_conditional_directive(directive, directive_type);
+                break;
+            case DIRECTIVE_INCLUDE:
+                preprocessed_end = handle_include_directive(directive);
+                break;
+            case DIRECTIVE_PRAGMA:
+                if (tk.atom[tk.next[directive]] == once_atom) {
+                    get_source_file(source_loc_file_id(tk.loc[directive]))->pragma_once = true;
+                    break;
+                }
+
+                // Leave in other Pragma directives for now
+                while (tk.type[tk.next[ptr]] != NEWLINE) {
+                    ptr = tk.next[ptr];
+                }
+                continue;
+            default: break;
+        }
+
+        if ((directive_type == DIRECTIVE_DEFINE || directive_type == DIRECTIVE_UNDEF ||
+             directive_type == DIRECTIVE_INCLUDE) && source_loc_file_id(tk.loc[directive]) != prefix_file_id) {
+            pch_prefix_intact = false;
+        }
+
+        // Go to end of directive line
+        while (tk.type[tk.next[ptr]] != NEWLINE) {
+            ptr = tk.next[ptr];
+        }
+
+        // Remove the directive, and skip over the header if it was precompiled
+        remove_from_list(before_directive, advance_list(ptr, 2));
+        ptr = preprocessed_end != TK_NONE ? preprocessed_end : before_directive;
+
+        if (skip) {
+            skip_group(&ptr);
+        }
+    }
+
+    if (num_conditionals > 0) {
+        error(current_loc, "Missing #endif");
+    }
+
+    if (output != NULL) {
+        write_tokens(output, tk.next[tokens], TK_NONE);
+    }
+
+    if (pch_output_path != NULL) {
+        write_pch(pch_output_path, tk.next[tokens], translation_unit);
+    }
+
+    delete_arena(macro_arena);
+}
@@ -1,4 +1,18 @@
-#ifndef PREPROCESSOR_H
-#define PREPROCESSOR_H
-
-#endif //PREPROCESSOR_H
+#ifndef PREPROCESSOR_H
+#define PREPROCESSOR_H
+
+#include "common.h"
+#include "hash_table.h"
+
+// Every translation unit starts with these, a file of its own before the main one
+extern const char predefined_macros[];
+
+// Keyed by the macro's interned name
+extern THREAD_LOCAL ht *macro_hash_table;
+
+void add_macro(const macro new_macro);
+void remove_macro(atom macro_name);
+
+bool included_in_translation_unit(const source_file *file);
+
+#endif //PREPROCESSOR_H
@@ -28,31 +28,18 @@ bool string_cat_c(string *dest, char c) {
     return true;
 }
 
+// Strings aren't guaranteed to be NULL terminated (e.g. views into a source buffer),
+// so only compare within the lengths of both strings
 int16_t string_cmp(const string *s1, const string *s2) {
+    const uint16_t shortest_len = s1->len < s2->len ? s1->len : s2->len;
 
-    if (s1->len == 0 && s2->len == 0) {
-        return 0;
-    }
-
-    if (s1->len == 0 || s2->len == 0) {
-        return ((s2->len == 0) * 2) - 1;
-    }
-
-    if (s1->len < s2->len) {
-        return s1->data[s1->len] - s2->data[s1->len];
-    }
-
-    if (s1->len > s2->len) {
-        return s1->data[s2->len] - s2->data[s2->len];
-    }
-
-    for (uint16_t i = 0; i < s1->len; i++) {
+    for (uint16_t i = 0; i < shortest_len; i++) {
         if (s1->data[i] != s2->data[i]) {
             return s1->data[i] - s2->data[i];
         }
     }
 
-    return 0;
+    return (int16_t) (s1->len - s2->len);
 }
 
 bool string_copy(string *dest, const string *src) {
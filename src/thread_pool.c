@@ -0,0 +1,127 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Tasks are dealt out to the workers in turn, and each works through its own queue from the front.
+// A worker that runs out steals from the back of another's queue, so a few slow tasks
+// don't leave the rest of the workers idle. No tasks are added once started, so a worker
+// that finds every queue empty is done
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t head;
+    size_t tail;
+} task_queue;
+
+typedef struct {
+    task_queue *queues;
+    unsigned num_threads;
+    task_function run_task;
+    thread_function finish_thread;
+    void *context;
+} thread_pool;
+
+typedef struct {
+    thread_pool *pool;
+    unsigned index;
+} worker;
+
+static bool take_task(task_queue *queue, bool steal, size_t *task) {
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->head < queue->tail) {
+        *task = steal ? queue->tasks[--queue->tail] : queue->tasks[queue->head++];
+        found = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+static void *run_worker(void *arg) {
+    const worker *self = arg;
+    thread_pool *pool = self->pool;
+    size_t task;
+
+    while (true) {
+        bool found = take_task(&pool->queues[self->index], false, &task);
+
+        for (unsigned i = 1; !found && i < pool->num_threads; i++) {
+            found = take_task(&pool->queues[(self->index + i) % pool->num_threads], true, &task);
+        }
+
+        if (!found) {
+            pool->finish_thread(pool->context);
+            return NULL;
+        }
+
+        pool->run_task(task, pool->context);
+    }
+}
+
+// Runs run_task on every task from 0 to num_tasks - 1, returning once they've all finished.
+// Each thread that ran tasks calls finish_thread once it has run its last one, to free what it kept
+// between them. With a single thread the tasks are run in order on the calling thread
+void run_tasks(size_t num_tasks, unsigned num_threads, task_function run_task, thread_function finish_thread,
+               void *context) {
+    if (num_threads > num_tasks) {
+        num_threads = (unsigned) num_tasks;
+    }
+
+    if (num_threads <= 1) {
+        for (size_t task = 0; task < num_tasks; task++) run_task(task, context);
+        finish_thread(context);
+        return;
+    }
+
+    thread_pool pool = {.queues = calloc(num_threads, sizeof(task_queue)), .num_threads = num_threads,
+                        .run_task = run_task, .finish_thread = finish_thread, .context = context};
+    worker *workers = calloc(num_threads, sizeof(worker));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+
+    for (unsigned i = 0; i < num_threads; i++) {
+        task_queue *queue = &pool.queues[i];
+
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->tasks = malloc((num_tasks / num_threads + 1) * sizeof(size_t));
+
+        for (size_t task = i; task < num_tasks; task += num_threads) {
+            queue->tasks[queue->tail++] = task;
+        }
+    }
+
+    unsigned num_started = 0;
+
+    for (; num_started < num_threads; num_started++) {
+        workers[num_started] = (worker) {.pool = &pool, .index = num_started};
+
+        if (pthread_create(&threads[num_started], NULL, run_worker, &workers[num_started]) != 0) {
+            break;
+        }
+    }
+
+    // Whatever the threads that didn't start would have run gets stolen by the others
+    if (num_started == 0) {
+        fprintf(stderr, "Cannot start worker threads, running on one\n");
+        run_worker(&workers[0]);
+    }
+
+    for (unsigned i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (unsigned i = 0; i < num_threads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+    }
+
+    free(pool.queues);
+    free(workers);
+    free(threads);
+}
@@ -0,0 +1,17 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+// Each worker runs whole translation units, so all the state the pipeline keeps between
+// calls is kept per thread, and a thread's translation units never see another thread's.
+// The exceptions are the header cache and the include path caches, which are shared behind locks
+#define THREAD_LOCAL __thread
+
+typedef void (*task_function)(size_t task, void *context);
+typedef void (*thread_function)(void *context);
+
+void run_tasks(size_t num_tasks, unsigned num_threads, task_function run_task, thread_function finish_thread,
+               void *context);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,99 @@
+#include "common.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define INITIAL_TOKEN_CAPACITY (1 << 16)
+
+THREAD_LOCAL token_buffer tk;
+
+static void *grow_column(void *column, size_t element_size, uint32_t new_cap) {
+    void *new_column = realloc(column, element_size * new_cap);
+
+    if (new_column == NULL) {
+        printf("\033[91mOut of Memory! Goodbye!\033[0m\n");
+        exit(1);
+    }
+
+    return new_column;
+}
+
+static void grow_token_buffer(void) {
+    const uint32_t new_cap = tk.cap ? tk.cap * 2 : INITIAL_TOKEN_CAPACITY;
+
+    tk.type = grow_column(tk.type, sizeof(*tk.type), new_cap);
+    tk.subtype = grow_column(tk.subtype, sizeof(*tk.subtype), new_cap);
+    tk.flags = grow_column(tk.flags, sizeof(*tk.flags), new_cap);
+    tk.loc = grow_column(tk.loc, sizeof(*tk.loc), new_cap);
+    tk.atom = grow_column(tk.atom, sizeof(*tk.atom), new_cap);
+    tk.value = grow_column(tk.value, sizeof(*tk.value), new_cap);
+    tk.hideset = grow_column(tk.hideset, sizeof(*tk.hideset), new_cap);
+    tk.lexeme = grow_column(tk.lexeme, sizeof(*tk.lexeme), new_cap);
+    tk.next = grow_column(tk.next, sizeof(*tk.next), new_cap);
+
+    tk.cap = new_cap;
+}
+
+// Drops every token, keeping the allocated arrays for the next translation unit
+void reset_token_buffer(void) {
+    // Index 0 is reserved for TK_NONE
+    tk.len = 1;
+}
+
+void free_token_buffer(void) {
+    free(tk.type);
+    free(tk.subtype);
+    free(tk.flags);
+    free(tk.loc);
+    free(tk.atom);
+    free(tk.value);
+    free(tk.hideset);
+    free(tk.lexeme);
+    free(tk.next);
+
+    tk = (token_buffer) {0};
+}
+
+// Appends an unlinked copy of new_token to the buffer
+tk_node new_token_node(const token *new_token) {
+    if (tk.len == 0) {
+        reset_token_buffer();
+    }
+
+    if (tk.len >= tk.cap) {
+        grow_token_buffer();
+    }
+
+    const tk_node node = tk.len++;
+
+    set_token(node, new_token);
+    tk.next[node] = TK_NONE;
+
+    return node;
+}
+
+token get_token(tk_node node) {
+    return (token) {
+        .type = tk.type[node],
+        .subtype = tk.subtype[node],
+        .loc = tk.loc[node],
+        .lexeme = tk.lexeme[node],
+        .atom = tk.atom[node],
+        .value = tk.value[node],
+        .hideset = tk.hideset[node],
+        .follows_whitespace = (tk.flags[node] & TK_FOLLOWS_WHITESPACE) != 0
+    };
+}
+
+// Overwrites the token at node, leaving its link untouched
+void set_token(tk_node node, const token *new_token) {
+    tk.type[node] = (uint8_t) new_token->type;
+    tk.subtype[node] = (uint8_t) new_token->subtype;
+    tk.flags[node] = new_token->follows_whitespace ? TK_FOLLOWS_WHITESPACE : 0;
+    tk.loc[node] = new_token->loc;
+    tk.atom[node] = new_token->atom;
+    tk.value[node] = new_token->value;
+    tk.hideset[node] = new_token->hideset;
+    tk.lexeme[node] = new_token->lexeme;
+}
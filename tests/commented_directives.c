@@ -0,0 +1,24 @@
+// Comments before a # or between it and the directive name, which a skipped group has to see
+#if 0
+int skipped_before_else;
+/* a comment */ #else
+int taken_else;
+#endif
+
+#if 0
+#if 1
+int skipped_nested;
+/**/ #endif
+int skipped_after_nested;
+# /* between */ else
+int taken_after_comment_in_directive;
+/* over
+   two lines */ #endif
+
+#ifdef UNDEFINED
+int skipped_ifdef;
+/* first */ /* second */ # /* third */ elif 1
+int taken_elif;
+#endif
+
+int after_all;
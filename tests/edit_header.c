@@ -0,0 +1,7 @@
+// The first translation unit includes its own output, which it then overwrites,
+// so the second one finds the header has changed since it was cached
+#include "output/edit_header.i"
+#define HASH #
+int first;
+int second;
+HASH include "missing.h"
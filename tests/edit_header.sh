@@ -0,0 +1,30 @@
+#!/bin/sh
+# usage: edit_header.sh <compiler> <tests directory>
+# The first translation unit includes its own output, which it then overwrites, so the second finds
+# the header has changed since it was cached. The error from the new version has to be on its line
+compiler=$1
+tests=$2
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/output"
+cp "$tests/edit_header.c" "$tests/edit_header_reader.c" "$tests/edit_header_same_size.c" \
+   "$tests/edit_header_same_size_reader.c" "$work/"
+cd "$work" || exit 1
+
+printf 'int seeded;\n' > output/edit_header.i
+
+"$compiler" -E edit_header.c edit_header_reader.c 2> errors.txt || { cat errors.txt; exit 1; }
+
+grep -q "output/edit_header.i on line 4, column 11: Cannot find missing.h" errors.txt || { cat errors.txt; exit 1; }
+grep -q "int seeded ; int first ;" output/edit_header_reader.i && grep -q "int second ;" output/edit_header_reader.i || exit 1
+
+# The comment pads the header out to the size of the output that replaces it, most likely within
+# the same second, so neither its size nor its modification time in seconds changes
+printf 'int seeded;/*xxxxxxxxxx*/\n' > output/edit_header_same_size.i
+
+"$compiler" -E edit_header_same_size.c edit_header_same_size_reader.c || exit 1
+
+[ "$(wc -c < output/edit_header_same_size.i)" -eq 26 ] || { echo "The output is no longer the size of the header"; exit 1; }
+grep -q "int seeded ; int first ; int last ;" output/edit_header_same_size_reader.i
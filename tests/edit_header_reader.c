@@ -0,0 +1,2 @@
+#include "output/edit_header.i"
+int last;
@@ -0,0 +1,4 @@
+// Like edit_header.c, but the output is the same size as the header it overwrites,
+// so the second translation unit can only tell it's changed from its contents
+#include "output/edit_header_same_size.i"
+int first;
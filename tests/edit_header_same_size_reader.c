@@ -0,0 +1,2 @@
+#include "output/edit_header_same_size.i"
+int last;
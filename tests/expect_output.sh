@@ -0,0 +1,24 @@
+#!/bin/sh
+# usage: expect_output.sh <compiler> <source> [options...]
+# Preprocesses source in a scratch directory and compares the output with the
+# .expected file next to it. Fails on any diagnostic as well as a difference
+compiler=$1
+source=$2
+shift 2
+
+expected=${source%.c}.expected
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/output"
+cp "$source" "$work/"
+cd "$work" || exit 1
+
+"$compiler" -E "$@" "$(basename "$source")" 2> errors.txt || { cat errors.txt; exit 1; }
+
+if [ -s errors.txt ]; then
+    cat errors.txt
+    exit 1
+fi
+
+diff "$expected" "output/$(basename "${source%.c}").i"
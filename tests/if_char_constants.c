@@ -0,0 +1,18 @@
+#if '\0' == 0
+int null_is_zero;
+#endif
+#if '\377' < 0 && '\377' == -1 && '\x80' == -128
+int plain_char_is_signed;
+#endif
+#if '\x41' == 'A' && '\101' == 65 && '\7' == 7 && '\1234' == 21300
+int octal_and_hex_escapes;
+#endif
+#if '\n' == 10 && '\t' == 9 && '\\' == 92 && '\'' == 39 && '"' == 34
+int simple_escapes;
+#endif
+#if 'ab' == 24930 && '\377\377' == 65535
+int multi_character;
+#endif
+#if L'\377' == 255 && L'\xffffffff' == -1 && L'a' == 97
+int wide_characters;
+#endif
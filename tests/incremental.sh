@@ -0,0 +1,34 @@
+#!/bin/sh
+# usage: incremental.sh <compiler>
+# Runs a translation unit with --incremental and -MD, then again unchanged, which has to leave the output
+# alone, then again once a header has been edited, which has to write it again
+compiler=$1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/output"
+cd "$work" || exit 1
+
+printf '#include "header.h"\nint main_file;\n' > main.c
+printf 'int one;\n' > header.h
+
+"$compiler" -E --incremental -MD main.c || exit 1
+
+grep -q "int one ; int main_file ;" output/main.i || { cat output/main.i; exit 1; }
+grep -q "^output/main.i: main.c" output/main.d && grep -q "header.h" output/main.d || { cat output/main.d; exit 1; }
+
+# Nothing has changed, so the output isn't written again
+printf 'left alone\n' >> output/main.i
+
+"$compiler" -E --incremental -MD main.c || exit 1
+
+grep -q "left alone" output/main.i || { echo "The output was written again with nothing changed"; exit 1; }
+
+# The same size, and most likely within the same second, so only the contents tell it apart
+printf 'int two;\n' > header.h
+
+"$compiler" -E --incremental -MD main.c || exit 1
+
+grep -q "int two ; int main_file ;" output/main.i || { echo "The output wasn't written again for the new header"; exit 1; }
+! grep -q "left alone" output/main.i
@@ -0,0 +1,39 @@
+#!/bin/sh
+# usage: parallel_translation_units.sh <compiler> <tests directory>
+# Runs the same translation units on one thread and on two, the output has to be the same,
+# and with leak detection on, every thread has to have freed what it kept between them
+compiler=$1
+tests=$2
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cd "$work" || exit 1
+
+cat > shared.h <<'HEADER'
+#ifndef SHARED_H
+#define SHARED_H
+#define TWICE(x) ((x) + (x))
+#define NAME(prefix, n) prefix##n
+#if defined(LARGE)
+int large;
+#else
+int small;
+#endif
+#endif
+HEADER
+
+for n in 1 2 3 4 5 6; do
+    printf '#include "shared.h"\n#include "shared.h"\nint NAME(value, %s) = TWICE(%s);\n' $n $n > unit$n.c
+done
+
+cp "$tests/if_char_constants.c" .
+
+for threads in 1 2; do
+    mkdir output
+    "$compiler" -E -j$threads unit1.c unit2.c unit3.c unit4.c unit5.c unit6.c if_char_constants.c || exit 1
+    "$compiler" -j$threads if_char_constants.c unit1.c || exit 1
+    mv output output$threads
+done
+
+diff -r output1 output2
@@ -0,0 +1,24 @@
+#!/bin/sh
+# usage: redefine_macros.sh <compiler>
+# Defines and undefines a macro more times than the macro table has slots, which only
+# works if the slots left by removed macros are used again
+compiler=$1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/output"
+cd "$work" || exit 1
+
+i=0
+while [ $i -lt 40000 ]; do
+    printf '#define REDEFINED %d\n#undef REDEFINED\n' $i
+    i=$((i + 1))
+done > redefine_macros.c
+
+echo "#define REDEFINED done" >> redefine_macros.c
+echo "int REDEFINED;" >> redefine_macros.c
+
+"$compiler" -E redefine_macros.c || exit 1
+
+grep -q "int done ;" output/redefine_macros.i
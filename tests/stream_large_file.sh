@@ -0,0 +1,49 @@
+#!/bin/sh
+# usage: stream_large_file.sh <compiler>
+# Preprocesses files larger than the source window, which -E streams a batch at a time, and compares
+# the output with --emit-pch's, which keeps every token until the end
+compiler=$1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cd "$work" || exit 1
+
+# Lines with macros whose arguments run over several lines, conditionals and comments
+generate() {
+    awk -v lines="$1" -v name="$2" 'BEGIN {
+        for (i = 0; i < lines; i++) {
+            if (i % 97 == 0) {
+                printf "#if %s_LEVEL > %d\nint %s_taken%d;\n#elif defined(%s_OTHER)\nint %s_other%d;\n#else\n", name, i % 3, name, i, name, name, i
+                printf "int %s_skipped%d = \"text\";\n#endif\n", name, i
+            } else if (i % 89 == 0) {
+                printf "#undef %s_ADD\n#define %s_ADD(a, b) ((a) + (b) * %d)\n", name, name, i
+            } else if (i % 13 == 0) {
+                printf "int %s_sum%d = %s_ADD(%d,\n    (1, 2)) /* a comment\n    over lines */;\n", name, i, name, i
+            } else {
+                printf "const char *%s_string%d = \"string %d\"; int %s_value%d = %d + %s_LEVEL; // comment\n", name, i, i, name, i, i, name
+            }
+        }
+    }'
+}
+
+{
+    printf '#ifndef LARGE_H\n#define LARGE_H\n#define header_LEVEL 1\n#define header_ADD(a, b) a\n'
+    generate 3000 header
+    printf '#endif\n'
+} > large.h
+
+{
+    printf '#define main_LEVEL 2\n#define main_ADD(a, b) b\n#include "large.h"\n'
+    generate 6000 main
+    printf '#include "large.h"\nint end = header_ADD(1,\n 2);\n'
+} > large.c
+
+mkdir output
+
+for options in "" "--line-markers" "--mmap"; do
+    "$compiler" -E $options large.c || exit 1
+    mv output/large.i streamed.i
+    "$compiler" -E $options --emit-pch large.pch large.c || exit 1
+    diff streamed.i output/large.i || exit 1
+done
@@ -0,0 +1,212 @@
+// Generates the lexer's lookup tables from the lists in src/enums.h:
+// perfect hash tables for the keyword and directive sets, and
+// a DFA that matches the longest punctuator
+// Usage: gen_lexer_tables <output header>
+
+#include "enums.h"
+#include "perfect_hash.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_HASH_BITS 10
+#define MAX_SEED_ATTEMPTS (1 << 20)
+
+#define MAX_DFA_STATES 256
+#define MAX_CHAR_CLASSES 32
+
+typedef struct {
+    const char *enum_name;
+    const char *str;
+} hash_entry;
+
+static const hash_entry keywords[] = {
+#define KW(name, str) {"KW_" #name, str},
+    KEYWORDS
+#undef KW
+};
+
+static const hash_entry directives[] = {
+#define DIR(name, str) {"DIRECTIVE_" #name, str},
+    DIRECTIVES
+#undef DIR
+};
+
+static const hash_entry punctuators[] = {
+#define PUN(name, str) {"PUN_" #name, str},
+    PUNCTUATORS
+#undef PUN
+};
+
+// Deterministic so the generated header only changes when the sets do
+static uint32_t next_seed(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state | 1;
+}
+
+static bool seed_is_perfect(const hash_entry *entries, size_t num_entries, uint32_t seed, uint8_t bits, int *slots) {
+    for (size_t i = 0; i < (1u << bits); i++) slots[i] = -1;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        const uint32_t index = perfect_hash(entries[i].str, (uint16_t) strlen(entries[i].str), seed, bits);
+
+        if (slots[index] != -1) {
+            return false;
+        }
+
+        slots[index] = (int) i;
+    }
+
+    return true;
+}
+
+static bool write_table(FILE *out, const char *prefix, const char *table_name,
+                        const hash_entry *entries, size_t num_entries) {
+    int slots[1 << MAX_HASH_BITS];
+    uint32_t state = 0x9E3779B9;
+    size_t max_length = 0;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        if (strlen(entries[i].str) > max_length) max_length = strlen(entries[i].str);
+    }
+
+    uint8_t bits = 1;
+    while ((1u << bits) < num_entries) bits++;
+
+    for (; bits <= MAX_HASH_BITS; bits++) {
+        for (size_t attempt = 0; attempt < MAX_SEED_ATTEMPTS; attempt++) {
+            const uint32_t seed = next_seed(&state);
+
+            if (!seed_is_perfect(entries, num_entries, seed, bits, slots)) {
+                continue;
+            }
+
+            fprintf(out, "#define %s_HASH_SEED 0x%08Xu\n", prefix, seed);
+            fprintf(out, "#define %s_HASH_BITS %u\n", prefix, bits);
+            fprintf(out, "#define %s_MAX_LENGTH %zu\n\n", prefix, max_length);
+            fprintf(out, "static const uint8_t %s[1 << %s_HASH_BITS] = {\n", table_name, prefix);
+
+            for (size_t i = 0; i < (1u << bits); i++) {
+                // Empty slots map to PUN_NONE, whose string never matches a non-empty lexeme
+                fprintf(out, "    %s,\n", slots[i] == -1 ? "PUN_NONE" : entries[slots[i]].enum_name);
+            }
+
+            fprintf(out, "};\n\n");
+
+            return true;
+        }
+    }
+
+    fprintf(stderr, "Could not find a perfect hash for %s\n", table_name);
+    return false;
+}
+
+// Builds a trie of the punctuators, where each node is a DFA state.
+// State 0 is the dead state and state 1 is the start state.
+// Characters that appear in punctuators each get a class, all others are class 0
+static bool write_punctuator_dfa(FILE *out) {
+    const size_t num_punctuators = sizeof(punctuators) / sizeof(punctuators[0]);
+
+    uint8_t char_class[256] = {0};
+    uint8_t transitions[MAX_DFA_STATES][MAX_CHAR_CLASSES] = {{0}};
+    const char *accepts[MAX_DFA_STATES] = {0};
+    size_t num_classes = 1;
+    size_t num_states = 2;
+
+    for (size_t i = 0; i < num_punctuators; i++) {
+        for (const char *c = punctuators[i].str; *c; c++) {
+            if (char_class[(uint8_t) *c] == 0) {
+                if (num_classes == MAX_CHAR_CLASSES) {
+                    fprintf(stderr, "Too many punctuator characters\n");
+                    return false;
+                }
+
+                char_class[(uint8_t) *c] = (uint8_t) num_classes++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < num_punctuators; i++) {
+        uint8_t state = 1;
+
+        for (const char *c = punctuators[i].str; *c; c++) {
+            uint8_t *next_state = &transitions[state][char_class[(uint8_t) *c]];
+
+            if (*next_state == 0) {
+                if (num_states == MAX_DFA_STATES) {
+                    fprintf(stderr, "Too many punctuator DFA states\n");
+                    return false;
+                }
+
+                *next_state = (uint8_t) num_states++;
+            }
+
+            state = *next_state;
+        }
+
+        accepts[state] = punctuators[i].enum_name;
+    }
+
+    fprintf(out, "#define PUNCTUATOR_START_STATE 1\n");
+    fprintf(out, "#define PUNCTUATOR_NUM_STATES %zu\n", num_states);
+    fprintf(out, "#define PUNCTUATOR_NUM_CLASSES %zu\n\n", num_classes);
+
+    fprintf(out, "static const uint8_t punctuator_char_class[256] = {\n");
+    for (size_t c = 0; c < 256; c++) {
+        if (char_class[c] != 0) fprintf(out, "    [0x%02zX] = %u, // '%c'\n", c, char_class[c], (char) c);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const uint8_t punctuator_transitions[PUNCTUATOR_NUM_STATES][PUNCTUATOR_NUM_CLASSES] = {\n");
+    for (size_t state = 0; state < num_states; state++) {
+        fprintf(out, "    {");
+        for (size_t class = 0; class < num_classes; class++) {
+            fprintf(out, class == 0 ? "%u" : ", %u", transitions[state][class]);
+        }
+        fprintf(out, "},\n");
+    }
+    fprintf(out, "};\n\n");
+
+    // States that aren't a complete punctuator (e.g. "..") accept PUN_NONE
+    fprintf(out, "static const uint8_t punctuator_accepts[PUNCTUATOR_NUM_STATES] = {\n");
+    for (size_t state = 0; state < num_states; state++) {
+        fprintf(out, "    %s,\n", accepts[state] ? accepts[state] : "PUN_NONE");
+    }
+    fprintf(out, "};\n\n");
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <output header>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by tools/gen_lexer_tables.c from src/enums.h, do not edit\n\n");
+    fprintf(out, "#ifndef LEXER_TABLES_H\n#define LEXER_TABLES_H\n\n");
+    fprintf(out, "#include \"enums.h\"\n\n#include <stdint.h>\n\n");
+
+    bool success = write_table(out, "KEYWORD", "keyword_hash_table", keywords,
+                               sizeof(keywords) / sizeof(keywords[0])) &&
+                   write_table(out, "DIRECTIVE", "directive_hash_table", directives,
+                               sizeof(directives) / sizeof(directives[0])) &&
+                   write_punctuator_dfa(out);
+
+    fprintf(out, "#endif // LEXER_TABLES_H\n");
+    fclose(out);
+
+    return success ? 0 : 1;
+}